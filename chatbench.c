@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "protocol.h"
+
+#define MAX_EVENTS 256
+#define USER_IN_BUF 2048
+#define USER_OUT_BUF 2048
+#define LIST_PIPELINE 8
+#define MAX_BURST 1000
+#define JOIN_TIMEOUT_NS (30ULL * 1000000000ULL)
+#define BENCH_TAG "[cb "
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef enum { USER_IDLE, USER_CONNECTING, USER_JOINING, USER_ACTIVE, USER_CLOSED } user_state_t;
+
+typedef enum { BENCH_BROADCAST, BENCH_PM, BENCH_LIST, BENCH_DELAY, BENCH_OP_COUNT } op_kind_t;
+
+static const char *op_names[BENCH_OP_COUNT] = {"broadcast", "pm", "list", "delay"};
+static const char op_tags[BENCH_OP_COUNT] = {'b', 'p', 'l', 'd'};
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    int fd;
+    int id;
+    user_state_t state;
+    char name[NAME_LEN];
+    char in_buf[USER_IN_BUF];
+    size_t in_len;
+    char out_buf[USER_OUT_BUF];
+    size_t out_len;
+    int want_write;
+    uint64_t list_sent[LIST_PIPELINE];
+    int list_head, list_count;
+} bench_user_t;
+
+volatile sig_atomic_t keep_running = 1;
+
+int epoll_fd = -1;
+bench_user_t *users = NULL;
+int user_count = 100;
+int active_count = 0;
+long total_rate = 100;
+int duration_s = 10;
+int drain_s = 2;
+int connect_rate = 2000;
+int delay_s = 1;
+int payload_size = 32;
+int mix[BENCH_OP_COUNT] = {80, 15, 3, 2};
+int mix_total = 100;
+const char *name_prefix = "bench";
+struct sockaddr_in server_addr;
+uint64_t rng_state;
+
+histogram_t hist[BENCH_OP_COUNT];
+uint64_t ops_sent[BENCH_OP_COUNT];
+uint64_t ops_received[BENCH_OP_COUNT];
+uint64_t out_full = 0;
+uint64_t pm_misses = 0;
+uint64_t connect_failures = 0;
+uint64_t join_failures = 0;
+uint64_t disconnects = 0;
+uint64_t behind = 0;
+
+void handle_sigint(int sig) {
+    (void)sig;
+    keep_running = 0;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t rng_next(void) {
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+/* Log-linear buckets: exact below HIST_SUB, then HIST_SUB steps per power of two (~3% error). */
+int hist_index(uint64_t v) {
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+uint64_t hist_value(int index) {
+    if (index < HIST_SUB) {
+        return (uint64_t)index;
+    }
+    int shift = index / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + index % HIST_SUB) << shift;
+}
+
+void hist_record(histogram_t *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+uint64_t hist_percentile(const histogram_t *h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * (double)h->total);
+    if (rank >= h->total) {
+        rank = h->total - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            uint64_t v = hist_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+void user_close(bench_user_t *u) {
+    if (u->fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, u->fd, NULL);
+        close(u->fd);
+        u->fd = -1;
+    }
+    if (u->state == USER_ACTIVE) {
+        --active_count;
+    }
+    u->state = USER_CLOSED;
+}
+
+void user_watch(bench_user_t *u, int want_write) {
+    if (u->want_write == want_write) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = u;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, u->fd, &ev) == 0) {
+        u->want_write = want_write;
+    }
+}
+
+int user_flush(bench_user_t *u) {
+    size_t off = 0;
+    while (off < u->out_len) {
+        ssize_t n = send(u->fd, u->out_buf + off, u->out_len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    memmove(u->out_buf, u->out_buf + off, u->out_len - off);
+    u->out_len -= off;
+    user_watch(u, u->out_len > 0);
+    return 0;
+}
+
+/* Queues one protocol line. Returns -1 if the user's send buffer is full. */
+int user_send_line(bench_user_t *u, const char *line) {
+    int len = format_line(u->out_buf + u->out_len, USER_OUT_BUF - u->out_len, line);
+    if (len < 0 || (size_t)len >= USER_OUT_BUF - u->out_len) {
+        ++out_full;
+        return -1;
+    }
+    u->out_len += (size_t)len;
+    if (!u->want_write && user_flush(u) < 0) {
+        ++disconnects;
+        user_close(u);
+        return -1;
+    }
+    return 0;
+}
+
+void user_connect(bench_user_t *u) {
+    u->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (u->fd < 0) {
+        perror("socket creation failed");
+        ++connect_failures;
+        u->state = USER_CLOSED;
+        return;
+    }
+    int one = 1;
+    setsockopt(u->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(u->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        ++connect_failures;
+        close(u->fd);
+        u->fd = -1;
+        u->state = USER_CLOSED;
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = u;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, u->fd, &ev) < 0) {
+        perror("epoll_ctl add failed");
+        ++connect_failures;
+        close(u->fd);
+        u->fd = -1;
+        u->state = USER_CLOSED;
+        return;
+    }
+    u->want_write = 1;
+    u->state = USER_CONNECTING;
+}
+
+/* The connect finished: send the name, then a /delays probe whose reply proves we are registered. */
+void user_connected(bench_user_t *u) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        ++connect_failures;
+        user_close(u);
+        return;
+    }
+    int n = format_hello(u->out_buf, USER_OUT_BUF, u->name);
+    u->out_len = (size_t)n;
+    u->state = USER_JOINING;
+    if (user_send_line(u, "/delays") < 0 && u->state == USER_CLOSED) {
+        return;
+    }
+    if (u->want_write && user_flush(u) < 0) {
+        ++connect_failures;
+        user_close(u);
+    }
+}
+
+void record_delivery(op_kind_t kind, uint64_t sent_ns, uint64_t now) {
+    uint64_t latency = now > sent_ns ? now - sent_ns : 0;
+    if (kind == BENCH_DELAY) {
+        uint64_t requested = (uint64_t)delay_s * 1000000000ULL;
+        latency = latency > requested ? latency - requested : requested - latency;
+    }
+    ++ops_received[kind];
+    hist_record(&hist[kind], latency / 1000);
+}
+
+void user_handle_line(bench_user_t *u, char *line, uint64_t now) {
+    if (u->state == USER_JOINING) {
+        if (strstr(line, "already in use") || strstr(line, "Unable to join")) {
+            fprintf(stderr, "%s: %s\n", u->name, line);
+            ++join_failures;
+            user_close(u);
+            return;
+        }
+        u->state = USER_ACTIVE;
+        ++active_count;
+    }
+
+    char *tag = strstr(line, BENCH_TAG);
+    if (tag) {
+        char kind_tag = tag[strlen(BENCH_TAG)];
+        uint64_t sent_ns = strtoull(tag + strlen(BENCH_TAG) + 2, NULL, 10);
+        for (int k = 0; k < BENCH_OP_COUNT; ++k) {
+            if (op_tags[k] == kind_tag) {
+                record_delivery((op_kind_t)k, sent_ns, now);
+                break;
+            }
+        }
+    } else if (strncmp(line, "Server: Connected users:", 24) == 0 && u->list_count > 0) {
+        record_delivery(BENCH_LIST, u->list_sent[u->list_head], now);
+        u->list_head = (u->list_head + 1) % LIST_PIPELINE;
+        --u->list_count;
+    } else if (strncmp(line, "Server: User '", 14) == 0) {
+        ++pm_misses;
+    }
+}
+
+void user_read(bench_user_t *u) {
+    uint64_t now = now_ns();
+    for (;;) {
+        ssize_t n = recv(u->fd, u->in_buf + u->in_len, USER_IN_BUF - 1 - u->in_len, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            if (u->state == USER_JOINING) {
+                ++join_failures;
+            } else {
+                ++disconnects;
+            }
+            user_close(u);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        u->in_len += (size_t)n;
+        u->in_buf[u->in_len] = '\0';
+
+        char *start = u->in_buf;
+        char *nl;
+        while ((nl = strchr(start, '\n')) != NULL) {
+            *nl = '\0';
+            user_handle_line(u, start, now);
+            if (u->state == USER_CLOSED) {
+                return;
+            }
+            start = nl + 1;
+        }
+        u->in_len -= (size_t)(start - u->in_buf);
+        memmove(u->in_buf, start, u->in_len);
+        if (u->in_len == USER_IN_BUF - 1) {
+            u->in_len = 0;
+        }
+    }
+}
+
+op_kind_t pick_op(void) {
+    int r = (int)(rng_next() % (uint64_t)mix_total);
+    for (int k = 0; k < BENCH_OP_COUNT; ++k) {
+        if (r < mix[k]) {
+            return (op_kind_t)k;
+        }
+        r -= mix[k];
+    }
+    return BENCH_BROADCAST;
+}
+
+bench_user_t *pick_peer(bench_user_t *self) {
+    for (int tries = 0; tries < 8; ++tries) {
+        bench_user_t *peer = &users[rng_next() % (uint64_t)user_count];
+        if (peer != self && peer->state == USER_ACTIVE) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+/* Sends one operation from u. Every body carries "[cb <kind> <send time ns>]" for the receiver. */
+void user_send_op(bench_user_t *u, op_kind_t kind) {
+    char line[BUFFER_SIZE];
+    char body[BUFFER_SIZE / 2];
+    uint64_t now = now_ns();
+    int len = snprintf(body, sizeof(body), BENCH_TAG "%c %llu] ", op_tags[kind], (unsigned long long)now);
+    while (len < payload_size && len < (int)sizeof(body) - 1) {
+        body[len++] = 'x';
+    }
+    body[len] = '\0';
+
+    bench_user_t *peer = NULL;
+    if (kind == BENCH_PM || kind == BENCH_DELAY) {
+        peer = pick_peer(u);
+        if (!peer) {
+            kind = BENCH_BROADCAST;
+            body[strlen(BENCH_TAG)] = op_tags[kind];
+        }
+    }
+    switch (kind) {
+    case BENCH_BROADCAST:
+        snprintf(line, sizeof(line), "%s", body);
+        break;
+    case BENCH_PM:
+        snprintf(line, sizeof(line), "/pm %s %s", peer->name, body);
+        break;
+    case BENCH_LIST:
+        if (u->list_count == LIST_PIPELINE) {
+            ++out_full;
+            return;
+        }
+        snprintf(line, sizeof(line), "/list");
+        break;
+    case BENCH_DELAY:
+        snprintf(line, sizeof(line), "/delay %d %s %s", delay_s, peer->name, body);
+        break;
+    default:
+        return;
+    }
+    if (user_send_line(u, line) < 0) {
+        return;
+    }
+    if (kind == BENCH_LIST) {
+        u->list_sent[(u->list_head + u->list_count) % LIST_PIPELINE] = now;
+        ++u->list_count;
+    }
+    ++ops_sent[kind];
+}
+
+void handle_events(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) {
+            perror("epoll_wait failed");
+            keep_running = 0;
+        }
+        return;
+    }
+    for (int i = 0; i < n; ++i) {
+        bench_user_t *u = events[i].data.ptr;
+        if (u->state == USER_CLOSED) {
+            continue;
+        }
+        if (u->state == USER_CONNECTING) {
+            user_connected(u);
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            user_read(u);
+        }
+        if (u->state != USER_CLOSED && (events[i].events & EPOLLOUT)) {
+            if (user_flush(u) < 0) {
+                ++disconnects;
+                user_close(u);
+            }
+        }
+    }
+}
+
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("setrlimit(RLIMIT_NOFILE) failed");
+        }
+    }
+}
+
+int parse_mix(const char *s) {
+    int vals[BENCH_OP_COUNT];
+    int total = 0;
+    const char *p = s;
+    for (int k = 0; k < BENCH_OP_COUNT; ++k) {
+        char *end;
+        errno = 0;
+        long v = strtol(p, &end, 10);
+        if (end == p || errno == ERANGE || v < 0 || v > 1000) {
+            return -1;
+        }
+        vals[k] = (int)v;
+        total += (int)v;
+        if (k < BENCH_OP_COUNT - 1 && *end != ':') {
+            return -1;
+        }
+        if (k == BENCH_OP_COUNT - 1 && *end != '\0') {
+            return -1;
+        }
+        p = end + 1;
+    }
+    if (total == 0) {
+        return -1;
+    }
+    memcpy(mix, vals, sizeof(mix));
+    mix_total = total;
+    return 0;
+}
+
+void print_report(double run_s) {
+    uint64_t sent = 0, received = 0;
+    for (int k = 0; k < BENCH_OP_COUNT; ++k) {
+        sent += ops_sent[k];
+        received += ops_received[k];
+    }
+    printf("\nchatbench: %d users (%d active at end), %.1f s, mix %d:%d:%d:%d, %d byte bodies\n",
+           user_count, active_count, run_s, mix[0], mix[1], mix[2], mix[3], payload_size);
+    printf("sent %llu ops (%.0f/s), received %llu deliveries (%.0f/s)\n",
+           (unsigned long long)sent, run_s > 0 ? sent / run_s : 0.0,
+           (unsigned long long)received, run_s > 0 ? received / run_s : 0.0);
+    printf("%-10s %10s %12s %10s %10s %10s %10s\n", "op", "sent", "delivered", "p50 us", "p99 us", "p999 us", "max us");
+    for (int k = 0; k < BENCH_OP_COUNT; ++k) {
+        printf("%-10s %10llu %12llu %10llu %10llu %10llu %10llu\n", op_names[k],
+               (unsigned long long)ops_sent[k], (unsigned long long)ops_received[k],
+               (unsigned long long)hist_percentile(&hist[k], 0.50),
+               (unsigned long long)hist_percentile(&hist[k], 0.99),
+               (unsigned long long)hist_percentile(&hist[k], 0.999),
+               (unsigned long long)hist[k].max);
+    }
+    printf("delay latency is the distance from the requested %d s.\n", delay_s);
+    printf("connect failures %llu, join failures %llu, disconnects %llu, pm misses %llu, "
+           "send buffer full %llu, pacing misses %llu\n",
+           (unsigned long long)connect_failures, (unsigned long long)join_failures,
+           (unsigned long long)disconnects, (unsigned long long)pm_misses,
+           (unsigned long long)out_full, (unsigned long long)behind);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--users N] [--rate OPS_PER_SEC] [--duration SEC] [--drain SEC]\n"
+                    "       [--mix BROADCAST:PM:LIST:DELAY] [--size BYTES] [--delay SEC]\n"
+                    "       [--connect-rate N] [--prefix NAME] <host> <port>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        {"users", required_argument, NULL, 'u'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"drain", required_argument, NULL, 'w'},
+        {"mix", required_argument, NULL, 'x'},
+        {"size", required_argument, NULL, 'b'},
+        {"delay", required_argument, NULL, 'D'},
+        {"connect-rate", required_argument, NULL, 'c'},
+        {"prefix", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt_c;
+    long val;
+    while ((opt_c = getopt_long(argc, argv, "u:r:d:w:x:b:D:c:p:", long_opts, NULL)) != -1) {
+        switch (opt_c) {
+        case 'u':
+            if ((val = parse_long_arg(optarg, 1, 1000000)) < 0) {
+                fprintf(stderr, "'%s' is not a valid user count (1-1000000).\n", optarg);
+                return 1;
+            }
+            user_count = (int)val;
+            break;
+        case 'r':
+            if ((val = parse_long_arg(optarg, 1, 10000000)) < 0) {
+                fprintf(stderr, "'%s' is not a valid rate (1-10000000 ops/s).\n", optarg);
+                return 1;
+            }
+            total_rate = val;
+            break;
+        case 'd':
+            if ((val = parse_long_arg(optarg, 1, 86400)) < 0) {
+                fprintf(stderr, "'%s' is not a valid duration (1-86400 s).\n", optarg);
+                return 1;
+            }
+            duration_s = (int)val;
+            break;
+        case 'w':
+            if ((val = parse_long_arg(optarg, 0, 3600)) < 0) {
+                fprintf(stderr, "'%s' is not a valid drain time (0-3600 s).\n", optarg);
+                return 1;
+            }
+            drain_s = (int)val;
+            break;
+        case 'x':
+            if (parse_mix(optarg) < 0) {
+                fprintf(stderr, "'%s' is not a valid mix (e.g. 80:15:3:2).\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if ((val = parse_long_arg(optarg, 0, BUFFER_SIZE / 2 - 1)) < 0) {
+                fprintf(stderr, "'%s' is not a valid body size (0-%d).\n", optarg, BUFFER_SIZE / 2 - 1);
+                return 1;
+            }
+            payload_size = (int)val;
+            break;
+        case 'D':
+            if ((val = parse_long_arg(optarg, 1, 86400)) < 0) {
+                fprintf(stderr, "'%s' is not a valid delay (1-86400 s).\n", optarg);
+                return 1;
+            }
+            delay_s = (int)val;
+            break;
+        case 'c':
+            if ((val = parse_long_arg(optarg, 1, 1000000)) < 0) {
+                fprintf(stderr, "'%s' is not a valid connect rate (1-1000000/s).\n", optarg);
+                return 1;
+            }
+            connect_rate = (int)val;
+            break;
+        case 'p':
+            name_prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *hostname = argv[optind];
+    int port = validate_port(argv[optind + 1]);
+    if (port < 0) {
+        fprintf(stderr, "Error: '%s' is not a valid port (1-65535).\n", argv[optind + 1]);
+        return 1;
+    }
+    if (resolve_server(hostname, port, &server_addr) < 0) {
+        fprintf(stderr, "Error: Could not resolve hostname '%s'\n", hostname);
+        herror("gethostbyname");
+        return 1;
+    }
+
+    users = calloc((size_t)user_count, sizeof(*users));
+    if (!users) {
+        perror("Failed to allocate users");
+        return 1;
+    }
+    for (int i = 0; i < user_count; ++i) {
+        bench_user_t *u = &users[i];
+        u->fd = -1;
+        u->id = i;
+        snprintf(u->name, sizeof(u->name), "%s%d", name_prefix, i);
+        const char *name_err = check_client_name(u->name);
+        if (name_err) {
+            fprintf(stderr, "Error: '%s': %s\n", u->name, name_err);
+            return 1;
+        }
+    }
+
+    raise_fd_limit();
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN);
+    rng_state = now_ns() | 1;
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return 1;
+    }
+
+    /* Connect at --connect-rate until every user has joined (or failed). */
+    printf("Connecting %d users to %s:%d...\n", user_count, hostname, port);
+    uint64_t join_start = now_ns();
+    int opened = 0;
+    while (keep_running) {
+        uint64_t now = now_ns();
+        uint64_t due = (now - join_start) * (uint64_t)connect_rate / 1000000000ULL + 1;
+        while (opened < user_count && (uint64_t)opened < due) {
+            user_connect(&users[opened++]);
+        }
+        int settled = 0;
+        for (int i = 0; i < user_count; ++i) {
+            if (users[i].state == USER_ACTIVE || users[i].state == USER_CLOSED) {
+                ++settled;
+            }
+        }
+        if (settled == user_count || now - join_start > JOIN_TIMEOUT_NS) {
+            break;
+        }
+        handle_events(1);
+    }
+    if (active_count == 0) {
+        fprintf(stderr, "No users joined (%llu connect failures, %llu join failures).\n",
+                (unsigned long long)connect_failures, (unsigned long long)join_failures);
+        return 1;
+    }
+    printf("%d users joined in %.2f s. Running for %d s at %ld ops/s...\n",
+           active_count, (now_ns() - join_start) / 1e9, duration_s, total_rate);
+
+    /* Run phase: pace ops across users round-robin so the aggregate matches --rate. */
+    uint64_t run_start = now_ns();
+    uint64_t run_end = run_start + (uint64_t)duration_s * 1000000000ULL;
+    uint64_t issued = 0;
+    int next_user = 0;
+    while (keep_running) {
+        uint64_t now = now_ns();
+        if (now >= run_end) {
+            break;
+        }
+        uint64_t due = (uint64_t)((double)(now - run_start) * (double)total_rate / 1e9);
+        if (due - issued > MAX_BURST) {
+            behind += due - issued - MAX_BURST;
+            issued = due - MAX_BURST;
+        }
+        while (issued < due && active_count > 0) {
+            bench_user_t *u = &users[next_user];
+            next_user = (next_user + 1) % user_count;
+            if (u->state != USER_ACTIVE) {
+                continue;
+            }
+            user_send_op(u, pick_op());
+            ++issued;
+        }
+        handle_events(1);
+    }
+    double run_s = (now_ns() - run_start) / 1e9;
+
+    /* Drain phase: keep reading so in-flight deliveries (and delays) are counted. */
+    uint64_t drain_end = now_ns() + (uint64_t)(drain_s + (mix[BENCH_DELAY] ? delay_s : 0)) * 1000000000ULL;
+    while (keep_running && now_ns() < drain_end) {
+        handle_events(10);
+    }
+
+    print_report(run_s);
+
+    for (int i = 0; i < user_count; ++i) {
+        if (users[i].fd >= 0) {
+            close(users[i].fd);
+        }
+    }
+    close(epoll_fd);
+    free(users);
+    return 0;
+}
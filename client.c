@@ -7,36 +7,156 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <signal.h>
-#include <ctype.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "protocol.h"
 
-#define BUFFER_SIZE 1024
-#define NAME_LEN 32
+#define PIPE_BUFFER_SIZE 65536
 
-char *trimwhitespace(char *str);
 volatile sig_atomic_t keep_running = 1;
 int sock = -1;
+int binary_mode = 0;
+int pipe_mode = 0;
+int framed_output = 0;
+int flush_ms = 5;
+/* Status and usage messages; in pipe mode they go to stderr so stdout only carries chat. */
+FILE *info;
 
 void handle_sigint(int sig) {
     keep_running = 0;
-    printf("\nCtrl+C detected. Shutting down...\n");
+    fprintf(info, "\nCtrl+C detected. Shutting down...\n");
     if (sock >= 0) {
         shutdown(sock, SHUT_WR);
     }
 }
 
+void print_frame(uint8_t op, const unsigned char *payload, size_t len) {
+    frame_reader_t r = {payload, len, 0};
+    char name[NAME_LEN];
+    static char text[FRAME_MAX_REPLY + 1];
+    uint32_t id;
+
+    switch (op) {
+    case OP_WELCOME:
+        id = frame_get_u32(&r);
+        frame_get_name(&r, name);
+        printf("Server: Joined as %s (id %u).\n", name, id);
+        break;
+    case OP_MESSAGE:
+    case OP_PRIVATE:
+        frame_get_u32(&r);
+        frame_get_name(&r, name);
+        frame_get_text(&r, text, sizeof(text));
+        printf(op == OP_MESSAGE ? "%s: %s\n" : "(PM from %s): %s\n", name, text);
+        break;
+    case OP_NOTICE:
+        frame_get_text(&r, text, sizeof(text));
+        printf("%s\n", text);
+        break;
+    case OP_USERS: {
+        uint32_t count = frame_get_u32(&r);
+        printf("Server: Connected users:\n");
+        for (uint32_t i = 0; i < count && !r.error; ++i) {
+            id = frame_get_u32(&r);
+            frame_get_name(&r, name);
+            if (!r.error) {
+                printf("- %s (id %u)\n", name, id);
+            }
+        }
+        uint32_t total = frame_get_u32(&r);
+        uint32_t page = frame_get_u32(&r);
+        uint32_t pages = frame_get_u32(&r);
+        if (!r.error && pages > 1) {
+            printf("Server: Page %u of %u, %u users.\n", page, pages, total);
+        }
+        break;
+    }
+    case OP_PRESENCE: {
+        char node[NAME_LEN];
+        id = frame_get_u32(&r);
+        frame_get_name(&r, name);
+        if (r.len < 1) {
+            r.error = 1;
+            break;
+        }
+        int joined = r.p[0];
+        r.p++;
+        r.len--;
+        frame_get_name(&r, node);
+        if (r.error) {
+            break;
+        }
+        if (node[0]) {
+            printf("Server: %s: %s (on %s)\n", joined ? "Online" : "Offline", name, node);
+        } else {
+            printf("Server: %s: %s (id %u)\n", joined ? "Online" : "Offline", name, id);
+        }
+        break;
+    }
+    default:
+        printf("Server: Unknown frame 0x%02x (%zu bytes).\n", op, len);
+        break;
+    }
+}
+
+/* Interactive output is flushed on every read. Pipe mode only flushes once the socket has
+ * nothing more waiting, so a busy room is written out in large blocks. */
+void flush_output(int sockfd) {
+    struct pollfd p = {sockfd, POLLIN, 0};
+    if (!pipe_mode || poll(&p, 1, 0) == 0) {
+        fflush(stdout);
+    }
+}
+
+/* Reads whole frames into one buffer and prints each as the text protocol would show it. */
+int recv_frames(int sockfd) {
+    static unsigned char buffer[FRAME_HEADER_LEN + FRAME_MAX_REPLY];
+    size_t len = 0;
+    int nbytes = 0;
+
+    while (keep_running && (nbytes = recv(sockfd, buffer + len, sizeof(buffer) - len, 0)) > 0) {
+        len += nbytes;
+        size_t off = 0;
+        while (len - off >= FRAME_HEADER_LEN) {
+            uint32_t payload = frame_get_be32(buffer + off);
+            if (payload > FRAME_MAX_REPLY) {
+                fprintf(stderr, "\nServer sent an oversized frame.\n");
+                return -1;
+            }
+            if (len - off < FRAME_HEADER_LEN + payload) {
+                break;
+            }
+            print_frame(buffer[off + 4], buffer + off + FRAME_HEADER_LEN, payload);
+            off += FRAME_HEADER_LEN + payload;
+        }
+        memmove(buffer, buffer + off, len - off);
+        len -= off;
+        flush_output(sockfd);
+    }
+    return nbytes;
+}
+
 void *recv_handler(void *arg) {
     int sockfd = *(int *)arg;
-    char buffer[BUFFER_SIZE];
-    int nbytes;
+    static char buffer[PIPE_BUFFER_SIZE];
+    int nbytes = 0;
 
-    while (keep_running && (nbytes = recv(sockfd, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[nbytes] = '\0';
-        printf("%s", buffer);
-        fflush(stdout);
+    if (binary_mode && !framed_output) {
+        nbytes = recv_frames(sockfd);
+    } else {
+        /* Text lines, or with --framed the server's frames, are passed through unchanged. */
+        while (keep_running && (nbytes = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
+            fwrite(buffer, 1, nbytes, stdout);
+            flush_output(sockfd);
+        }
     }
+    fflush(stdout);
 
     if (nbytes == 0 && keep_running) {
-        printf("\nServer disconnected.\n");
+        fprintf(info, "\nServer disconnected.\n");
     } else if (nbytes < 0 && errno != EINTR && keep_running) {
         perror("\nrecv failed");
     }
@@ -45,48 +165,259 @@ void *recv_handler(void *arg) {
     return NULL;
 }
 
-int validate_port(const char *s) {
-    char *end;
-    errno = 0;
-    long v = strtol(s, &end, 10);
-    if (end == s || *end != '\0' || errno == ERANGE || v < 1 || v > 65535) {
-        return -1;
+/* "<who>" in /pm and /delay is a name, or "#<id>" for a numeric user id. */
+void put_recipient(frame_writer_t *w, const char *who) {
+    if (who[0] == '#') {
+        frame_put_u32(w, (uint32_t)strtoul(who + 1, NULL, 10));
+        frame_put_name(w, "");
+    } else {
+        frame_put_u32(w, 0);
+        frame_put_name(w, who);
     }
-    return (int)v;
+}
+
+/* Encodes one input line as a frame; commands without a dedicated opcode go as OP_COMMAND. */
+int encode_input(char *line, unsigned char *buf, size_t cap) {
+    frame_writer_t w;
+    char *saveptr;
+
+    if (line[0] != '/') {
+        frame_begin(&w, buf, cap, OP_SAY);
+        frame_put_bytes(&w, line, strlen(line));
+    } else if (strcmp(line, "/list") == 0) {
+        frame_begin(&w, buf, cap, OP_LIST);
+    } else if (strncmp(line, "/pm ", 4) == 0 || strncmp(line, "/send ", 6) == 0) {
+        char *who = strtok_r(line + (line[1] == 'p' ? 4 : 6), " ", &saveptr);
+        char *msg = trimwhitespace(saveptr);
+        if (!who || !*msg) {
+            fprintf(info, "Usage: /pm <user|#id> <message>\n");
+            return 0;
+        }
+        frame_begin(&w, buf, cap, OP_PM);
+        put_recipient(&w, who);
+        frame_put_bytes(&w, msg, strlen(msg));
+    } else if (strncmp(line, "/delay ", 7) == 0) {
+        char *secs = strtok_r(line + 7, " ", &saveptr);
+        char *who = strtok_r(NULL, " ", &saveptr);
+        char *msg = trimwhitespace(saveptr);
+        long delay = secs ? parse_long_arg(secs, 1, UINT32_MAX) : -1;
+        if (!who || delay < 0 || !*msg) {
+            fprintf(info, "Usage: /delay <seconds> <user|#id> <message>\n");
+            return 0;
+        }
+        frame_begin(&w, buf, cap, OP_DELAY);
+        frame_put_u32(&w, (uint32_t)delay);
+        put_recipient(&w, who);
+        frame_put_bytes(&w, msg, strlen(msg));
+    } else {
+        frame_begin(&w, buf, cap, OP_COMMAND);
+        frame_put_bytes(&w, line, strlen(line));
+    }
+    return frame_end(&w);
+}
+
+#define LINE_SKIP 0
+#define LINE_TOO_LONG -1
+#define LINE_QUIT -2
+
+/* Turns one input line into the bytes to send. Returns their length or one of LINE_*. */
+int encode_line(char *line, char *buf, size_t cap) {
+    char *trimmed_input = trimwhitespace(line);
+    int len;
+
+    if (strlen(trimmed_input) == 0) {
+        return LINE_SKIP;
+    }
+    if (strcmp(trimmed_input, "/quit") == 0 || strcmp(trimmed_input, "/exit") == 0) {
+        return LINE_QUIT;
+    }
+    if (binary_mode) {
+        len = encode_input(trimmed_input, (unsigned char *)buf, cap);
+    } else {
+        len = format_line(buf, cap, trimmed_input);
+        if (len >= (int)cap) {
+            len = -1;
+        }
+    }
+    return len < 0 ? LINE_TOO_LONG : len;
+}
+
+int send_all(int sockfd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, buf, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Pipe mode: stdin is read in large blocks and the encoded lines are collected in one
+ * buffer. It is sent when it fills up, or once flush_ms have passed since its first line
+ * was added.
+ */
+void pipe_input_loop(void) {
+    static char in[PIPE_BUFFER_SIZE];
+    static char out[PIPE_BUFFER_SIZE];
+    char line_buf[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+    size_t in_len = 0, out_len = 0;
+    uint64_t deadline = 0;
+    int eof = 0, quit = 0, failed = 0;
+
+    while (keep_running && !eof && !quit && !failed) {
+        int timeout = -1;
+        if (out_len > 0) {
+            uint64_t now = now_ms();
+            timeout = deadline > now ? (int)(deadline - now) : 0;
+        }
+        struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+        int ready = poll(&p, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll failed");
+            break;
+        }
+        if (ready == 0) {
+            failed = send_all(sock, out, out_len) < 0;
+            out_len = 0;
+            continue;
+        }
+        if (ready < 0) {
+            continue;
+        }
+
+        ssize_t n = read(STDIN_FILENO, in + in_len, sizeof(in) - in_len);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("read failed");
+                break;
+            }
+            continue;
+        }
+        if (n == 0) {
+            eof = 1;
+            if (in_len > 0 && in_len < sizeof(in)) {
+                in[in_len++] = '\n';
+            }
+        }
+        in_len += n;
+
+        char *start = in, *end = in + in_len, *nl;
+        while (!quit && !failed && (nl = memchr(start, '\n', end - start)) != NULL) {
+            *nl = '\0';
+            int len = encode_line(start, line_buf, sizeof(line_buf));
+            start = nl + 1;
+            if (len == LINE_QUIT) {
+                quit = 1;
+            } else if (len == LINE_TOO_LONG) {
+                fprintf(stderr, "Message too long.\n");
+            } else if (len > 0) {
+                if (out_len + len > sizeof(out)) {
+                    failed = send_all(sock, out, out_len) < 0;
+                    out_len = 0;
+                }
+                if (out_len == 0) {
+                    deadline = now_ms() + flush_ms;
+                }
+                memcpy(out + out_len, line_buf, len);
+                out_len += len;
+            }
+        }
+        in_len = end - start;
+        memmove(in, start, in_len);
+        if (in_len == sizeof(in)) {
+            fprintf(stderr, "Message too long.\n");
+            in_len = 0;
+        }
+        /* Under continuous input poll() never times out, so the deadline is checked here too. */
+        if (!failed && out_len > 0 && now_ms() >= deadline) {
+            failed = send_all(sock, out, out_len) < 0;
+            out_len = 0;
+        }
+    }
+
+    if (!failed && out_len > 0) {
+        failed = send_all(sock, out, out_len) < 0;
+    }
+    if (failed && keep_running) {
+        perror("send failed");
+    }
+    keep_running = 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--binary] [--pipe] [--flush-ms MS] [--framed] <name> <host> <port>\n", prog);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s <name> <host> <port>\n", argv[0]);
+    static const struct option long_opts[] = {
+        {"binary", no_argument, NULL, 'b'},
+        {"pipe", no_argument, NULL, 'p'},
+        {"flush-ms", required_argument, NULL, 'f'},
+        {"framed", no_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt_c;
+    long val;
+    info = stdout;
+    while ((opt_c = getopt_long(argc, argv, "bpf:F", long_opts, NULL)) != -1) {
+        switch (opt_c) {
+        case 'b':
+            binary_mode = 1;
+            break;
+        case 'p':
+            pipe_mode = 1;
+            break;
+        case 'f':
+            if ((val = parse_long_arg(optarg, 0, 10000)) < 0) {
+                fprintf(stderr, "'%s' is not a valid flush delay (0-10000 ms).\n", optarg);
+                return 1;
+            }
+            flush_ms = (int)val;
+            break;
+        case 'F':
+            framed_output = 1;
+            binary_mode = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
         return 1;
     }
+    argv += optind - 1;
 
     char *client_name = argv[1];
     char *hostname = argv[2];
     int port = validate_port(argv[3]);
 
-    if (strlen(client_name) == 0) {
-        fprintf(stderr, "Error: Name cannot be empty.\n");
+    const char *name_err = check_client_name(client_name);
+    if (name_err) {
+        fprintf(stderr, "Error: %s\n", name_err);
         return 1;
     }
-    if (strlen(client_name) >= NAME_LEN) {
-        fprintf(stderr, "Error: Name is too long (max %d characters).\n", NAME_LEN - 1);
-        return 1;
-    }
-    for (char *p = client_name; *p; p++) {
-        if (isspace((unsigned char)*p)) {
-            fprintf(stderr, "Error: Name cannot contain whitespace.\n");
-            return 1;
-        }
-    }
 
     if (port < 0) {
         fprintf(stderr, "Error: '%s' is not a valid port (1-65535).\n", argv[3]);
         return 1;
     }
 
-    struct hostent *he = gethostbyname(hostname);
-    if (!he) {
+    struct sockaddr_in server_addr;
+    if (resolve_server(hostname, port, &server_addr) < 0) {
         fprintf(stderr, "Error: Could not resolve hostname '%s'\n", hostname);
         herror("gethostbyname");
         return 1;
@@ -98,12 +429,6 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr, he->h_addr_list[0], he->h_length);
-
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("connect failed");
         close(sock);
@@ -111,10 +436,22 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    printf("Connected to server '%s' on port %d as '%s'.\n", hostname, port, client_name);
+    if (pipe_mode) {
+        /* Lines are already coalesced here, so the kernel should not hold them back as well. */
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        info = stderr;
+        setvbuf(stdout, NULL, _IOFBF, PIPE_BUFFER_SIZE);
+    }
+
+    fprintf(info, "Connected to server '%s' on port %d as '%s'.\n", hostname, port, client_name);
 
-    char name_msg[NAME_LEN + 1];
-    snprintf(name_msg, sizeof(name_msg), "%s\n", client_name);
+    char name_msg[NAME_LEN + sizeof(BINARY_HELLO)];
+    if (binary_mode) {
+        snprintf(name_msg, sizeof(name_msg), "%s%s\n", BINARY_HELLO, client_name);
+    } else {
+        format_hello(name_msg, sizeof(name_msg), client_name);
+    }
     if (send(sock, name_msg, strlen(name_msg), 0) < 0) {
         perror("failed to send client name");
         close(sock);
@@ -133,7 +470,11 @@ int main(int argc, char *argv[]) {
     }
 
     char input_buffer[BUFFER_SIZE];
-    printf("Enter messages or commands (/list, /pm <user> <msg>, /delay <sec> <user> <msg>, /quit):\n");
+    if (pipe_mode) {
+        pipe_input_loop();
+    } else {
+        printf("Enter messages or commands (/list, /pm <user> <msg>, /delay <sec> <user> <msg>, /quit):\n");
+    }
     while (keep_running) {
         if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL) {
             if (feof(stdin)) {
@@ -146,21 +487,22 @@ int main(int argc, char *argv[]) {
         }
 
         input_buffer[strcspn(input_buffer, "\n")] = 0;
-        char *trimmed_input = trimwhitespace(input_buffer);
 
-        if (trimmed_input == NULL || strlen(trimmed_input) == 0) {
-            continue;
-        }
-
-        if (strcmp(trimmed_input, "/quit") == 0 || strcmp(trimmed_input, "/exit") == 0) {
+        char send_buf[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+        int send_len = encode_line(input_buffer, send_buf, sizeof(send_buf));
+        if (send_len == LINE_QUIT) {
             keep_running = 0;
             break;
         }
+        if (send_len == LINE_SKIP) {
+            continue;
+        }
+        if (send_len == LINE_TOO_LONG) {
+            printf("Message too long.\n");
+            continue;
+        }
 
-        char send_buf[BUFFER_SIZE + 1];
-        snprintf(send_buf, sizeof(send_buf), "%s\n", trimmed_input);
-
-        if (keep_running && send(sock, send_buf, strlen(send_buf), 0) < 0) {
+        if (keep_running && send(sock, send_buf, send_len, 0) < 0) {
             if (errno != EPIPE && keep_running) {
                 perror("send failed");
             } else if (keep_running) {
@@ -171,7 +513,7 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    printf("Disconnecting...\n");
+    fprintf(info, "Disconnecting...\n");
     if (sock >= 0) {
         shutdown(sock, SHUT_WR);
     }
@@ -183,17 +525,6 @@ int main(int argc, char *argv[]) {
         sock = -1;
     }
 
-    printf("Exited.\n");
+    fprintf(info, "Exited.\n");
     return 0;
 }
-
-char *trimwhitespace(char *str) {
-    if (str == NULL) return NULL;
-    char *end;
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == 0) return str;
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    return str;
-}
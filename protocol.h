@@ -0,0 +1,219 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define BUFFER_SIZE 1024
+#define NAME_LEN 32
+
+/*
+ * Binary protocol. A client opts in by sending "/binary <name>" as its handshake line
+ * instead of the bare name; from then on both directions carry frames:
+ *
+ *   u32 payload length (big-endian) | u8 opcode | payload
+ *
+ * Ids are the numeric user ids the server assigns (0 = none). A "name" field is a u8
+ * length followed by that many bytes. Text fields run to the end of the payload and may
+ * contain newlines.
+ */
+#define BINARY_HELLO "/binary "
+#define FRAME_HEADER_LEN 5
+#define FRAME_MAX_PAYLOAD BUFFER_SIZE
+#define FRAME_MAX_REPLY 65536
+
+enum {
+    OP_SAY = 0x01,      /* text                                       */
+    OP_PM = 0x02,       /* u32 id, name (used when id is 0), text      */
+    OP_LIST = 0x03,     /* (empty), or u32 page, optional name prefix  */
+    OP_DELAY = 0x04,    /* u32 seconds, u32 id, name, text            */
+    OP_COMMAND = 0x05,  /* any other text command, e.g. "/delays"      */
+    OP_WELCOME = 0x81,  /* u32 your id, name                          */
+    OP_MESSAGE = 0x82,  /* u32 sender id, sender name, text            */
+    OP_PRIVATE = 0x83,  /* u32 sender id, sender name, text            */
+    OP_NOTICE = 0x84,   /* text from the server                       */
+    OP_USERS = 0x85,    /* u32 count, then count x (u32 id, name), then
+                           u32 matching users, u32 page, u32 pages     */
+    OP_PRESENCE = 0x86  /* u32 id, name, u8 1 joined / 0 left, node name
+                           (empty on this node); sent after /watch     */
+};
+
+/*
+ * Server-to-server links (--link-port, --peer) use the same framing. Both sides open with
+ * LINK_HELLO. Every other frame starts with the name of the node it describes, and a node
+ * only ever sends its own events, so nothing is relayed.
+ */
+enum {
+    LINK_HELLO = 0x41,  /* node name                                     */
+    LINK_JOIN = 0x42,   /* node name, user name                          */
+    LINK_PART = 0x43,   /* node name, user name                          */
+    LINK_SAY = 0x44,    /* node name, room, sender name, u8 keep history, text */
+    LINK_PM = 0x45      /* node name, sender name, recipient name, text  */
+};
+
+typedef struct {
+    unsigned char *buf;
+    size_t cap;
+    size_t len;
+} frame_writer_t;
+
+typedef struct {
+    const unsigned char *p;
+    size_t len;
+    int error;
+} frame_reader_t;
+
+static inline char *trimwhitespace(char *str) {
+    if (str == NULL) return NULL;
+    char *end;
+    while (isspace((unsigned char)*str)) str++;
+    if (*str == 0) return str;
+    end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) end--;
+    end[1] = '\0';
+    return str;
+}
+
+static inline int validate_port(const char *s) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno == ERANGE || v < 1 || v > 65535) {
+        return -1;
+    }
+    return (int)v;
+}
+
+static inline long parse_long_arg(const char *s, long min, long max) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno == ERANGE || v < min || v > max) {
+        return -1;
+    }
+    return v;
+}
+
+/* Returns NULL if the server will accept name, otherwise a description of the problem. */
+static inline const char *check_client_name(const char *name) {
+    if (strlen(name) == 0) {
+        return "Name cannot be empty.";
+    }
+    if (strlen(name) >= NAME_LEN) {
+        return "Name is too long (max 31 characters).";
+    }
+    for (const char *p = name; *p; p++) {
+        if (isspace((unsigned char)*p)) {
+            return "Name cannot contain whitespace.";
+        }
+    }
+    return NULL;
+}
+
+static inline int resolve_server(const char *hostname, int port, struct sockaddr_in *addr) {
+    struct hostent *he = gethostbyname(hostname);
+    if (!he) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    memcpy(&addr->sin_addr, he->h_addr_list[0], he->h_length);
+    return 0;
+}
+
+/* The handshake is the bare name on its own line; every later line is a message or a command. */
+static inline int format_hello(char *buf, size_t size, const char *name) {
+    return snprintf(buf, size, "%s\n", name);
+}
+
+static inline int format_line(char *buf, size_t size, const char *line) {
+    return snprintf(buf, size, "%s\n", line);
+}
+
+static inline uint32_t frame_get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void frame_begin(frame_writer_t *w, unsigned char *buf, size_t cap, uint8_t op) {
+    w->buf = buf;
+    w->cap = cap;
+    w->len = FRAME_HEADER_LEN;
+    if (cap >= FRAME_HEADER_LEN) {
+        buf[4] = op;
+    }
+}
+
+static inline void frame_put_bytes(frame_writer_t *w, const void *data, size_t len) {
+    if (w->len + len <= w->cap) {
+        memcpy(w->buf + w->len, data, len);
+    }
+    w->len += len;
+}
+
+static inline void frame_put_u32(frame_writer_t *w, uint32_t v) {
+    unsigned char b[4] = {v >> 24, v >> 16, v >> 8, v};
+    frame_put_bytes(w, b, 4);
+}
+
+static inline void frame_put_name(frame_writer_t *w, const char *name) {
+    size_t len = strnlen(name, NAME_LEN - 1);
+    unsigned char n = (unsigned char)len;
+    frame_put_bytes(w, &n, 1);
+    frame_put_bytes(w, name, len);
+}
+
+/* Fills in the length; returns the frame size, or -1 if it did not fit in the buffer. */
+static inline int frame_end(frame_writer_t *w) {
+    if (w->len > w->cap) {
+        return -1;
+    }
+    uint32_t payload = (uint32_t)(w->len - FRAME_HEADER_LEN);
+    w->buf[0] = payload >> 24;
+    w->buf[1] = payload >> 16;
+    w->buf[2] = payload >> 8;
+    w->buf[3] = payload;
+    return (int)w->len;
+}
+
+static inline uint32_t frame_get_u32(frame_reader_t *r) {
+    if (r->len < 4) {
+        r->error = 1;
+        return 0;
+    }
+    uint32_t v = frame_get_be32(r->p);
+    r->p += 4;
+    r->len -= 4;
+    return v;
+}
+
+static inline void frame_get_name(frame_reader_t *r, char name[NAME_LEN]) {
+    size_t len = r->len > 0 ? r->p[0] : 0;
+    if (r->len < 1 + len || len >= NAME_LEN) {
+        r->error = 1;
+        name[0] = '\0';
+        return;
+    }
+    memcpy(name, r->p + 1, len);
+    name[len] = '\0';
+    r->p += 1 + len;
+    r->len -= 1 + len;
+}
+
+/* Copies the rest of the payload as a NUL-terminated string (truncated to size - 1). */
+static inline size_t frame_get_text(frame_reader_t *r, char *text, size_t size) {
+    size_t len = r->len < size - 1 ? r->len : size - 1;
+    memcpy(text, r->p, len);
+    text[len] = '\0';
+    r->p += r->len;
+    r->len = 0;
+    return len;
+}
+
+#endif
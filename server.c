@@ -1,395 +1,7731 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <errno.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-#include <ctype.h>
-
-#define MAX_CLIENTS 50
-#define BUFFER_SIZE 1024
-#define NAME_LEN 32
-
-typedef struct {
-    int sockfd;
-    char name[NAME_LEN];
-    struct sockaddr_in addr;
-} client_t;
-
-typedef struct {
-    int delay;
-    char sender_name[NAME_LEN];
-    char recipient_name[NAME_LEN];
-    char message[BUFFER_SIZE];
-} delay_args_t;
-
-client_t *clients[MAX_CLIENTS];
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-void add_client(client_t *cl) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i]) {
-            clients[i] = cl;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-void remove_client(int sockfd) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i] && clients[i]->sockfd == sockfd) {
-            clients[i] = NULL;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-void broadcast(int sender_sockfd, const char *sender_name, const char *message) {
-    char send_buffer[BUFFER_SIZE + NAME_LEN + 3];
-    snprintf(send_buffer, sizeof(send_buffer), "%s: %s\n", sender_name, message);
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i] && clients[i]->sockfd != sender_sockfd) {
-            send(clients[i]->sockfd, send_buffer, strlen(send_buffer), 0);
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-void send_private_message(int sender_sockfd, const char* sender_name, const char *recipient_name, const char *message) {
-    char send_buffer[BUFFER_SIZE + NAME_LEN + 10];
-    char error_buffer[BUFFER_SIZE];
-    int recipient_sockfd = -1;
-    int found = 0;
-
-    if (message == NULL || strlen(message) == 0) {
-        if (sender_sockfd > 0) {
-            send(sender_sockfd, "Server: Cannot send an empty private message.\n", 44, 0);
-        }
-        return;
-    }
-
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i] && strcmp(clients[i]->name, recipient_name) == 0) {
-            recipient_sockfd = clients[i]->sockfd;
-            found = 1;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-
-    if (found && recipient_sockfd > 0) {
-        if (sender_sockfd > 0 && recipient_sockfd == sender_sockfd) {
-            send(sender_sockfd, "Server: You cannot send a PM to yourself.\n", 41, 0);
-            return;
-        }
-        snprintf(send_buffer, sizeof(send_buffer), "(PM from %s): %s\n", sender_name, message);
-        if (send(recipient_sockfd, send_buffer, strlen(send_buffer), 0) < 0) {
-            perror("pm send failed");
-            if (sender_sockfd > 0) {
-                snprintf(error_buffer, sizeof(error_buffer), "Server: Failed to send PM to %s.\n", recipient_name);
-                send(sender_sockfd, error_buffer, strlen(error_buffer), 0);
-            }
-        }
-    } else {
-        if (sender_sockfd > 0) {
-            snprintf(error_buffer, sizeof(error_buffer), "Server: User '%s' not found or is offline.\n", recipient_name);
-            send(sender_sockfd, error_buffer, strlen(error_buffer), 0);
-        } else {
-            printf("Server: Delayed PM recipient '%s' not found for message from %s.\n", recipient_name, sender_name);
-            fflush(stdout);
-        }
-    }
-}
-
-void list_clients(int requester_sockfd) {
-    char list_buffer[BUFFER_SIZE] = "Server: Connected users:\n";
-    int current_len = strlen(list_buffer);
-    int count = 0;
-
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i]) {
-            ++count;
-            int needed = snprintf(list_buffer + current_len, sizeof(list_buffer) - current_len, "- %s\n", clients[i]->name);
-            if (needed < 0 || needed >= sizeof(list_buffer) - current_len) {
-                strcat(list_buffer, "- ... (list truncated)\n");
-                break;
-            }
-            current_len += needed;
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-
-    if (count == 0) {
-        strcat(list_buffer, "(No users connected)\n");
-    }
-    send(requester_sockfd, list_buffer, strlen(list_buffer), 0);
-}
-
-char *trimwhitespace(char *str) {
-    if (str == NULL) return NULL;
-    char *end;
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == 0) return str;
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    return str;
-}
-
-void *delay_handler(void *arg) {
-    delay_args_t *d_args = (delay_args_t *)arg;
-    sleep(d_args->delay);
-    printf("Server: Executing delayed PM from %s to %s after %d seconds.\n",
-           d_args->sender_name, d_args->recipient_name, d_args->delay);
-    fflush(stdout);
-    send_private_message(0, d_args->sender_name, d_args->recipient_name, d_args->message);
-    free(d_args);
-    return NULL;
-}
-
-void *handle_client(void *arg) {
-    client_t *cli = (client_t *)arg;
-    char buffer[BUFFER_SIZE];
-    char message_buffer[BUFFER_SIZE * 2] = {0};
-    int nbytes;
-    int buffer_len = 0;
-
-    printf("Client joined: %s (%s:%d) with fd %d\n", cli->name,
-           inet_ntoa(cli->addr.sin_addr), ntohs(cli->addr.sin_port), cli->sockfd);
-    snprintf(buffer, sizeof(buffer), "Server: %s joined the chat room.\n", cli->name);
-    broadcast(cli->sockfd, "Server", cli->name);
-
-    while ((nbytes = recv(cli->sockfd, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[nbytes] = '\0';
-        if (buffer_len + nbytes < sizeof(message_buffer)) {
-            memcpy(message_buffer + buffer_len, buffer, nbytes);
-            buffer_len += nbytes;
-            message_buffer[buffer_len] = '\0';
-        } else {
-            fprintf(stderr, "Client %s message buffer overflow, discarding data.\n", cli->name);
-            buffer_len = 0;
-            message_buffer[0] = '\0';
-            continue;
-        }
-
-        char *line_start = message_buffer;
-        char *newline_pos;
-        while ((newline_pos = strchr(line_start, '\n')) != NULL) {
-            *newline_pos = '\0';
-            char *current_line = trimwhitespace(line_start);
-            if (*current_line) {
-                printf("Received from %s: %s\n", cli->name, current_line);
-                if (current_line[0] == '/') {
-                    if (strcmp(current_line, "/list") == 0) {
-                        list_clients(cli->sockfd);
-                    } else if (strncmp(current_line, "/pm ", 4) == 0 || strncmp(current_line, "/send ", 6) == 0) {
-                        char *saveptr = current_line;
-                        char *recipient = strtok_r(saveptr + (current_line[1]=='p'?4:6), " ", &saveptr);
-                        char *msg = saveptr;
-                        if (recipient && *recipient) {
-                            msg = trimwhitespace(msg);
-                            if (*msg) {
-                                send_private_message(cli->sockfd, cli->name, recipient, msg);
-                            } else {
-                                send(cli->sockfd, "Server: Usage /pm <recipient> <message>\n", 38, 0);
-                            }
-                        } else {
-                            send(cli->sockfd, "Server: Usage /pm <recipient> <message>\n", 38, 0);
-                        }
-                    } else if (strncmp(current_line, "/delay ", 7) == 0) {
-                        char *saveptr = current_line;
-                        char *time_str = strtok_r(saveptr + 7, " ", &saveptr);
-                        char *recipient = strtok_r(NULL, " ", &saveptr);
-                        char *msg = saveptr;
-                        if (time_str && recipient && *time_str && *recipient) {
-                            char *endptr;
-                            errno = 0;
-                            long delay_val = strtol(time_str, &endptr, 10);
-                            if (!errno && *endptr=='\0' && delay_val>0 && delay_val<=86400) {
-                                msg = trimwhitespace(msg);
-                                if (*msg) {
-                                    delay_args_t *d = malloc(sizeof(delay_args_t));
-                                    if (d) {
-                                        d->delay = (int)delay_val;
-                                        strncpy(d->sender_name, cli->name, NAME_LEN-1);
-                                        d->sender_name[NAME_LEN-1] = '\0';
-                                        strncpy(d->recipient_name, recipient, NAME_LEN-1);
-                                        d->recipient_name[NAME_LEN-1] = '\0';
-                                        strncpy(d->message, msg, BUFFER_SIZE-1);
-                                        d->message[BUFFER_SIZE-1] = '\0';
-                                        pthread_t tid;
-                                        if (pthread_create(&tid, NULL, delay_handler, d) == 0) {
-                                            pthread_detach(tid);
-                                            char confirm[100];
-                                            snprintf(confirm, sizeof(confirm),
-                                                     "Server: Message to %s scheduled in %ld seconds.\n",
-                                                     recipient, delay_val);
-                                            send(cli->sockfd, confirm, strlen(confirm), 0);
-                                        } else {
-                                            free(d);
-                                            send(cli->sockfd, "Server: Failed to schedule message.\n", 35, 0);
-                                        }
-                                    } else {
-                                        send(cli->sockfd, "Server: Internal error processing delay.\n", 39, 0);
-                                    }
-                                } else {
-                                    send(cli->sockfd, "Server: Usage /delay <time_seconds> <recipient> <message>\n", 60, 0);
-                                }
-                            } else {
-                                send(cli->sockfd, "Server: Invalid time (must be positive integer seconds, max 86400).\n", 70, 0);
-                            }
-                        } else {
-                            send(cli->sockfd, "Server: Usage /delay <time_seconds> <recipient> <message>\n", 60, 0);
-                        }
-                    } else {
-                        send(cli->sockfd, "Server: Unknown command.\n", 24, 0);
-                    }
-                } else {
-                    broadcast(cli->sockfd, cli->name, current_line);
-                }
-            }
-            line_start = newline_pos + 1;
-        }
-        if (line_start < message_buffer + buffer_len) {
-            memmove(message_buffer, line_start, buffer_len - (line_start - message_buffer));
-            buffer_len -= (line_start - message_buffer);
-            message_buffer[buffer_len] = '\0';
-        } else {
-            buffer_len = 0;
-            message_buffer[0] = '\0';
-        }
-    }
-
-    if (nbytes == 0) {
-        printf("Client disconnected: %s (fd %d)\n", cli->name, cli->sockfd);
-        snprintf(buffer, sizeof(buffer), "Server: %s left the chat room.\n", cli->name);
-        broadcast(cli->sockfd, "Server", cli->name);
-    } else {
-        perror("recv failed");
-        printf("Client error: %s (fd %d)\n", cli->name, cli->sockfd);
-        snprintf(buffer, sizeof(buffer), "Server: %s left due to an error.\n", cli->name);
-        broadcast(cli->sockfd, "Server", cli->name);
-    }
-
-    close(cli->sockfd);
-    remove_client(cli->sockfd);
-    free(cli);
-    pthread_detach(pthread_self());
-    return NULL;
-}
-
-int validate_port(const char *s) {
-    char *end;
-    errno = 0;
-    long v = strtol(s, &end, 10);
-    if (end == s || *end != '\0' || errno == ERANGE || v < 1 || v > 65535) {
-        return -1;
-    }
-    return (int)v;
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 2) { 
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        return 1;
-    }
-
-    int port = validate_port(argv[1]);
-    if (port < 0) {
-        fprintf(stderr, "'%s' is not a valid port (1-65535).\n", argv[1]);
-        return 1;
-    }
-
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        clients[i] = NULL;
-    }
-
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("socket creation failed");
-        return 1;
-    }
-
-    int opt = 1;
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
-    }
-
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(port);
-
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind failed");
-        close(server_sock);
-        return 1;
-    }
-
-    if (listen(server_sock, 5) < 0) {
-        perror("listen failed");
-        close(server_sock);
-        return 1;
-    }
-
-    printf("Server listening on port %d...\n", port);
-
-    while (1) {
-        struct sockaddr_in cli_addr;
-        socklen_t cli_len = sizeof(cli_addr);
-        int client_sock = accept(server_sock, (struct sockaddr *)&cli_addr, &cli_len);
-        if (client_sock < 0) {
-            perror("accept failed");
-            continue;
-        }
-
-        char name_buf[NAME_LEN];
-        int name_bytes = recv(client_sock, name_buf, NAME_LEN - 1, 0);
-        if (name_bytes <= 0) {
-            fprintf(stderr, "Failed to get client name or client disconnected.\n");
-            close(client_sock);
-            continue;
-        }
-        name_buf[name_bytes] = '\0';
-        char *clean_name = trimwhitespace(name_buf);
-        if (*clean_name == '\0') {
-            fprintf(stderr, "Client sent empty name.\n");
-            close(client_sock);
-            continue;
-        }
-
-        client_t *cli = malloc(sizeof(client_t));
-        if (!cli) {
-            perror("malloc failed for client struct");
-            close(client_sock);
-            continue;
-        }
-        cli->sockfd = client_sock;
-        cli->addr = cli_addr;
-        strncpy(cli->name, clean_name, NAME_LEN - 1);
-        cli->name[NAME_LEN - 1] = '\0';
-
-        add_client(cli);
-
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, cli) != 0) {
-            perror("pthread_create failed");
-            remove_client(cli->sockfd);
-            free(cli);
-            close(client_sock);
-        }
-    }
-
-    close(server_sock);
-    pthread_mutex_destroy(&clients_mutex);
-    return 0;
-}
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <dirent.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#include "protocol.h"
+
+#define MAX_EVENTS 256
+#define DEFAULT_QUEUE_LIMIT 1024
+#define FLUSH_IOV_MAX 64
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define TICK_MS 100
+#define ACCEPT_BACKOFF_MS 100
+#define RCU_RECLAIM_MS 1000
+#define TIMER_NIL UINT32_MAX
+#define TIMER_INDEX_BITS 20
+#define MAX_PENDING_DELAYS (1u << TIMER_INDEX_BITS)
+#define MAX_DELAY_SECONDS 86400
+#define LATENCY_BUCKETS 24
+#define ID_FD_BITS 20
+#define IN_BUF_INITIAL 1024
+#define IN_BUF_MIN_READ 512
+#define OUT_QUEUE_INITIAL 16
+#define DEFAULT_MAX_LINE 4096
+#define LOBBY_NAME "lobby"
+#define HISTORY_SEGMENT_SIZE (4u << 20)
+#define HISTORY_SEGMENT_RECORDS 65536
+#define HISTORY_SEGMENTS 8
+#define HISTORY_NONE UINT64_MAX
+#define HISTORY_MAX_REPLAY 500
+#define HISTORY_REPLAY_AGE_MS (3600 * 1000ull)
+#define DEFAULT_REPLAY 20
+#define MAILBOX_MAX_BYTES (1u << 20)
+#define MAILBOX_LOCKS 64
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024
+#define URING_BUFFER_SIZE 4096
+#define URING_MAX_FILES 65536
+#define RATE_HELD_SLACK (URING_BUFFERS * URING_BUFFER_SIZE)
+#define DEFAULT_BACKLOG 4096
+#define DEFAULT_HANDSHAKE_TIMEOUT 10
+#define LOG_RING_RECORDS 256
+#define LOG_RING_CLIENT_RECORDS 16
+#define LOG_TEXT_LEN 216
+#define LOG_WRITE_BUFFER 65536
+#define LOG_IDLE_MS 5
+#define POOL_CLASSES 11
+#define POOL_SLAB_SIZE 65536
+#define THREAD_STACK_SIZE (128 * 1024)
+#define MEM_ADMIT_PERCENT 90
+#define LINK_QUEUE_BYTES (8u << 20)
+#define LINK_HIGH_WATER (LINK_QUEUE_BYTES / 2)
+#define LINK_LOW_WATER (LINK_QUEUE_BYTES / 8)
+#define LINK_BACKOFF_MS 50
+#define LINK_RETRY_MS 2000
+#define LINK_MAX_PAYLOAD (FRAME_MAX_PAYLOAD + 4 * NAME_LEN + 8)
+#define REMOTE_INITIAL 64
+#define RATE_MAX 1000000
+#define LIST_PAGE_TEXT 50
+#define LIST_PAGE_BINARY 1000
+#define UPGRADE_ENV "CHAT_UPGRADE_FD"
+#define UPGRADE_TIMEOUT_MS 10000
+#define UPGRADE_MAX_RECORD (64u << 20)
+#define ID_FD_MASK ((1u << ID_FD_BITS) - 1)
+
+_Static_assert((uint64_t)MAX_DELAY_SECONDS * 1000 / TICK_MS < (1ull << (WHEEL_BITS * WHEEL_LEVELS)),
+               "the timer wheel must span the longest /delay");
+
+typedef enum {
+    MODE_THREADS,
+    MODE_EPOLL,
+    MODE_URING
+} server_mode_t;
+
+typedef enum {
+    SLOW_DROP_OLDEST,
+    SLOW_DROP_NEWEST,
+    SLOW_DISCONNECT
+} slow_policy_t;
+
+typedef enum {
+    CMD_MESSAGE,
+    CMD_LIST,
+    CMD_PM,
+    CMD_DELAY,
+    CMD_DELAYS,
+    CMD_CANCEL,
+    CMD_STATS,
+    CMD_JOIN,
+    CMD_PART,
+    CMD_ROOMS,
+    CMD_HISTORY,
+    CMD_WATCH,
+    CMD_UNKNOWN,
+    CMD_COUNT
+} command_t;
+
+typedef enum {
+    RATE_INPUT,
+    RATE_MESSAGE,
+    RATE_PM,
+    RATE_LIST,
+    RATE_DELAY,
+    RATE_CLASSES
+} rate_class_t;
+
+/* A bucket holds up to burst tokens and refills at rate tokens per second; rate 0 is no limit. */
+typedef struct {
+    uint32_t rate;
+    uint32_t burst;
+} rate_limit_t;
+
+/* Tokens are counted in thousandths, so even slow rates refill a little every millisecond. */
+typedef struct {
+    uint32_t tokens;
+    uint32_t stamp_ms;
+} rate_bucket_t;
+
+typedef enum {
+    RECV_ARMED,
+    RECV_CANCELLING,
+    RECV_STOPPED
+} recv_state_t;
+
+/*
+ * Only allocated when --rate-limit is set or the node has links. resume_ms is non-zero while the
+ * client's reads are paused. In io_uring mode recv_state tracks the multishot receive that a pause cancels.
+ */
+typedef struct rate_state {
+    uint64_t resume_ms;
+    struct client *paused_next;
+    recv_state_t recv_state;
+    rate_bucket_t buckets[RATE_CLASSES];
+} rate_state_t;
+
+/* Bucket i counts observations of at most 2^i microseconds; the last bucket is +Inf. */
+typedef struct {
+    atomic_ulong buckets[LATENCY_BUCKETS + 1];
+    atomic_ulong count;
+    atomic_ulong sum_ns;
+} latency_hist_t;
+
+/*
+ * Per-connection input. recv() writes at tail and lines or frames are handed out in place
+ * from head, so nothing is copied on the way in. Consumed space is reclaimed by resetting
+ * to the start when the buffer drains, or by moving the unread tail once it reaches cap.
+ * held is set while the rate limiter keeps unread lines waiting. In io_uring mode the receive
+ * is cancelled then, but whatever the buffer ring already delivered must still fit, so the
+ * buffer may grow by RATE_HELD_SLACK past the usual line limit.
+ */
+typedef struct {
+    char *data;
+    size_t cap;
+    size_t head;
+    size_t tail;
+    size_t scanned;
+    int discarding;
+    int held;
+} in_buf_t;
+
+/*
+ * Every pooled block starts with this header. Blocks up to the largest size class (2 KB) are
+ * carved from slabs and recycled through per-class free lists. Bigger ones are rare and only
+ * needed during bursts, so they come straight from malloc and go back to it.
+ */
+typedef struct pool_block {
+    struct pool_block *next;
+    uint32_t cls;
+    uint32_t size;
+} pool_block_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pool_block_t *free;
+} pool_class_t;
+
+/* frame, if set, is the binary-protocol rendering of the same message. */
+typedef struct msg_buf {
+    atomic_uint refs;
+    struct msg_buf *frame;
+    size_t len;
+    char data[];
+} msg_buf_t;
+
+struct shard;
+
+typedef struct client {
+    int sockfd;
+    char name[NAME_LEN];
+    uint32_t id;
+    int binary;
+    struct sockaddr_in addr;
+    int registered;
+    in_buf_t in;
+    pthread_mutex_t out_mutex;
+    msg_buf_t **out_q;
+    size_t out_head;
+    size_t out_count;
+    size_t out_cap;
+    size_t out_off;
+    size_t out_peak;
+    unsigned long out_drops;
+    unsigned long out_msgs;
+    unsigned long out_writes;
+    int want_write;
+    int dirty;
+    struct client *dirty_prev;
+    struct client *dirty_next;
+    int wake_fd;
+    int slow_disconnect;
+    int detached;
+    size_t out_inflight;
+    int uring_ops;
+    int closing;
+    int fixed_file;
+    struct uring_send *send;
+    uint64_t handshake_deadline;
+    struct client *handshake_prev;
+    struct client *handshake_next;
+    size_t reg_index;
+    struct shard *shard;
+    struct room *room;
+    size_t member_index;
+    struct rate_state *rate;
+    int subscribed;
+    size_t sub_index;
+} client_t;
+
+typedef struct {
+    size_t cap;
+    _Atomic(client_t *) slots[];
+} fd_table_t;
+
+/* Changed only under clients_mutex. Readers use the published view, or by_fd for ids. */
+typedef struct {
+    client_t **items;
+    size_t count;
+    size_t cap;
+    _Atomic(fd_table_t *) by_fd;
+    client_t **by_name;
+    size_t name_cap;
+} registry_t;
+
+/* An immutable copy of the name index, republished after every join and leave. */
+typedef struct {
+    size_t count;
+    size_t name_cap;
+    client_t *by_name[];
+} registry_view_t;
+
+typedef struct {
+    char name[NAME_LEN];
+    char node[NAME_LEN];
+    uint32_t id;
+    uint32_t text_off;
+    uint32_t frame_off;
+} presence_entry_t;
+
+/*
+ * Everyone online, local and remote, sorted by name and already rendered both ways, so /list only
+ * copies a slice. Dropped on every join and leave and rebuilt by the next /list.
+ */
+typedef struct {
+    size_t count;
+    char *text;
+    unsigned char *frames;
+    msg_buf_t *first_page[2];
+    presence_entry_t entries[];
+} presence_t;
+
+/* An immutable member array; room_enter() and room_leave() publish a new one. */
+typedef struct {
+    size_t count;
+    client_t *items[];
+} member_set_t;
+
+/* Members are kept per shard, so each shard's loop only ever walks its own clients. */
+typedef struct room {
+    char name[NAME_LEN];
+    pthread_mutex_t mutex;
+    _Atomic(member_set_t *) *by_shard;
+    size_t member_count;
+    size_t dir_index;
+} room_t;
+
+typedef struct {
+    room_t **items;
+    size_t count;
+    size_t cap;
+    room_t **by_name;
+    size_t name_cap;
+} room_dir_t;
+
+typedef enum {
+    SHARD_BROADCAST,
+    SHARD_PM,
+    SHARD_PRESENCE
+} shard_msg_kind_t;
+
+/* target is the room name for SHARD_BROADCAST and the recipient name for SHARD_PM; SHARD_PRESENCE goes
+ * to the shard's /watch subscribers. */
+typedef struct shard_msg {
+    struct shard_msg *next;
+    shard_msg_kind_t kind;
+    msg_buf_t *msg;
+    char target[NAME_LEN];
+} shard_msg_t;
+
+typedef enum {
+    MAIL_STORE,
+    MAIL_DELIVER
+} mail_job_kind_t;
+
+/*
+ * Work for the mail thread. MAIL_STORE saves text from sender for the offline user name and
+ * reports back to the client with id sender (id 0: a delayed PM; origin set: a PM from that
+ * node). MAIL_DELIVER sends name's mailbox to the client with id if it is still connected.
+ */
+typedef struct mail_job {
+    struct mail_job *next;
+    mail_job_kind_t kind;
+    uint32_t id;
+    char name[NAME_LEN];
+    char sender[NAME_LEN];
+    char origin[NAME_LEN];
+    char text[];
+} mail_job_t;
+
+typedef struct shard {
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;
+    client_t *dirty_head;
+    client_t *handshake_head;
+    client_t *handshake_tail;
+    client_t *paused_head;
+    client_t *adopted;
+    client_t **subscribers;
+    size_t subscriber_count;
+    size_t subscriber_cap;
+    _Atomic(shard_msg_t *) inbox;
+    struct uring *ring;
+    pthread_t tid;
+} shard_t;
+
+/*
+ * A link to another node. Any thread may queue frames on out under mutex; only the link
+ * thread touches the socket and frees the link. peer is the --peer index for links we
+ * dialled and -1 for accepted ones. up is set once the peer's LINK_HELLO has arrived.
+ */
+typedef struct link {
+    int fd;
+    int peer;
+    int up;
+    int connecting;
+    int want_write;
+    int overflow;
+    int congested;
+    char node[NAME_LEN];
+    in_buf_t in;
+    pthread_mutex_t mutex;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    struct link *next;
+} link_t;
+
+/* node is learnt from the first HELLO, so a peer already reached the other way is not redialled. */
+typedef struct {
+    char *host;
+    int port;
+    link_t *link;
+    char node[NAME_LEN];
+    uint64_t next_dial;
+    int failing;
+} peer_t;
+
+/* A user on another node, as announced over link. */
+typedef struct remote_user {
+    struct remote_user *next;
+    link_t *link;
+    char name[NAME_LEN];
+    char node[NAME_LEN];
+} remote_user_t;
+
+/*
+ * History segment file layout: HISTORY_SEGMENT_RECORDS index records followed by
+ * HISTORY_SEGMENT_SIZE bytes of log text, which is exactly what text clients were sent.
+ * A record's id is its segment number * HISTORY_SEGMENT_RECORDS + its index, and prev
+ * chains each room's records from newest to oldest. len is written last, so a record
+ * with len 0 ends the segment.
+ */
+typedef struct {
+    uint64_t time_ms;
+    uint64_t prev;
+    uint32_t offset;
+    uint32_t len;
+    char room[NAME_LEN];
+} history_record_t;
+
+typedef struct {
+    uint64_t seq;
+    history_record_t *records;
+    char *data;
+    uint32_t count;
+    size_t used;
+} history_segment_t;
+
+typedef struct {
+    char name[NAME_LEN];
+    uint64_t last;
+} history_room_t;
+
+/*
+ * Epoch-based reclamation. Readers announce the epoch they started in; a retired object is
+ * freed once no reader is still in an epoch from before it was unpublished.
+ */
+typedef struct rcu_reader {
+    _Alignas(64) atomic_ulong epoch;
+    atomic_int in_use;
+    int depth;
+    struct rcu_reader *next;
+} rcu_reader_t;
+
+typedef struct rcu_node {
+    struct rcu_node *next;
+    void *ptr;
+    void (*free_fn)(void *);
+    unsigned long epoch;
+} rcu_node_t;
+
+typedef enum {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} log_level_t;
+
+typedef enum {
+    LOG_KIND_TEXT,
+    LOG_KIND_LINE,
+    LOG_KIND_FRAME
+} log_kind_t;
+
+/*
+ * One log entry as the logging thread receives it. Text entries are formatted by the caller;
+ * received lines and frames are copied raw and only turned into text by the logging thread.
+ */
+typedef struct {
+    uint64_t time_ms;
+    uint8_t level;
+    uint8_t kind;
+    uint8_t op;
+    uint8_t truncated;
+    uint32_t len;
+    char name[NAME_LEN];
+    char text[LOG_TEXT_LEN];
+} log_record_t;
+
+/*
+ * Single-producer, single-consumer ring owned by one thread; retired when that thread exits.
+ * size is a power of two: LOG_RING_RECORDS, or LOG_RING_CLIENT_RECORDS for per-client threads.
+ */
+typedef struct log_ring {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    atomic_int retired;
+    struct log_ring *next;
+    unsigned size;
+    log_record_t records[];
+} log_ring_t;
+
+typedef enum {
+    TIMER_FREE,
+    TIMER_PENDING,
+    TIMER_DUE
+} timer_state_t;
+
+typedef struct {
+    uint64_t expires;
+    uint32_t next;
+    uint32_t prev;
+    uint32_t gen;
+    uint8_t state;
+    uint8_t level;
+    uint8_t slot;
+    int delay;
+    char sender_name[NAME_LEN];
+    char recipient_name[NAME_LEN];
+    char *message;
+} delay_timer_t;
+
+/*
+ * Hot upgrade (SIGUSR2): the running server execs its binary again and hands over its state on
+ * a unix socket. Records use the frame layout from protocol.h; sockets travel as SCM_RIGHTS on
+ * the first byte of their record.
+ */
+typedef enum {
+    UPGRADE_READY = 1,      /* new -> old, (u32 0)                                           */
+    UPGRADE_LISTENER,       /* u32 shard                                                     */
+    UPGRADE_METRICS,        /* u32 0 for --metrics-port, 1 for --metrics-socket              */
+    UPGRADE_LINK_LISTENER,  /* (u32 0)                                                       */
+    UPGRADE_CLIENT,         /* u32 flags, name, room, u32 n, n bytes of unread input, unsent output */
+    UPGRADE_DELAY,          /* u32 index, u32 gen, u32 expires high, u32 low, u32 delay, sender, recipient, text */
+    UPGRADE_DONE,           /* old -> new, (u32 0)                                           */
+    UPGRADE_ACK             /* new -> old, (u32 0)                                           */
+} upgrade_op_t;
+
+#define UPGRADE_CLIENT_REGISTERED 1u
+#define UPGRADE_CLIENT_BINARY 2u
+#define UPGRADE_CLIENT_SUBSCRIBED 4u
+
+/* A record as the new process received it, kept until the part of startup that needs it. */
+typedef struct upgrade_record {
+    struct upgrade_record *next;
+    uint8_t op;
+    int fd;
+    size_t len;
+    unsigned char data[];
+} upgrade_record_t;
+
+registry_t clients;
+pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+_Atomic(registry_view_t *) client_view;
+_Atomic(registry_view_t *) client_view_spare;
+atomic_ulong rcu_epoch = 1;
+_Atomic(rcu_reader_t *) rcu_readers;
+pthread_key_t rcu_key;
+__thread rcu_reader_t *rcu_self;
+pthread_mutex_t rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+rcu_node_t *rcu_retired;
+atomic_size_t rcu_pending;
+room_dir_t rooms;
+pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+room_t *lobby;
+server_mode_t server_mode = MODE_THREADS;
+shard_t *shards;
+int shard_count = 1;
+__thread shard_t *current_shard;
+size_t queue_limit = DEFAULT_QUEUE_LIMIT;
+slow_policy_t slow_policy = SLOW_DROP_OLDEST;
+atomic_ulong stat_out_drops;
+atomic_ulong stat_slow_disconnects;
+atomic_ulong stat_msgs_delivered;
+atomic_ulong stat_write_calls;
+atomic_ulong stat_connections;
+atomic_int binary_clients;
+uint32_t id_generation;
+atomic_ulong stat_msgs_in;
+atomic_ulong stat_bytes_in;
+atomic_ulong stat_bytes_out;
+atomic_ulong stat_send_errors;
+atomic_ulong stat_delays_fired;
+atomic_ulong stat_long_lines;
+atomic_ulong stat_history_appends;
+atomic_ulong stat_history_replays;
+atomic_ulong stat_mail_stored;
+atomic_ulong stat_mail_delivered;
+atomic_ulong stat_log_drops;
+atomic_ulong stat_handshake_timeouts;
+atomic_ulong stat_accept_refused;
+_Atomic uint64_t accept_error_logged_ms;
+int spare_fd = -1;
+pthread_mutex_t spare_mutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_ulong stat_mem_rejects;
+atomic_ulong stat_mem_shed;
+const size_t pool_sizes[POOL_CLASSES] = {32, 64, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+pool_class_t pool_classes[POOL_CLASSES];
+size_t mem_limit;
+atomic_size_t mem_used;
+atomic_size_t mem_reserved;
+atomic_size_t mem_conn;
+atomic_long live_clients;
+atomic_int mem_shedding;
+size_t max_line = DEFAULT_MAX_LINE;
+char node_name[NAME_LEN];
+int link_port;
+peer_t *peers;
+int peer_count;
+link_t *links;
+pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_int links_up;
+atomic_int links_congested;
+int link_epoll_fd = -1;
+int link_listen_fd = -1;
+int link_wake_fd = -1;
+remote_user_t **remote_users;
+size_t remote_cap;
+size_t remote_count;
+pthread_mutex_t remote_mutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_ulong stat_link_frames_out;
+atomic_ulong stat_link_frames_in;
+atomic_ulong stat_link_resets;
+atomic_ulong stat_link_pauses;
+rate_limit_t rate_limits[RATE_CLASSES];
+int rate_limited;
+const char *rate_names[RATE_CLASSES] = {"input", "message", "pm", "list", "delay"};
+atomic_ulong stat_rate_limited[RATE_CLASSES];
+_Atomic(presence_t *) presence;
+atomic_ulong presence_gen;
+pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_int subscriber_total;
+atomic_ulong stat_presence_builds;
+char **upgrade_argv;
+atomic_int upgrading;
+pthread_mutex_t upgrade_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upgrade_cond = PTHREAD_COND_INITIALIZER;
+int upgrade_parked;
+int upgrade_wake_fd = -1;
+int upgrade_fd = -1;
+atomic_int client_threads;
+client_t *upgrade_handshakes;
+upgrade_record_t *upgrade_records;
+int listen_backlog = DEFAULT_BACKLOG;
+int handshake_timeout_ms = DEFAULT_HANDSHAKE_TIMEOUT * 1000;
+latency_hist_t fanout_hist;
+latency_hist_t command_hist[CMD_COUNT];
+const char *command_names[CMD_COUNT] = {
+    "message", "list", "pm", "delay", "delays", "cancel", "stats", "join", "part", "rooms", "history", "watch", "unknown"
+};
+char **admin_names;
+int admin_count;
+int metrics_port;
+const char *metrics_path;
+int metrics_fds[2] = {-1, -1};
+
+log_level_t log_level = LOG_INFO;
+unsigned long log_sample = 1;
+int log_content = 1;
+_Atomic(log_ring_t *) log_rings;
+atomic_ulong log_idle_passes;
+pthread_key_t log_key;
+__thread log_ring_t *log_ring;
+__thread unsigned log_ring_size = LOG_RING_RECORDS;
+__thread unsigned long log_sample_seq;
+
+const char *history_dir;
+const char *mailbox_dir;
+pthread_mutex_t mailbox_locks[MAILBOX_LOCKS];
+pthread_mutex_t mail_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mail_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t mail_idle = PTHREAD_COND_INITIALIZER;
+mail_job_t *mail_head;
+mail_job_t *mail_tail;
+int mail_busy;
+int replay_count = DEFAULT_REPLAY;
+pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+history_segment_t history_segments[HISTORY_SEGMENTS];
+uint64_t history_first;
+uint64_t history_last;
+history_room_t *history_rooms;
+size_t history_rooms_count;
+size_t history_rooms_cap;
+/* Hand-off to the history thread; records is NULL until the spare segment is mapped. */
+pthread_mutex_t history_spare_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t history_spare_cond = PTHREAD_COND_INITIALIZER;
+history_segment_t history_spare;
+uint64_t history_spare_want = HISTORY_NONE;
+uint64_t history_unlink_below;
+char *history_sync;
+char *history_unmaps[HISTORY_SEGMENTS];
+size_t history_unmap_count;
+
+pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sched_cond;
+delay_timer_t *timer_pool;
+uint32_t timer_pool_cap;
+uint32_t timer_pool_used;
+uint32_t timer_free_list = TIMER_NIL;
+uint32_t wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+uint64_t wheel_tick;
+size_t sched_pending;
+int sched_firing;
+pthread_cond_t sched_idle = PTHREAD_COND_INITIALIZER;
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t monotonic_ms(void) {
+    return monotonic_ns() / 1000000;
+}
+
+void latency_observe(latency_hist_t *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS;
+    }
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+}
+
+uint64_t wall_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Logging never blocks the caller: each thread writes fixed-size records into its own ring,
+ * and a single logging thread formats them and writes them to stdout in batches. When a
+ * ring is full the record is dropped and counted.
+ */
+void log_ring_retire(void *ring) {
+    atomic_store_explicit(&((log_ring_t *)ring)->retired, 1, memory_order_release);
+}
+
+log_record_t *log_reserve(log_level_t level, log_kind_t kind) {
+    log_ring_t *ring = log_ring;
+    if (!ring) {
+        if ((ring = calloc(1, sizeof(log_ring_t) + log_ring_size * sizeof(log_record_t))) == NULL) {
+            atomic_fetch_add_explicit(&stat_log_drops, 1, memory_order_relaxed);
+            return NULL;
+        }
+        ring->size = log_ring_size;
+        ring->next = atomic_load_explicit(&log_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&log_rings, &ring->next, ring,
+                                                      memory_order_release, memory_order_relaxed)) {
+        }
+        pthread_setspecific(log_key, ring);
+        log_ring = ring;
+    }
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ring->size) {
+        atomic_fetch_add_explicit(&stat_log_drops, 1, memory_order_relaxed);
+        return NULL;
+    }
+    log_record_t *rec = &ring->records[tail % ring->size];
+    rec->time_ms = wall_clock_ms();
+    rec->level = level;
+    rec->kind = kind;
+    return rec;
+}
+
+void log_commit(void) {
+    atomic_fetch_add_explicit(&log_ring->tail, 1, memory_order_release);
+}
+
+__attribute__((format(printf, 2, 3)))
+void log_msg(log_level_t level, const char *fmt, ...) {
+    if (level > log_level) {
+        return;
+    }
+    log_record_t *rec = log_reserve(level, LOG_KIND_TEXT);
+    if (!rec) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+    rec->len = len < 0 ? 0 : len >= LOG_TEXT_LEN ? LOG_TEXT_LEN - 1 : (uint32_t)len;
+    rec->truncated = len >= LOG_TEXT_LEN;
+    log_commit();
+}
+
+/* True for every --log-sample'th received message on this thread. */
+int log_sampled(void) {
+    return log_level >= LOG_INFO && log_sample > 0 && ++log_sample_seq % log_sample == 0;
+}
+
+void log_received_line(const char *name, const char *line) {
+    if (!log_sampled()) {
+        return;
+    }
+    size_t len = strlen(line);
+    log_record_t *rec = log_reserve(LOG_INFO, LOG_KIND_LINE);
+    if (!rec) {
+        return;
+    }
+    memcpy(rec->name, name, NAME_LEN);
+    rec->len = len;
+    if (log_content) {
+        size_t n = len < LOG_TEXT_LEN ? len : LOG_TEXT_LEN;
+        memcpy(rec->text, line, n);
+        rec->truncated = n < len;
+    }
+    log_commit();
+}
+
+void log_received_frame(const char *name, uint8_t op, size_t len) {
+    if (!log_sampled()) {
+        return;
+    }
+    log_record_t *rec = log_reserve(LOG_INFO, LOG_KIND_FRAME);
+    if (!rec) {
+        return;
+    }
+    memcpy(rec->name, name, NAME_LEN);
+    rec->op = op;
+    rec->len = len;
+    log_commit();
+}
+
+size_t log_format(const log_record_t *rec, char *out, size_t size) {
+    static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+    time_t secs = rec->time_ms / 1000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    size_t n = strftime(out, size, "%Y-%m-%d %H:%M:%S", &tm);
+    int len;
+    switch (rec->kind) {
+    case LOG_KIND_LINE:
+        if (log_content) {
+            len = snprintf(out + n, size - n, ".%03u %-5s Received from %.*s: %.*s%s\n",
+                           (unsigned)(rec->time_ms % 1000), level_names[rec->level], NAME_LEN, rec->name,
+                           (int)(rec->truncated ? LOG_TEXT_LEN : rec->len), rec->text, rec->truncated ? "..." : "");
+        } else {
+            len = snprintf(out + n, size - n, ".%03u %-5s Received from %.*s (%u bytes)\n",
+                           (unsigned)(rec->time_ms % 1000), level_names[rec->level], NAME_LEN, rec->name, rec->len);
+        }
+        break;
+    case LOG_KIND_FRAME:
+        len = snprintf(out + n, size - n, ".%03u %-5s Received frame 0x%02x from %.*s (%u bytes)\n",
+                       (unsigned)(rec->time_ms % 1000), level_names[rec->level], rec->op, NAME_LEN, rec->name,
+                       rec->len);
+        break;
+    default:
+        len = snprintf(out + n, size - n, ".%03u %-5s %.*s%s\n", (unsigned)(rec->time_ms % 1000),
+                       level_names[rec->level], (int)rec->len, rec->text, rec->truncated ? "..." : "");
+        break;
+    }
+    n += len < 0 ? 0 : (size_t)len;
+    return n < size ? n : size - 1;
+}
+
+void log_write(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void *log_thread(void *arg) {
+    (void)arg;
+    static char out[LOG_WRITE_BUFFER];
+    unsigned long reported_drops = 0;
+    while (1) {
+        size_t used = 0;
+        log_ring_t *prev = NULL;
+        log_ring_t *ring = atomic_load_explicit(&log_rings, memory_order_acquire);
+        while (ring) {
+            int retired = atomic_load_explicit(&ring->retired, memory_order_acquire);
+            unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            for (; head != tail; ++head) {
+                if (LOG_WRITE_BUFFER - used < LOG_TEXT_LEN + NAME_LEN + 128) {
+                    log_write(out, used);
+                    used = 0;
+                }
+                used += log_format(&ring->records[head % ring->size], out + used, LOG_WRITE_BUFFER - used);
+                atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+            }
+            log_ring_t *next = ring->next;
+            /* Threads only ever push at the front, so anything behind it can be unlinked here. */
+            if (retired && prev) {
+                prev->next = next;
+                free(ring);
+            } else {
+                prev = ring;
+            }
+            ring = next;
+        }
+
+        unsigned long drops = atomic_load_explicit(&stat_log_drops, memory_order_relaxed);
+        if (drops != reported_drops && LOG_WRITE_BUFFER - used >= LOG_TEXT_LEN + 64) {
+            log_record_t rec;
+            rec.time_ms = wall_clock_ms();
+            rec.level = LOG_WARN;
+            rec.kind = LOG_KIND_TEXT;
+            rec.truncated = 0;
+            rec.len = snprintf(rec.text, sizeof(rec.text), "Dropped %lu log records (log rings full).",
+                               drops - reported_drops);
+            used += log_format(&rec, out + used, LOG_WRITE_BUFFER - used);
+            reported_drops = drops;
+        }
+        if (used > 0) {
+            log_write(out, used);
+        } else {
+            atomic_fetch_add_explicit(&log_idle_passes, 1, memory_order_release);
+            struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_start(void) {
+    if (pthread_key_create(&log_key, log_ring_retire) != 0) {
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/* Waits until everything logged so far is written: the second idle pass from now began after it. */
+void log_drain(void) {
+    unsigned long seen = atomic_load_explicit(&log_idle_passes, memory_order_acquire);
+    for (int i = 0; i < 200 && atomic_load_explicit(&log_idle_passes, memory_order_acquire) < seen + 2; ++i) {
+        struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+        nanosleep(&idle, NULL);
+    }
+}
+
+void pool_init(void) {
+    for (int c = 0; c < POOL_CLASSES; ++c) {
+        pthread_mutex_init(&pool_classes[c].mutex, NULL);
+    }
+}
+
+/* Called with the class mutex held. Slabs are never given back; their blocks are reused. */
+int pool_refill(int cls) {
+    size_t block = sizeof(pool_block_t) + pool_sizes[cls];
+    size_t count = POOL_SLAB_SIZE / block;
+    char *slab = malloc(count * block);
+    if (!slab) {
+        return -1;
+    }
+    atomic_fetch_add_explicit(&mem_reserved, count * block, memory_order_relaxed);
+    for (size_t i = count; i-- > 0;) {
+        pool_block_t *b = (pool_block_t *)(slab + i * block);
+        b->next = pool_classes[cls].free;
+        pool_classes[cls].free = b;
+    }
+    return 0;
+}
+
+/*
+ * Returns a block of at least size bytes. A limited allocation fails with ENOBUFS once
+ * --mem-limit bytes are in use; that is how load is shed. Unlimited ones are for memory a
+ * connection needs to exist at all, which admission control already accounted for.
+ */
+void *pool_alloc(size_t size, int limited) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && size > pool_sizes[cls]) {
+        ++cls;
+    }
+    size_t bytes = sizeof(pool_block_t) + (cls < POOL_CLASSES ? pool_sizes[cls] : size);
+    if (limited && mem_limit && atomic_load_explicit(&mem_used, memory_order_relaxed) + bytes > mem_limit) {
+        atomic_fetch_add_explicit(&stat_mem_shed, 1, memory_order_relaxed);
+        if (!atomic_exchange(&mem_shedding, 1)) {
+            log_msg(LOG_WARN, "Memory limit reached, shedding load.");
+        }
+        errno = ENOBUFS;
+        return NULL;
+    }
+    pool_block_t *b;
+    if (cls == POOL_CLASSES) {
+        if ((b = malloc(bytes)) == NULL) {
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&mem_reserved, bytes, memory_order_relaxed);
+    } else {
+        pool_class_t *pc = &pool_classes[cls];
+        pthread_mutex_lock(&pc->mutex);
+        if (!pc->free && pool_refill(cls) < 0) {
+            pthread_mutex_unlock(&pc->mutex);
+            return NULL;
+        }
+        b = pc->free;
+        pc->free = b->next;
+        pthread_mutex_unlock(&pc->mutex);
+    }
+    b->cls = cls;
+    b->size = bytes;
+    atomic_fetch_add_explicit(&mem_used, bytes, memory_order_relaxed);
+    return b + 1;
+}
+
+void pool_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    pool_block_t *b = (pool_block_t *)ptr - 1;
+    size_t used = atomic_fetch_sub_explicit(&mem_used, b->size, memory_order_relaxed) - b->size;
+    if (atomic_load_explicit(&mem_shedding, memory_order_relaxed) && used < mem_limit / 100 * MEM_ADMIT_PERCENT
+        && atomic_exchange(&mem_shedding, 0)) {
+        log_msg(LOG_INFO, "Memory use is back under the limit.");
+    }
+    if (b->cls == POOL_CLASSES) {
+        atomic_fetch_sub_explicit(&mem_reserved, b->size, memory_order_relaxed);
+        free(b);
+        return;
+    }
+    pool_class_t *pc = &pool_classes[b->cls];
+    pthread_mutex_lock(&pc->mutex);
+    b->next = pc->free;
+    pc->free = b;
+    pthread_mutex_unlock(&pc->mutex);
+}
+
+/* Shed allocations are counted in stat_mem_shed and reported once, not logged one by one. */
+log_level_t alloc_failure_level(void) {
+    return errno == ENOBUFS ? LOG_DEBUG : LOG_ERROR;
+}
+
+/* Bytes a block from pool_alloc() counts against the limit, header included; 0 for NULL. */
+size_t pool_charge(const void *ptr) {
+    return ptr ? ((const pool_block_t *)ptr - 1)->size : 0;
+}
+
+/* Bytes usable in a block, which may be more than were asked for. */
+size_t pool_usable(const void *ptr) {
+    return pool_charge(ptr) - sizeof(pool_block_t);
+}
+
+/* Pool allocations that belong to one connection are also counted in mem_conn. */
+void *conn_alloc(size_t size, int limited) {
+    void *ptr = pool_alloc(size, limited);
+    atomic_fetch_add_explicit(&mem_conn, pool_charge(ptr), memory_order_relaxed);
+    return ptr;
+}
+
+void conn_free(void *ptr) {
+    atomic_fetch_sub_explicit(&mem_conn, pool_charge(ptr), memory_order_relaxed);
+    pool_free(ptr);
+}
+
+msg_buf_t *msg_alloc(size_t len) {
+    msg_buf_t *msg = pool_alloc(sizeof(msg_buf_t) + len, 1);
+    if (!msg) {
+        return NULL;
+    }
+    atomic_init(&msg->refs, 1);
+    msg->frame = NULL;
+    msg->len = len;
+    return msg;
+}
+
+msg_buf_t *msg_printf(const char *fmt, ...) {
+    va_list ap, ap2;
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    msg_buf_t *msg = len < 0 ? NULL : msg_alloc(len + 1);
+    if (msg) {
+        vsnprintf(msg->data, len + 1, fmt, ap2);
+        msg->len = len;
+    }
+    va_end(ap2);
+    return msg;
+}
+
+void msg_ref(msg_buf_t *msg) {
+    atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+}
+
+void msg_unref(msg_buf_t *msg) {
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1) {
+        if (msg->frame) {
+            msg_unref(msg->frame);
+        }
+        pool_free(msg);
+    }
+}
+
+void rcu_reader_release(void *reader) {
+    atomic_store(&((rcu_reader_t *)reader)->in_use, 0);
+}
+
+/* Claims a record left behind by an exited thread, or adds a new one. */
+rcu_reader_t *rcu_reader(void) {
+    if (rcu_self) {
+        return rcu_self;
+    }
+    rcu_reader_t *r;
+    for (r = atomic_load(&rcu_readers); r; r = r->next) {
+        int free_record = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &free_record, 1)) {
+            break;
+        }
+    }
+    if (!r) {
+        if ((r = calloc(1, sizeof(rcu_reader_t))) == NULL) {
+            perror("malloc failed for RCU reader");
+            abort();
+        }
+        atomic_store(&r->in_use, 1);
+        r->next = atomic_load(&rcu_readers);
+        while (!atomic_compare_exchange_weak(&rcu_readers, &r->next, r)) {
+        }
+    }
+    pthread_setspecific(rcu_key, r);
+    rcu_self = r;
+    return r;
+}
+
+/* Read sections nest and must not block. */
+void rcu_read_lock(void) {
+    rcu_reader_t *r = rcu_reader();
+    if (r->depth++ == 0) {
+        atomic_store(&r->epoch, atomic_load(&rcu_epoch));
+    }
+}
+
+void rcu_read_unlock(void) {
+    if (--rcu_self->depth == 0) {
+        atomic_store(&rcu_self->epoch, 0);
+    }
+}
+
+/* Called with rcu_mutex held. */
+void rcu_reclaim(void) {
+    unsigned long oldest = ULONG_MAX;
+    for (rcu_reader_t *r = atomic_load(&rcu_readers); r; r = r->next) {
+        unsigned long e = atomic_load(&r->epoch);
+        if (e && e < oldest) {
+            oldest = e;
+        }
+    }
+    rcu_node_t **link = &rcu_retired;
+    while (*link) {
+        rcu_node_t *node = *link;
+        if (node->epoch <= oldest) {
+            *link = node->next;
+            node->free_fn(node->ptr);
+            pool_free(node);
+            atomic_fetch_sub_explicit(&rcu_pending, 1, memory_order_relaxed);
+        } else {
+            link = &node->next;
+        }
+    }
+}
+
+/* Frees ptr with free_fn once every reader that might still see it has finished; ptr must already be unpublished. */
+void rcu_retire(void *ptr, void (*free_fn)(void *)) {
+    rcu_node_t *node = pool_alloc(sizeof(rcu_node_t), 0);
+    if (!node) {
+        log_msg(LOG_ERROR, "RCU node allocation failed, leaking an object.");
+        return;
+    }
+    node->ptr = ptr;
+    node->free_fn = free_fn;
+    node->epoch = atomic_fetch_add(&rcu_epoch, 1) + 1;
+    pthread_mutex_lock(&rcu_mutex);
+    node->next = rcu_retired;
+    rcu_retired = node;
+    atomic_fetch_add_explicit(&rcu_pending, 1, memory_order_relaxed);
+    rcu_reclaim();
+    pthread_mutex_unlock(&rcu_mutex);
+}
+
+/*
+ * Frees whatever readers have since let go of. Retiring reclaims too, but on a quiet server
+ * nothing may be retired for a long time, so the scheduler thread calls this periodically.
+ */
+void rcu_poll(void) {
+    if (atomic_load_explicit(&rcu_pending, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&rcu_mutex);
+        rcu_reclaim();
+        pthread_mutex_unlock(&rcu_mutex);
+    }
+}
+
+/* Upper bound, in microseconds, of the bucket holding quantile q; 0 if nothing was observed. */
+unsigned long latency_quantile(latency_hist_t *h, double q) {
+    unsigned long total = atomic_load_explicit(&h->count, memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+    unsigned long rank = (unsigned long)(q * total);
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen > rank) {
+            return 1ul << i;
+        }
+    }
+    return 1ul << LATENCY_BUCKETS;
+}
+
+/* Builds a binary frame: op, then (id, name) if name is set, then text_len bytes of text. */
+msg_buf_t *frame_msg(uint8_t op, uint32_t id, const char *name, const char *text, size_t text_len) {
+    size_t cap = FRAME_HEADER_LEN + 5 + NAME_LEN + text_len;
+    msg_buf_t *msg = msg_alloc(cap);
+    if (!msg) {
+        return NULL;
+    }
+    frame_writer_t w;
+    frame_begin(&w, (unsigned char *)msg->data, cap, op);
+    if (name) {
+        frame_put_u32(&w, id);
+        frame_put_name(&w, name);
+    }
+    frame_put_bytes(&w, text, text_len);
+    msg->len = frame_end(&w);
+    return msg;
+}
+
+/* Text clients read one line per message, so line breaks from binary clients become spaces. */
+const char *flatten_lines(const char *text, char *buf, size_t size) {
+    if (!strpbrk(text, "\r\n")) {
+        return text;
+    }
+    snprintf(buf, size, "%s", text);
+    for (char *p = buf; *p; ++p) {
+        if (*p == '\n' || *p == '\r') {
+            *p = ' ';
+        }
+    }
+    return buf;
+}
+
+/*
+ * Fails with ENOBUFS, after telling the peer, once MEM_ADMIT_PERCENT of --mem-limit is in use.
+ * The rest of the limit is headroom for the clients already connected.
+ */
+client_t *client_create(int sockfd, const struct sockaddr_in *addr) {
+    if (mem_limit && atomic_load_explicit(&mem_used, memory_order_relaxed) >= mem_limit / 100 * MEM_ADMIT_PERCENT) {
+        static const char busy[] = "Server: Server is full, try again later.\n";
+        send(sockfd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        atomic_fetch_add_explicit(&stat_mem_rejects, 1, memory_order_relaxed);
+        log_msg(LOG_WARN, "Refusing %s:%d: memory limit reached.", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        errno = ENOBUFS;
+        return NULL;
+    }
+    client_t *cli = conn_alloc(sizeof(client_t), 0);
+    if (!cli) {
+        return NULL;
+    }
+    memset(cli, 0, sizeof(client_t));
+    atomic_fetch_add_explicit(&live_clients, 1, memory_order_relaxed);
+    cli->sockfd = sockfd;
+    cli->addr = *addr;
+    cli->wake_fd = -1;
+    atomic_fetch_add_explicit(&stat_connections, 1, memory_order_relaxed);
+    /* Output is already batched per flush; Nagle would only hold small chat lines back. */
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (server_mode == MODE_THREADS) {
+        cli->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (cli->wake_fd < 0) {
+            atomic_fetch_sub_explicit(&live_clients, 1, memory_order_relaxed);
+            conn_free(cli);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&cli->out_mutex, NULL);
+    return cli;
+}
+
+void client_free(void *arg) {
+    client_t *cli = arg;
+    conn_free(cli->in.data);
+    for (size_t i = 0; i < cli->out_count; ++i) {
+        msg_unref(cli->out_q[(cli->out_head + i) % cli->out_cap]);
+    }
+    conn_free(cli->out_q);
+    conn_free(cli->rate);
+    if (cli->wake_fd >= 0) {
+        close(cli->wake_fd);
+    }
+    pthread_mutex_destroy(&cli->out_mutex);
+    atomic_fetch_sub_explicit(&live_clients, 1, memory_order_relaxed);
+    conn_free(cli);
+}
+
+/* Other threads may still hold cli from a registry view or member set, so freeing waits for them. */
+void client_destroy(client_t *cli) {
+    rcu_retire(cli, client_free);
+}
+
+/* Stops anything more being queued for cli, then closes its socket; nobody can write to a reused fd. */
+void client_close(client_t *cli) {
+    pthread_mutex_lock(&cli->out_mutex);
+    cli->detached = 1;
+    pthread_mutex_unlock(&cli->out_mutex);
+    close(cli->sockfd);
+}
+
+/* Makes room for at least IN_BUF_MIN_READ more bytes; returns the space free at tail. */
+size_t in_buf_reserve(in_buf_t *in) {
+    size_t limit = (max_line > FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD ? max_line : FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD)
+                   + IN_BUF_MIN_READ + (in->held ? RATE_HELD_SLACK : 0);
+    if (in->head == in->tail) {
+        in->head = in->tail = in->scanned = 0;
+    }
+    if (in->cap - in->tail < IN_BUF_MIN_READ && in->head > 0) {
+        memmove(in->data, in->data + in->head, in->tail - in->head);
+        in->tail -= in->head;
+        in->scanned -= in->head;
+        in->head = 0;
+    }
+    if (in->cap - in->tail < IN_BUF_MIN_READ && in->cap < limit) {
+        size_t new_cap = in->cap ? in->cap * 2 : IN_BUF_INITIAL;
+        if (new_cap > limit) {
+            new_cap = limit;
+        }
+        /* The first block is part of what every connection needs; only growth is limited. */
+        char *data = conn_alloc(new_cap, in->cap > 0);
+        if (data) {
+            if (in->tail > 0) {
+                memcpy(data, in->data, in->tail);
+            }
+            conn_free(in->data);
+            in->data = data;
+            in->cap = pool_usable(data);
+        }
+    }
+    return in->cap - in->tail;
+}
+
+/* Gives a drained buffer back to the pool, so an idle connection holds none. */
+void in_buf_release(in_buf_t *in) {
+    conn_free(in->data);
+    in->data = NULL;
+    in->cap = in->head = in->tail = in->scanned = 0;
+}
+
+int in_buf_append(in_buf_t *in, const char *data, size_t len) {
+    while (len > 0) {
+        size_t room = in_buf_reserve(in);
+        if (room == 0) {
+            return -1;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(in->data + in->tail, data, n);
+        in->tail += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+ssize_t client_recv(client_t *cli) {
+    size_t room = in_buf_reserve(&cli->in);
+    if (room == 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t nbytes = recv(cli->sockfd, cli->in.data + cli->in.tail, room, 0);
+    if (nbytes > 0) {
+        cli->in.tail += nbytes;
+        atomic_fetch_add_explicit(&stat_bytes_in, nbytes, memory_order_relaxed);
+    }
+    return nbytes;
+}
+
+/* First '\n' in [p, p + len), compared 32 bytes at a time with AVX2 or 16 with SSE2. */
+char *find_newline(char *p, size_t len) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl32));
+        if (mask) {
+            return p + i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+        if (mask) {
+            return p + i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; ++i) {
+        if (p[i] == '\n') {
+            return p + i;
+        }
+    }
+    return NULL;
+}
+
+uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+size_t client_name_slot(client_t *const *by_name, size_t cap, const char *name) {
+    size_t mask = cap - 1;
+    size_t slot = hash_name(name) & mask;
+    while (by_name[slot] && strcmp(by_name[slot]->name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+size_t registry_name_slot(const registry_t *reg, const char *name) {
+    return client_name_slot(reg->by_name, reg->name_cap, name);
+}
+
+int registry_grow_names(registry_t *reg) {
+    size_t old_cap = reg->name_cap;
+    client_t **old = reg->by_name;
+    size_t new_cap = old_cap ? old_cap * 2 : 64;
+    client_t **names = calloc(new_cap, sizeof(client_t *));
+    if (!names) {
+        return -1;
+    }
+    reg->by_name = names;
+    reg->name_cap = new_cap;
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old[i]) {
+            reg->by_name[registry_name_slot(reg, old[i]->name)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+int registry_reserve(registry_t *reg, int fd) {
+    if (reg->count == reg->cap) {
+        size_t new_cap = reg->cap ? reg->cap * 2 : 64;
+        client_t **items = realloc(reg->items, new_cap * sizeof(client_t *));
+        if (!items) {
+            return -1;
+        }
+        reg->items = items;
+        reg->cap = new_cap;
+    }
+    fd_table_t *old = atomic_load(&reg->by_fd);
+    size_t old_cap = old ? old->cap : 0;
+    if ((size_t)fd >= old_cap) {
+        size_t new_cap = old_cap ? old_cap : 64;
+        while (new_cap <= (size_t)fd) {
+            new_cap *= 2;
+        }
+        fd_table_t *by_fd = calloc(1, sizeof(fd_table_t) + new_cap * sizeof(client_t *));
+        if (!by_fd) {
+            return -1;
+        }
+        by_fd->cap = new_cap;
+        for (size_t i = 0; i < old_cap; ++i) {
+            atomic_init(&by_fd->slots[i], atomic_load_explicit(&old->slots[i], memory_order_relaxed));
+        }
+        atomic_store(&reg->by_fd, by_fd);
+        if (old) {
+            rcu_retire(old, free);
+        }
+    }
+    if ((reg->count + 1) * 2 > reg->name_cap) {
+        return registry_grow_names(reg);
+    }
+    return 0;
+}
+
+client_t *registry_find_name(const registry_t *reg, const char *name) {
+    if (reg->name_cap == 0) {
+        return NULL;
+    }
+    return reg->by_name[registry_name_slot(reg, name)];
+}
+
+/* Safe without clients_mutex inside an RCU read section. */
+client_t *registry_find_fd(registry_t *reg, int fd) {
+    fd_table_t *by_fd = atomic_load_explicit(&reg->by_fd, memory_order_acquire);
+    if (fd < 0 || !by_fd || (size_t)fd >= by_fd->cap) {
+        return NULL;
+    }
+    return atomic_load_explicit(&by_fd->slots[fd], memory_order_acquire);
+}
+
+client_t *registry_find_id(registry_t *reg, uint32_t id) {
+    client_t *cl = registry_find_fd(reg, id & ID_FD_MASK);
+    return cl && cl->id == id ? cl : NULL;
+}
+
+int registry_add(registry_t *reg, client_t *cl) {
+    if (registry_reserve(reg, cl->sockfd) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t slot = registry_name_slot(reg, cl->name);
+    if (reg->by_name[slot]) {
+        errno = EEXIST;
+        return -1;
+    }
+    reg->by_name[slot] = cl;
+    atomic_store_explicit(&atomic_load(&reg->by_fd)->slots[cl->sockfd], cl, memory_order_release);
+    cl->reg_index = reg->count;
+    reg->items[reg->count++] = cl;
+    return 0;
+}
+
+void registry_remove(registry_t *reg, client_t *cl) {
+    size_t mask = reg->name_cap - 1;
+    size_t hole = registry_name_slot(reg, cl->name);
+    reg->by_name[hole] = NULL;
+    /* Backward-shift deletion keeps every probe chain unbroken without tombstones. */
+    for (size_t slot = (hole + 1) & mask; reg->by_name[slot]; slot = (slot + 1) & mask) {
+        size_t home = hash_name(reg->by_name[slot]->name) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            reg->by_name[hole] = reg->by_name[slot];
+            reg->by_name[slot] = NULL;
+            hole = slot;
+        }
+    }
+
+    atomic_store_explicit(&atomic_load(&reg->by_fd)->slots[cl->sockfd], NULL, memory_order_release);
+    client_t *last = reg->items[--reg->count];
+    reg->items[cl->reg_index] = last;
+    last->reg_index = cl->reg_index;
+}
+
+void presence_free(void *ptr) {
+    presence_t *p = ptr;
+    for (int i = 0; i < 2; ++i) {
+        if (p->first_page[i]) {
+            msg_unref(p->first_page[i]);
+        }
+    }
+    free(p->text);
+    free(p->frames);
+    free(p);
+}
+
+/* Called after every join and leave, local or remote; the next /list builds a fresh snapshot. */
+void presence_invalidate(void) {
+    atomic_fetch_add(&presence_gen, 1);
+    presence_t *old = atomic_exchange(&presence, NULL);
+    if (old) {
+        rcu_retire(old, presence_free);
+    }
+}
+
+void registry_view_free(void *view) {
+    free(atomic_exchange(&client_view_spare, (registry_view_t *)view));
+}
+
+/* Called with clients_mutex held after every change; readers switch to the new view as they start. */
+void registry_publish(registry_t *reg) {
+    registry_view_t *view = atomic_exchange(&client_view_spare, NULL);
+    if (view && view->name_cap != reg->name_cap) {
+        free(view);
+        view = NULL;
+    }
+    if (!view && (view = malloc(sizeof(registry_view_t) + reg->name_cap * sizeof(client_t *))) == NULL) {
+        log_msg(LOG_ERROR, "Registry view allocation failed, readers keep the previous one.");
+        return;
+    }
+    view->count = reg->count;
+    view->name_cap = reg->name_cap;
+    memcpy(view->by_name, reg->by_name, reg->name_cap * sizeof(client_t *));
+    registry_view_t *old = atomic_exchange(&client_view, view);
+    if (old) {
+        rcu_retire(old, registry_view_free);
+    }
+    presence_invalidate();
+}
+
+/* Looks name up in the current view; call inside an RCU read section. */
+client_t *client_lookup(const char *name) {
+    registry_view_t *view = atomic_load(&client_view);
+    if (!view || view->name_cap == 0) {
+        return NULL;
+    }
+    return view->by_name[client_name_slot(view->by_name, view->name_cap, name)];
+}
+
+size_t room_name_slot(const room_dir_t *dir, const char *name) {
+    size_t mask = dir->name_cap - 1;
+    size_t slot = hash_name(name) & mask;
+    while (dir->by_name[slot] && strcmp(dir->by_name[slot]->name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+int room_dir_grow_names(room_dir_t *dir) {
+    size_t old_cap = dir->name_cap;
+    room_t **old = dir->by_name;
+    size_t new_cap = old_cap ? old_cap * 2 : 64;
+    room_t **names = calloc(new_cap, sizeof(room_t *));
+    if (!names) {
+        return -1;
+    }
+    dir->by_name = names;
+    dir->name_cap = new_cap;
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old[i]) {
+            dir->by_name[room_name_slot(dir, old[i]->name)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+room_t *room_dir_find(const room_dir_t *dir, const char *name) {
+    if (dir->name_cap == 0) {
+        return NULL;
+    }
+    return dir->by_name[room_name_slot(dir, name)];
+}
+
+int room_dir_add(room_dir_t *dir, room_t *room) {
+    if (dir->count == dir->cap) {
+        size_t new_cap = dir->cap ? dir->cap * 2 : 16;
+        room_t **items = realloc(dir->items, new_cap * sizeof(room_t *));
+        if (!items) {
+            return -1;
+        }
+        dir->items = items;
+        dir->cap = new_cap;
+    }
+    if ((dir->count + 1) * 2 > dir->name_cap && room_dir_grow_names(dir) < 0) {
+        return -1;
+    }
+    dir->by_name[room_name_slot(dir, room->name)] = room;
+    room->dir_index = dir->count;
+    dir->items[dir->count++] = room;
+    return 0;
+}
+
+void room_dir_remove(room_dir_t *dir, room_t *room) {
+    size_t mask = dir->name_cap - 1;
+    size_t hole = room_name_slot(dir, room->name);
+    dir->by_name[hole] = NULL;
+    for (size_t slot = (hole + 1) & mask; dir->by_name[slot]; slot = (slot + 1) & mask) {
+        size_t home = hash_name(dir->by_name[slot]->name) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            dir->by_name[hole] = dir->by_name[slot];
+            dir->by_name[slot] = NULL;
+            hole = slot;
+        }
+    }
+
+    room_t *last = dir->items[--dir->count];
+    dir->items[room->dir_index] = last;
+    last->dir_index = room->dir_index;
+}
+
+room_t *room_create(const char *name) {
+    room_t *room = calloc(1, sizeof(room_t));
+    if (!room) {
+        return NULL;
+    }
+    room->by_shard = calloc(shard_count, sizeof(*room->by_shard));
+    if (!room->by_shard) {
+        free(room);
+        return NULL;
+    }
+    strncpy(room->name, name, NAME_LEN - 1);
+    pthread_mutex_init(&room->mutex, NULL);
+    return room;
+}
+
+void room_free(void *arg) {
+    room_t *room = arg;
+    for (int i = 0; i < shard_count; ++i) {
+        free(atomic_load(&room->by_shard[i]));
+    }
+    free(room->by_shard);
+    pthread_mutex_destroy(&room->mutex);
+    free(room);
+}
+
+/* A shard loop may have found the room just before it was removed from the directory. */
+void room_destroy(room_t *room) {
+    rcu_retire(room, room_free);
+}
+
+/* Puts cl in the named room, creating it on first use. */
+int room_enter(client_t *cl, const char *name) {
+    pthread_mutex_lock(&rooms_mutex);
+    room_t *room = room_dir_find(&rooms, name);
+    if (!room) {
+        room = room_create(name);
+        if (!room || room_dir_add(&rooms, room) < 0) {
+            if (room) {
+                room_destroy(room);
+            }
+            pthread_mutex_unlock(&rooms_mutex);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&room->mutex);
+    member_set_t *old = atomic_load(&room->by_shard[cl->shard->id]);
+    size_t count = old ? old->count : 0;
+    member_set_t *set = malloc(sizeof(member_set_t) + (count + 1) * sizeof(client_t *));
+    int rc = set ? 0 : -1;
+    if (set) {
+        if (count > 0) {
+            memcpy(set->items, old->items, count * sizeof(client_t *));
+        }
+        cl->member_index = count;
+        set->items[count] = cl;
+        set->count = count + 1;
+        atomic_store(&room->by_shard[cl->shard->id], set);
+        if (old) {
+            rcu_retire(old, free);
+        }
+        room->member_count++;
+        cl->room = room;
+    }
+    pthread_mutex_unlock(&room->mutex);
+    if (rc < 0 && room->member_count == 0 && room != lobby) {
+        room_dir_remove(&rooms, room);
+        room_destroy(room);
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    if (rc < 0) {
+        errno = ENOMEM;
+    }
+    return rc;
+}
+
+/* Takes cl out of its room; an emptied room other than the lobby is freed. */
+void room_leave(client_t *cl) {
+    room_t *room = cl->room;
+    if (!room) {
+        return;
+    }
+    pthread_mutex_lock(&rooms_mutex);
+    pthread_mutex_lock(&room->mutex);
+    member_set_t *old = atomic_load(&room->by_shard[cl->shard->id]);
+    size_t count = old->count - 1;
+    member_set_t *set = NULL;
+    if (count > 0 && (set = malloc(sizeof(member_set_t) + count * sizeof(client_t *))) != NULL) {
+        memcpy(set->items, old->items, count * sizeof(client_t *));
+        if (cl->member_index < count) {
+            client_t *last = old->items[count];
+            set->items[cl->member_index] = last;
+            last->member_index = cl->member_index;
+        }
+        set->count = count;
+    }
+    if (count > 0 && !set) {
+        /* Without memory for a copy, shrink in place: a concurrent reader may see the moved member twice. */
+        client_t *last = old->items[count];
+        old->items[cl->member_index] = last;
+        last->member_index = cl->member_index;
+        old->count = count;
+    } else {
+        atomic_store(&room->by_shard[cl->shard->id], set);
+        rcu_retire(old, free);
+    }
+    room->member_count--;
+    int empty = room->member_count == 0 && room != lobby;
+    pthread_mutex_unlock(&room->mutex);
+    if (empty) {
+        room_dir_remove(&rooms, room);
+        room_destroy(room);
+    }
+    cl->room = NULL;
+    pthread_mutex_unlock(&rooms_mutex);
+}
+
+void client_watch(client_t *cli, int want_write) {
+    cli->want_write = want_write;
+    if (server_mode == MODE_THREADS) {
+        if (want_write) {
+            uint64_t one = 1;
+            if (write(cli->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                log_msg(LOG_ERROR, "Client %s eventfd write failed: %s", cli->name, strerror(errno));
+            }
+        }
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = (cli->rate && cli->rate->resume_ms ? 0 : EPOLLIN) | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = cli;
+    if (epoll_ctl(cli->shard->epoll_fd, EPOLL_CTL_MOD, cli->sockfd, &ev) < 0) {
+        log_msg(LOG_ERROR, "Client %s epoll_ctl(MOD) failed: %s", cli->name, strerror(errno));
+    }
+}
+
+void out_queue_pop(client_t *cli) {
+    msg_unref(cli->out_q[cli->out_head]);
+    cli->out_head = (cli->out_head + 1) % cli->out_cap;
+    cli->out_count--;
+    cli->out_off = 0;
+}
+
+int out_queue_push(client_t *cli, msg_buf_t *msg) {
+    if (cli->out_count == cli->out_cap) {
+        size_t new_cap = cli->out_cap ? cli->out_cap * 2 : OUT_QUEUE_INITIAL;
+        if (new_cap > queue_limit) {
+            new_cap = queue_limit;
+        }
+        msg_buf_t **new_q = conn_alloc(new_cap * sizeof(msg_buf_t *), cli->out_cap > 0);
+        if (!new_q) {
+            return -1;
+        }
+        for (size_t i = 0; i < cli->out_count; ++i) {
+            new_q[i] = cli->out_q[(cli->out_head + i) % cli->out_cap];
+        }
+        conn_free(cli->out_q);
+        cli->out_q = new_q;
+        cli->out_head = 0;
+        cli->out_cap = new_cap;
+    }
+    msg_ref(msg);
+    cli->out_q[(cli->out_head + cli->out_count) % cli->out_cap] = msg;
+    cli->out_count++;
+    if (cli->out_count > cli->out_peak) {
+        cli->out_peak = cli->out_count;
+    }
+    return 0;
+}
+
+/* Applies the slow-consumer policy when the queue is full; returns 1 if the new message should still be queued. */
+int out_queue_make_room(client_t *cli) {
+    if (cli->out_count < queue_limit) {
+        return 1;
+    }
+    cli->out_drops++;
+    atomic_fetch_add(&stat_out_drops, 1);
+
+    if (slow_policy == SLOW_DISCONNECT) {
+        if (!cli->slow_disconnect) {
+            cli->slow_disconnect = 1;
+            atomic_fetch_add(&stat_slow_disconnects, 1);
+            shutdown(cli->sockfd, SHUT_RDWR);
+        }
+        return 0;
+    }
+    /* A partially written head, and anything the kernel is still sending, must stay in front. */
+    size_t pinned = cli->out_inflight > 0 ? cli->out_inflight : (cli->out_off > 0 ? 1 : 0);
+    if (slow_policy == SLOW_DROP_NEWEST || pinned >= cli->out_count) {
+        return 0;
+    }
+
+    /* The oldest unsent message goes, and the pinned ones move up into its slot. */
+    size_t victim = (cli->out_head + pinned) % cli->out_cap;
+    msg_unref(cli->out_q[victim]);
+    for (size_t i = pinned; i > 0; --i) {
+        cli->out_q[(cli->out_head + i) % cli->out_cap] = cli->out_q[(cli->out_head + i - 1) % cli->out_cap];
+    }
+    cli->out_head = (cli->out_head + 1) % cli->out_cap;
+    cli->out_count--;
+    return 1;
+}
+
+/* Fills iov from the front of the queue; returns the number of entries and the byte total in *total. */
+size_t out_queue_iov(client_t *cli, struct iovec *iov, size_t *total) {
+    size_t n_iov = 0;
+    *total = 0;
+    while (n_iov < cli->out_count && n_iov < FLUSH_IOV_MAX) {
+        msg_buf_t *msg = cli->out_q[(cli->out_head + n_iov) % cli->out_cap];
+        size_t skip = n_iov == 0 ? cli->out_off : 0;
+        iov[n_iov].iov_base = msg->data + skip;
+        iov[n_iov].iov_len = msg->len - skip;
+        *total += iov[n_iov].iov_len;
+        ++n_iov;
+    }
+    return n_iov;
+}
+
+/* Accounts for one write of n bytes from the front of the queue. */
+void out_queue_consume(client_t *cli, size_t n) {
+    cli->out_writes++;
+    atomic_fetch_add_explicit(&stat_write_calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_bytes_out, n, memory_order_relaxed);
+
+    unsigned long delivered = 0;
+    while (n > 0) {
+        msg_buf_t *head = cli->out_q[cli->out_head];
+        size_t left = head->len - cli->out_off;
+        if (n < left) {
+            cli->out_off += n;
+            break;
+        }
+        n -= left;
+        out_queue_pop(cli);
+        ++delivered;
+    }
+    cli->out_msgs += delivered;
+    atomic_fetch_add_explicit(&stat_msgs_delivered, delivered, memory_order_relaxed);
+
+    /* A queue that grew during a burst is given back once it drains. */
+    if (cli->out_count == 0 && cli->out_cap > OUT_QUEUE_INITIAL) {
+        conn_free(cli->out_q);
+        cli->out_q = NULL;
+        cli->out_cap = 0;
+        cli->out_head = 0;
+    }
+}
+
+/* Writes as much of the queue as the socket takes, up to FLUSH_IOV_MAX messages per sendmsg(). */
+int client_flush_locked(client_t *cli) {
+    while (cli->out_count > 0) {
+        struct iovec iov[FLUSH_IOV_MAX];
+        size_t total;
+        size_t n_iov = out_queue_iov(cli, iov, &total);
+
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = n_iov;
+        ssize_t n = sendmsg(cli->sockfd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            atomic_fetch_add_explicit(&stat_send_errors, 1, memory_order_relaxed);
+            return -1;
+        }
+        out_queue_consume(cli, n);
+        if ((size_t)n < total) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Asks the owner to keep writing only while something is still queued. */
+void client_update_watch(client_t *cli) {
+    if (cli->out_count == 0 && cli->want_write) {
+        client_watch(cli, 0);
+    } else if (cli->out_count > 0 && !cli->want_write) {
+        client_watch(cli, 1);
+    }
+}
+
+/* Puts cli on its shard's list of clients to flush before the loop next waits. */
+void dirty_link(client_t *cli) {
+    if (cli->dirty) {
+        return;
+    }
+    cli->dirty = 1;
+    cli->dirty_prev = NULL;
+    cli->dirty_next = cli->shard->dirty_head;
+    if (cli->shard->dirty_head) {
+        cli->shard->dirty_head->dirty_prev = cli;
+    }
+    cli->shard->dirty_head = cli;
+}
+
+void dirty_unlink(client_t *cli) {
+    if (!cli->dirty) {
+        return;
+    }
+    if (cli->dirty_prev) {
+        cli->dirty_prev->dirty_next = cli->dirty_next;
+    } else {
+        cli->shard->dirty_head = cli->dirty_next;
+    }
+    if (cli->dirty_next) {
+        cli->dirty_next->dirty_prev = cli->dirty_prev;
+    }
+    cli->dirty = 0;
+}
+
+/*
+ * Event-loop clients that have not sent their name yet, oldest first. They all get the same
+ * timeout, so appending keeps the list sorted by deadline.
+ */
+void handshake_track(client_t *cli) {
+    shard_t *sh = cli->shard;
+    cli->handshake_deadline = monotonic_ms() + handshake_timeout_ms;
+    cli->handshake_next = NULL;
+    cli->handshake_prev = sh->handshake_tail;
+    if (sh->handshake_tail) {
+        sh->handshake_tail->handshake_next = cli;
+    } else {
+        sh->handshake_head = cli;
+    }
+    sh->handshake_tail = cli;
+}
+
+void handshake_untrack(client_t *cli) {
+    if (!cli->handshake_deadline) {
+        return;
+    }
+    shard_t *sh = cli->shard;
+    if (cli->handshake_prev) {
+        cli->handshake_prev->handshake_next = cli->handshake_next;
+    } else {
+        sh->handshake_head = cli->handshake_next;
+    }
+    if (cli->handshake_next) {
+        cli->handshake_next->handshake_prev = cli->handshake_prev;
+    } else {
+        sh->handshake_tail = cli->handshake_prev;
+    }
+    cli->handshake_deadline = 0;
+}
+
+/* Untracks and returns the oldest handshake if it has timed out; otherwise sets *wait_ms to the time left (-1 if none). */
+client_t *handshake_expired(shard_t *sh, int *wait_ms) {
+    client_t *cli = sh->handshake_head;
+    *wait_ms = -1;
+    if (!cli) {
+        return NULL;
+    }
+    uint64_t now = monotonic_ms();
+    if (cli->handshake_deadline > now) {
+        *wait_ms = (int)(cli->handshake_deadline - now);
+        return NULL;
+    }
+    handshake_untrack(cli);
+    atomic_fetch_add_explicit(&stat_handshake_timeouts, 1, memory_order_relaxed);
+    log_msg(LOG_WARN, "Closing %s:%d (fd %d): no name within %d ms.", inet_ntoa(cli->addr.sin_addr),
+            ntohs(cli->addr.sin_port), cli->sockfd, handshake_timeout_ms);
+    return cli;
+}
+
+/*
+ * Queues a reference to msg for cli. The event loop flushes its own clients once per wakeup so that
+ * a burst of messages leaves in one sendmsg(); other threads hand the write to the client's owner
+ * unless a full batch has already built up. In io_uring mode only the owning shard ever queues
+ * (everything else goes through the shard inbox), and all sends are left to its loop.
+ */
+void client_queue_locked(client_t *cli, msg_buf_t *msg) {
+    if (cli->detached || cli->slow_disconnect || !out_queue_make_room(cli)) {
+        return;
+    }
+    if (out_queue_push(cli, msg) < 0) {
+        /* Over --mem-limit a queue that cannot grow sheds like a full one. */
+        cli->out_drops++;
+        atomic_fetch_add(&stat_out_drops, 1);
+        if (errno != ENOBUFS) {
+            log_msg(LOG_ERROR, "Client %s output queue allocation failed, dropping message.", cli->name);
+        }
+    } else if (cli->out_count >= FLUSH_IOV_MAX && server_mode != MODE_URING) {
+        /* A full batch is ready, so there is nothing to gain from waiting for the owner. */
+        if (client_flush_locked(cli) == 0) {
+            client_update_watch(cli);
+        }
+    } else if (cli->shard == current_shard) {
+        if (!cli->want_write) {
+            dirty_link(cli);
+        }
+    } else if (!cli->want_write) {
+        client_watch(cli, 1);
+    }
+}
+
+void client_send_msg(client_t *cli, msg_buf_t *msg) {
+    pthread_mutex_lock(&cli->out_mutex);
+    client_queue_locked(cli, msg);
+    pthread_mutex_unlock(&cli->out_mutex);
+}
+
+/* Sends server text to one client; binary clients get it as an OP_NOTICE frame. */
+void client_send(client_t *cli, const char *data, size_t len) {
+    msg_buf_t *msg;
+    if (cli->binary) {
+        msg = frame_msg(OP_NOTICE, 0, NULL, data, len > 0 && data[len - 1] == '\n' ? len - 1 : len);
+    } else if ((msg = msg_alloc(len)) != NULL) {
+        memcpy(msg->data, data, len);
+    }
+    if (!msg) {
+        log_msg(alloc_failure_level(), "Client %s message allocation failed, dropping message.", cli->name);
+        return;
+    }
+    client_send_msg(cli, msg);
+    msg_unref(msg);
+}
+
+/* Drains what the socket will take without blocking; returns -1 once the connection is unusable. */
+int client_drain(client_t *cli) {
+    pthread_mutex_lock(&cli->out_mutex);
+    int rc = client_flush_locked(cli);
+    if (rc == 0) {
+        client_update_watch(cli);
+    }
+    pthread_mutex_unlock(&cli->out_mutex);
+    return rc;
+}
+
+void client_send_str(client_t *cli, const char *str) {
+    client_send(cli, str, strlen(str));
+}
+
+/* Mailbox files are named by the hex bytes of the user name, so any name is a safe file name. */
+void mailbox_path(char *path, size_t size, const char *name) {
+    int n = snprintf(path, size, "%s/", mailbox_dir);
+    for (const unsigned char *p = (const unsigned char *)name; *p && n + 3 < (int)size; ++p) {
+        n += snprintf(path + n, size - n, "%02x", *p);
+    }
+    snprintf(path + n, size - n, ".mbox");
+}
+
+/*
+ * Orders PMs for one user against its joins. A sender holds it from the check that the recipient
+ * is offline until the store is queued, and a join holds it while the client is registered and
+ * its delivery is queued. The mail thread works through its queue in order, so a PM is either
+ * stored before the join's delivery reads the mailbox or sent live. No file I/O happens under it.
+ */
+pthread_mutex_t *mailbox_lock(const char *name) {
+    return &mailbox_locks[hash_name(name) & (MAILBOX_LOCKS - 1)];
+}
+
+int mailbox_sync_dir(void) {
+    int fd = open(mailbox_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/*
+ * Saves a PM for an offline user. A mailbox is a file of OP_PRIVATE frames (sender id 0),
+ * appended with one write each and synced before the sender is told it was stored. Only the
+ * mail thread touches mailbox files.
+ */
+int mailbox_store(const char *recipient_name, const char *sender_name, const char *message) {
+    unsigned char frame[FRAME_HEADER_LEN + 5 + NAME_LEN + BUFFER_SIZE];
+    char path[PATH_MAX];
+    size_t len = strlen(message);
+    frame_writer_t w;
+    frame_begin(&w, frame, sizeof(frame), OP_PRIVATE);
+    frame_put_u32(&w, 0);
+    frame_put_name(&w, sender_name);
+    frame_put_bytes(&w, message, len < BUFFER_SIZE ? len : BUFFER_SIZE);
+    int frame_len = frame_end(&w);
+
+    mailbox_path(path, sizeof(path), recipient_name);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_msg(LOG_ERROR, "Cannot open mailbox of %s: %s", recipient_name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size + frame_len > MAILBOX_MAX_BYTES) {
+        close(fd);
+        errno = EFBIG;
+        return -1;
+    }
+    ssize_t n = write(fd, frame, frame_len);
+    if (n != frame_len || fsync(fd) < 0) {
+        if (n == frame_len) {
+            log_msg(LOG_ERROR, "Cannot sync mailbox of %s: %s", recipient_name, strerror(errno));
+        } else {
+            log_msg(LOG_ERROR, "Cannot write mailbox of %s: %s", recipient_name, n < 0 ? strerror(errno) : "short write");
+        }
+        /* Drop a partial or unsynced frame so the rest of the mailbox stays readable. */
+        if (n > 0 && ftruncate(fd, st.st_size) < 0) {
+            log_msg(LOG_ERROR, "Cannot truncate mailbox of %s: %s", recipient_name, strerror(errno));
+        }
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    /* An empty file was just created; its directory entry has to be durable too. */
+    if (st.st_size == 0 && mailbox_sync_dir() < 0) {
+        log_msg(LOG_ERROR, "Cannot sync mailbox directory %s: %s", mailbox_dir, strerror(errno));
+        return -1;
+    }
+    atomic_fetch_add_explicit(&stat_mail_stored, 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Reads name's mailbox without removing it; *size is the number of bytes of whole frames in
+ * *data. Returns -1, leaving the file alone, if there is no mailbox or it cannot be read.
+ */
+int mailbox_load(const char *name, char **data, size_t *size, int *count) {
+    char path[PATH_MAX];
+    mailbox_path(path, sizeof(path), name);
+    *data = NULL;
+    *size = 0;
+    *count = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_msg(LOG_ERROR, "Cannot open mailbox of %s: %s", name, strerror(errno));
+        }
+        return -1;
+    }
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL) {
+        while (len < (size_t)st.st_size) {
+            ssize_t n = read(fd, buf + len, st.st_size - len);
+            if (n <= 0) {
+                break;
+            }
+            len += n;
+        }
+    }
+    close(fd);
+    if (!buf || len < (size_t)st.st_size) {
+        log_msg(LOG_ERROR, "Mailbox of %s could not be loaded, keeping it.", name);
+        free(buf);
+        return -1;
+    }
+
+    /* A frame cut short by a crash mid-append ends the mailbox. */
+    size_t valid = 0;
+    while (len - valid >= FRAME_HEADER_LEN) {
+        uint32_t frame_len = frame_get_be32((unsigned char *)buf + valid);
+        if (frame_len > len - valid - FRAME_HEADER_LEN || buf[valid + 4] != (char)OP_PRIVATE) {
+            break;
+        }
+        valid += FRAME_HEADER_LEN + frame_len;
+        ++*count;
+    }
+    *data = buf;
+    *size = valid;
+    return 0;
+}
+
+void mailbox_remove(const char *name) {
+    char path[PATH_MAX];
+    mailbox_path(path, sizeof(path), name);
+    if (unlink(path) < 0 && errno != ENOENT) {
+        log_msg(LOG_ERROR, "Cannot remove mailbox of %s: %s", name, strerror(errno));
+    }
+}
+
+/* Queues a job for the mail thread; text is copied. Called with name's mailbox lock held. */
+int mail_queue(mail_job_kind_t kind, const char *name, uint32_t id, const char *sender, const char *origin,
+               const char *text) {
+    size_t len = text ? strlen(text) + 1 : 1;
+    mail_job_t *job = pool_alloc(sizeof(mail_job_t) + len, 1);
+    if (!job) {
+        return -1;
+    }
+    job->next = NULL;
+    job->kind = kind;
+    job->id = id;
+    snprintf(job->name, NAME_LEN, "%s", name);
+    snprintf(job->sender, NAME_LEN, "%s", sender ? sender : "");
+    snprintf(job->origin, NAME_LEN, "%s", origin ? origin : "");
+    memcpy(job->text, text ? text : "", len);
+    pthread_mutex_lock(&mail_mutex);
+    if (mail_tail) {
+        mail_tail->next = job;
+    } else {
+        mail_head = job;
+    }
+    mail_tail = job;
+    pthread_cond_signal(&mail_cond);
+    pthread_mutex_unlock(&mail_mutex);
+    return 0;
+}
+
+/* Waits until the mail thread has nothing queued or in hand; the upgrade calls it with every loop parked. */
+void mail_wait_idle(void) {
+    pthread_mutex_lock(&mail_mutex);
+    while (mail_head || mail_busy) {
+        pthread_cond_wait(&mail_idle, &mail_mutex);
+    }
+    pthread_mutex_unlock(&mail_mutex);
+}
+
+void link_wake(void) {
+    uint64_t one = 1;
+    if (write(link_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_msg(LOG_ERROR, "Link eventfd write failed: %s", strerror(errno));
+    }
+}
+
+/*
+ * Past LINK_HIGH_WATER a link is congested and local senders' reads are paused until it drains
+ * (see rate_admit()). A link more than LINK_QUEUE_BYTES behind anyway stops taking frames and is
+ * reset by the link thread. Returns -1 if the frame was not queued.
+ */
+int link_queue_locked(link_t *l, const void *frame, size_t len) {
+    if (l->overflow) {
+        return -1;
+    }
+    if (l->out_off == l->out_len) {
+        l->out_off = l->out_len = 0;
+    }
+    if (l->out_len - l->out_off + len > LINK_QUEUE_BYTES) {
+        l->overflow = 1;
+        link_wake();
+        return -1;
+    }
+    if (l->out_len + len > l->out_cap && l->out_off > 0) {
+        memmove(l->out, l->out + l->out_off, l->out_len - l->out_off);
+        l->out_len -= l->out_off;
+        l->out_off = 0;
+    }
+    if (l->out_len + len > l->out_cap) {
+        size_t new_cap = l->out_cap ? l->out_cap : 4096;
+        while (new_cap < l->out_len + len) {
+            new_cap *= 2;
+        }
+        char *out = pool_alloc(new_cap, 1);
+        if (!out) {
+            log_msg(alloc_failure_level(), "Link to %s: queue allocation failed, resetting.", l->node);
+            l->overflow = 1;
+            link_wake();
+            return -1;
+        }
+        if (l->out) {
+            memcpy(out, l->out, l->out_len);
+            pool_free(l->out);
+        }
+        l->out = out;
+        l->out_cap = new_cap;
+    }
+    int was_empty = l->out_len == l->out_off;
+    memcpy(l->out + l->out_len, frame, len);
+    l->out_len += len;
+    atomic_fetch_add_explicit(&stat_link_frames_out, 1, memory_order_relaxed);
+    if (!l->congested && l->out_len - l->out_off > LINK_HIGH_WATER) {
+        l->congested = 1;
+        atomic_fetch_add(&links_congested, 1);
+        log_msg(LOG_WARN, "Link to %s is %zu bytes behind; pausing local senders.", l->node, l->out_len - l->out_off);
+    }
+    if (was_empty && l->up) {
+        link_wake();
+    }
+    return 0;
+}
+
+/* Queues frame once on every link that is up. Frames are never relayed, so this reaches each node once. */
+void link_publish(const unsigned char *frame, int len) {
+    if (len < 0) {
+        return;
+    }
+    pthread_mutex_lock(&links_mutex);
+    for (link_t *l = links; l; l = l->next) {
+        if (l->up) {
+            pthread_mutex_lock(&l->mutex);
+            link_queue_locked(l, frame, len);
+            pthread_mutex_unlock(&l->mutex);
+        }
+    }
+    pthread_mutex_unlock(&links_mutex);
+}
+
+/* LINK_JOIN or LINK_PART. Called under clients_mutex, which orders it against link_up()'s snapshot. */
+void link_send_presence(uint8_t op, const char *name) {
+    if (atomic_load(&links_up) == 0) {
+        return;
+    }
+    unsigned char frame[FRAME_HEADER_LEN + 2 * NAME_LEN];
+    frame_writer_t w;
+    frame_begin(&w, frame, sizeof(frame), op);
+    frame_put_name(&w, node_name);
+    frame_put_name(&w, name);
+    link_publish(frame, frame_end(&w));
+}
+
+/* The text is cut at BUFFER_SIZE, which is as much as any text client is shown. */
+void link_send_say(const char *room, const char *sender_name, const char *text, int keep_history) {
+    if (atomic_load(&links_up) == 0) {
+        return;
+    }
+    unsigned char frame[FRAME_HEADER_LEN + LINK_MAX_PAYLOAD];
+    uint8_t flag = keep_history ? 1 : 0;
+    size_t len = strnlen(text, BUFFER_SIZE);
+    frame_writer_t w;
+    frame_begin(&w, frame, sizeof(frame), LINK_SAY);
+    frame_put_name(&w, node_name);
+    frame_put_name(&w, room);
+    frame_put_name(&w, sender_name);
+    frame_put_bytes(&w, &flag, 1);
+    frame_put_bytes(&w, text, len);
+    link_publish(frame, frame_end(&w));
+}
+
+size_t remote_slot(const char *name) {
+    return hash_name(name) & (remote_cap - 1);
+}
+
+/* Returns the entry for name, or NULL. Called under remote_mutex. */
+remote_user_t *remote_find(const char *name) {
+    if (remote_cap == 0) {
+        return NULL;
+    }
+    remote_user_t *u = remote_users[remote_slot(name)];
+    while (u && strcmp(u->name, name) != 0) {
+        u = u->next;
+    }
+    return u;
+}
+
+int remote_user_known(const char *name) {
+    pthread_mutex_lock(&remote_mutex);
+    int known = remote_find(name) != NULL;
+    pthread_mutex_unlock(&remote_mutex);
+    return known;
+}
+
+/* Forwards a PM to the node recipient_name is on; returns -1 if no node has announced that user or its link cannot take it. */
+int link_send_pm(const char *sender_name, const char *recipient_name, const char *text) {
+    if (atomic_load(&links_up) == 0) {
+        return -1;
+    }
+    unsigned char frame[FRAME_HEADER_LEN + LINK_MAX_PAYLOAD];
+    frame_writer_t w;
+    frame_begin(&w, frame, sizeof(frame), LINK_PM);
+    frame_put_name(&w, node_name);
+    frame_put_name(&w, sender_name);
+    frame_put_name(&w, recipient_name);
+    frame_put_bytes(&w, text, strnlen(text, BUFFER_SIZE));
+    int len = frame_end(&w);
+
+    /* A link is only freed after its users are forgotten, so holding remote_mutex keeps it alive. */
+    pthread_mutex_lock(&remote_mutex);
+    remote_user_t *u = remote_find(recipient_name);
+    int queued = -1;
+    if (u && len > 0) {
+        pthread_mutex_lock(&u->link->mutex);
+        queued = link_queue_locked(u->link, frame, len);
+        pthread_mutex_unlock(&u->link->mutex);
+    }
+    pthread_mutex_unlock(&remote_mutex);
+    return queued;
+}
+
+/* Stops /watch deliveries to cli; harmless if it never subscribed. */
+void presence_unsubscribe(client_t *cli) {
+    pthread_mutex_lock(&subscribers_mutex);
+    if (cli->subscribed) {
+        shard_t *sh = cli->shard;
+        client_t *last = sh->subscribers[--sh->subscriber_count];
+        sh->subscribers[cli->sub_index] = last;
+        last->sub_index = cli->sub_index;
+        cli->subscribed = 0;
+        atomic_fetch_sub(&subscriber_total, 1);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+}
+
+/* Names are unique across the whole server and every linked node. The welcome is queued before the
+ * client is published; stored mail follows from the mail thread, so a PM sent meanwhile goes first. */
+int add_client(client_t *cl) {
+    pthread_mutex_t *mail_lock = NULL;
+    if (mailbox_dir) {
+        mail_lock = mailbox_lock(cl->name);
+        pthread_mutex_lock(mail_lock);
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    /* Ids are the fd plus a generation, so lookups go through by_fd and stale ids miss. */
+    id_generation = (id_generation + 1) & (UINT32_MAX >> ID_FD_BITS);
+    cl->id = (id_generation << ID_FD_BITS) | ((uint32_t)cl->sockfd & ID_FD_MASK);
+    if (cl->binary) {
+        atomic_fetch_add(&binary_clients, 1);
+    }
+    int added;
+    if (remote_user_known(cl->name)) {
+        errno = EEXIST;
+        added = -1;
+    } else {
+        added = registry_add(&clients, cl);
+    }
+    if (added < 0 && cl->binary) {
+        atomic_fetch_sub(&binary_clients, 1);
+    }
+    if (added == 0 && cl->binary) {
+        msg_buf_t *welcome = frame_msg(OP_WELCOME, cl->id, cl->name, "", 0);
+        if (welcome) {
+            client_send_msg(cl, welcome);
+            msg_unref(welcome);
+        }
+    }
+    if (added == 0) {
+        registry_publish(&clients);
+        link_send_presence(LINK_JOIN, cl->name);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    if (mail_lock) {
+        /* While load is being shed the mailbox stays on disk for a later join. */
+        if (added == 0 && !atomic_load_explicit(&mem_shedding, memory_order_relaxed) &&
+            mail_queue(MAIL_DELIVER, cl->name, cl->id, NULL, NULL, NULL) < 0) {
+            log_msg(alloc_failure_level(), "Mail job allocation failed, keeping the mailbox of %s.", cl->name);
+        }
+        pthread_mutex_unlock(mail_lock);
+    }
+    return added;
+}
+
+void remove_client(int sockfd) {
+    pthread_mutex_lock(&clients_mutex);
+    client_t *cl = registry_find_fd(&clients, sockfd);
+    if (cl) {
+        registry_remove(&clients, cl);
+        presence_unsubscribe(cl);
+        registry_publish(&clients);
+        link_send_presence(LINK_PART, cl->name);
+        room_leave(cl);
+        if (cl->binary) {
+            atomic_fetch_sub(&binary_clients, 1);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+size_t history_room_slot(const history_room_t *table, size_t cap, const char *name) {
+    size_t mask = cap - 1;
+    size_t slot = hash_name(name) & mask;
+    while (table[slot].name[0] && strcmp(table[slot].name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/* Rebuilds the room index at cap, dropping rooms whose newest record has rotated out. */
+int history_rooms_rebuild(size_t cap) {
+    history_room_t *table = calloc(cap, sizeof(history_room_t));
+    if (!table) {
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < history_rooms_cap; ++i) {
+        history_room_t *r = &history_rooms[i];
+        if (r->name[0] && r->last / HISTORY_SEGMENT_RECORDS >= history_first) {
+            table[history_room_slot(table, cap, r->name)] = *r;
+            ++count;
+        }
+    }
+    free(history_rooms);
+    history_rooms = table;
+    history_rooms_cap = cap;
+    history_rooms_count = count;
+    return 0;
+}
+
+uint64_t history_room_last(const char *room) {
+    if (history_rooms_cap == 0) {
+        return HISTORY_NONE;
+    }
+    history_room_t *r = &history_rooms[history_room_slot(history_rooms, history_rooms_cap, room)];
+    return r->name[0] ? r->last : HISTORY_NONE;
+}
+
+int history_room_set_last(const char *room, uint64_t id) {
+    if ((history_rooms_count + 1) * 2 > history_rooms_cap &&
+        history_rooms_rebuild(history_rooms_cap ? history_rooms_cap * 2 : 64) < 0) {
+        return -1;
+    }
+    history_room_t *r = &history_rooms[history_room_slot(history_rooms, history_rooms_cap, room)];
+    if (!r->name[0]) {
+        strncpy(r->name, room, NAME_LEN - 1);
+        history_rooms_count++;
+    }
+    r->last = id;
+    return 0;
+}
+
+history_record_t *history_record(uint64_t id) {
+    uint64_t seq = id / HISTORY_SEGMENT_RECORDS;
+    if (id == HISTORY_NONE || seq < history_first || seq > history_last) {
+        return NULL;
+    }
+    history_segment_t *seg = &history_segments[seq % HISTORY_SEGMENTS];
+    return &seg->records[id % HISTORY_SEGMENT_RECORDS];
+}
+
+void history_segment_path(char *path, size_t size, uint64_t seq) {
+    snprintf(path, size, "%s/%010lu.hist", history_dir, (unsigned long)seq);
+}
+
+/* Maps segment seq into seg, creating its file if needed, and works out how much of it is in use. */
+int history_map_segment(history_segment_t *seg, uint64_t seq) {
+    char path[PATH_MAX];
+    size_t file_size = HISTORY_SEGMENT_RECORDS * sizeof(history_record_t) + HISTORY_SEGMENT_SIZE;
+    history_segment_path(path, sizeof(path), seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_msg(LOG_ERROR, "Cannot open history segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || ((size_t)st.st_size < file_size && ftruncate(fd, file_size) < 0)) {
+        log_msg(LOG_ERROR, "Cannot size history segment %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_msg(LOG_ERROR, "Cannot map history segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    seg->seq = seq;
+    seg->records = (history_record_t *)map;
+    seg->data = map + HISTORY_SEGMENT_RECORDS * sizeof(history_record_t);
+    seg->count = 0;
+    seg->used = 0;
+    while (seg->count < HISTORY_SEGMENT_RECORDS) {
+        history_record_t *rec = &seg->records[seg->count];
+        if (rec->len == 0 || rec->offset != seg->used || rec->len > HISTORY_SEGMENT_SIZE - seg->used) {
+            break;
+        }
+        rec->room[NAME_LEN - 1] = '\0';
+        seg->used += rec->len;
+        seg->count++;
+    }
+    return 0;
+}
+
+void history_unmap(void *map) {
+    munmap(map, HISTORY_SEGMENT_RECORDS * sizeof(history_record_t) + HISTORY_SEGMENT_SIZE);
+}
+
+/* Called once no reader can see map; the history thread unmaps it so a busy thread does not have to. */
+void history_retire_map(void *map) {
+    pthread_mutex_lock(&history_spare_mutex);
+    if (history_unmap_count < HISTORY_SEGMENTS) {
+        history_unmaps[history_unmap_count++] = map;
+        pthread_cond_signal(&history_spare_cond);
+        map = NULL;
+    }
+    pthread_mutex_unlock(&history_spare_mutex);
+    if (map) {
+        history_unmap(map);
+    }
+}
+
+/*
+ * Starts a new segment, retiring the oldest one once HISTORY_SEGMENTS are kept. The history
+ * thread maps the next segment ahead of time and deletes retired ones, so this is a pointer swap.
+ * Rooms whose last record rotates out stay in the index until it next grows; their ids just miss.
+ */
+int history_rotate(void) {
+    uint64_t seq = history_last + 1;
+    history_segment_t next;
+    pthread_mutex_lock(&history_spare_mutex);
+    int ready = history_spare.records && history_spare.seq == seq;
+    if (ready) {
+        next = history_spare;
+        history_spare.records = NULL;
+    }
+    history_sync = (char *)history_segments[history_last % HISTORY_SEGMENTS].records;
+    pthread_mutex_unlock(&history_spare_mutex);
+    if (!ready) {
+        log_msg(LOG_WARN, "History segment %lu was not mapped ahead of time.", (unsigned long)seq);
+        if (history_map_segment(&next, seq) < 0) {
+            return -1;
+        }
+    }
+
+    if (history_last - history_first + 1 == HISTORY_SEGMENTS) {
+        history_segment_t *old = &history_segments[history_first % HISTORY_SEGMENTS];
+        /* A replay may still be sending from the old mapping, so it goes once readers are done. */
+        rcu_retire(old->records, history_retire_map);
+        old->records = NULL;
+        old->data = NULL;
+        history_first++;
+    }
+    history_segments[seq % HISTORY_SEGMENTS] = next;
+    history_last = seq;
+
+    pthread_mutex_lock(&history_spare_mutex);
+    history_spare_want = seq + 1;
+    history_unlink_below = history_first;
+    pthread_cond_signal(&history_spare_cond);
+    pthread_mutex_unlock(&history_spare_mutex);
+    return 0;
+}
+
+/* Does the file I/O for rotations: syncs full segments, maps the next one and deletes retired ones. */
+void *history_thread(void *arg) {
+    (void)arg;
+    size_t file_size = HISTORY_SEGMENT_RECORDS * sizeof(history_record_t) + HISTORY_SEGMENT_SIZE;
+    uint64_t unlinked = history_unlink_below;
+    pthread_mutex_lock(&history_spare_mutex);
+    while (1) {
+        if (history_sync) {
+            char *map = history_sync;
+            history_sync = NULL;
+            pthread_mutex_unlock(&history_spare_mutex);
+            msync(map, file_size, MS_ASYNC);
+            pthread_mutex_lock(&history_spare_mutex);
+        } else if (history_unmap_count > 0) {
+            char *map = history_unmaps[--history_unmap_count];
+            pthread_mutex_unlock(&history_spare_mutex);
+            history_unmap(map);
+            pthread_mutex_lock(&history_spare_mutex);
+        } else if (unlinked < history_unlink_below) {
+            char path[PATH_MAX];
+            history_segment_path(path, sizeof(path), unlinked++);
+            pthread_mutex_unlock(&history_spare_mutex);
+            unlink(path);
+            pthread_mutex_lock(&history_spare_mutex);
+        } else if (!history_spare.records && history_spare_want != HISTORY_NONE) {
+            uint64_t seq = history_spare_want;
+            history_segment_t seg;
+            pthread_mutex_unlock(&history_spare_mutex);
+            int mapped = history_map_segment(&seg, seq);
+            pthread_mutex_lock(&history_spare_mutex);
+            if (mapped < 0) {
+                /* history_rotate maps it itself and asks again. */
+                history_spare_want = HISTORY_NONE;
+            } else if (history_spare_want == seq && !history_spare.records) {
+                history_spare = seg;
+            } else {
+                pthread_mutex_unlock(&history_spare_mutex);
+                history_unmap(seg.records);
+                pthread_mutex_lock(&history_spare_mutex);
+            }
+        } else {
+            pthread_cond_wait(&history_spare_cond, &history_spare_mutex);
+        }
+    }
+    return NULL;
+}
+
+int history_start(void) {
+    history_spare_want = history_last + 1;
+    history_unlink_below = history_first;
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, history_thread, NULL);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/* True if segment seq holds no records, as when the history thread made it ahead of time. */
+int history_segment_unused(uint64_t seq) {
+    char path[PATH_MAX];
+    history_record_t rec;
+    history_segment_path(path, sizeof(path), seq);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = pread(fd, &rec, sizeof(rec), 0);
+    close(fd);
+    return n != (ssize_t)sizeof(rec) || rec.len == 0;
+}
+
+/*
+ * Opens the history directory, keeping its newest HISTORY_SEGMENTS segments, and rebuilds the
+ * per-room index from their records. New messages go on the end of the newest segment.
+ */
+int history_open(void) {
+    if (mkdir(history_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir history directory failed");
+        return -1;
+    }
+    DIR *dir = opendir(history_dir);
+    if (!dir) {
+        perror("opendir history directory failed");
+        return -1;
+    }
+    int found = 0;
+    uint64_t newest = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long long seq = strtoull(de->d_name, &end, 10);
+        if (end != de->d_name && strcmp(end, ".hist") == 0 && (!found || seq > newest)) {
+            newest = seq;
+            found = 1;
+        }
+    }
+
+    if (found && newest > 0 && history_segment_unused(newest)) {
+        /* Appending resumes in the segment before it rather than shifting the retained range. */
+        char path[PATH_MAX];
+        history_segment_path(path, sizeof(path), newest);
+        unlink(path);
+        newest--;
+    }
+    history_last = newest;
+    history_first = newest >= HISTORY_SEGMENTS - 1 ? newest - (HISTORY_SEGMENTS - 1) : 0;
+    rewinddir(dir);
+    while ((de = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long long seq = strtoull(de->d_name, &end, 10);
+        if (end != de->d_name && strcmp(end, ".hist") == 0 && seq < history_first) {
+            char path[PATH_MAX];
+            history_segment_path(path, sizeof(path), seq);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+
+    /* Segments missing from the retained range are recreated empty. */
+    for (uint64_t seq = history_first; seq <= history_last; ++seq) {
+        history_segment_t *seg = &history_segments[seq % HISTORY_SEGMENTS];
+        if (history_map_segment(seg, seq) < 0) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < seg->count; ++i) {
+            if (history_room_set_last(seg->records[i].room, seq * HISTORY_SEGMENT_RECORDS + i) < 0) {
+                perror("malloc failed for history index");
+                return -1;
+            }
+        }
+    }
+    history_segment_t *cur = &history_segments[history_last % HISTORY_SEGMENTS];
+    log_msg(LOG_INFO, "History in %s: segments %lu-%lu, %zu rooms, %zu bytes in the current segment", history_dir,
+           (unsigned long)history_first, (unsigned long)history_last, history_rooms_count, cur->used);
+    return 0;
+}
+
+/*
+ * Appends a message as it was sent to text clients. This is a copy into the mapped segment, which
+ * the kernel writes back in the background; page faults on a fresh page are the only I/O here.
+ */
+void history_append(const char *room, const char *text, size_t len) {
+    if (!history_dir || len == 0 || len > HISTORY_SEGMENT_SIZE) {
+        return;
+    }
+    pthread_mutex_lock(&history_mutex);
+    history_segment_t *seg = &history_segments[history_last % HISTORY_SEGMENTS];
+    if (seg->count == HISTORY_SEGMENT_RECORDS || seg->used + len > HISTORY_SEGMENT_SIZE) {
+        if (history_rotate() < 0) {
+            pthread_mutex_unlock(&history_mutex);
+            return;
+        }
+        seg = &history_segments[history_last % HISTORY_SEGMENTS];
+    }
+    uint64_t id = seg->seq * HISTORY_SEGMENT_RECORDS + seg->count;
+    uint64_t prev = history_room_last(room);
+    if (history_room_set_last(room, id) == 0) {
+        history_record_t *rec = &seg->records[seg->count];
+        memcpy(seg->data + seg->used, text, len);
+        rec->time_ms = wall_clock_ms();
+        rec->prev = prev;
+        rec->offset = (uint32_t)seg->used;
+        memset(rec->room, 0, NAME_LEN);
+        strncpy(rec->room, room, NAME_LEN - 1);
+        rec->len = (uint32_t)len;
+        seg->used += len;
+        seg->count++;
+        atomic_fetch_add_explicit(&stat_history_appends, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
+
+/*
+ * Sends cli up to count of the newest messages kept for room, oldest first, under a heading.
+ * Text clients are written straight from the mapped segments, with adjacent records merged
+ * into one iovec; whatever the socket does not take at once is queued as a single copy.
+ * Binary clients get one OP_NOTICE per message. Only collecting the records takes
+ * history_mutex; the read section keeps a rotated-out segment mapped until the send is done.
+ * Returns the number of messages sent.
+ */
+int history_replay(client_t *cli, const char *room, int count, uint64_t max_age_ms, const char *label) {
+    uint64_t ids[HISTORY_MAX_REPLAY];
+    struct iovec iov[HISTORY_MAX_REPLAY + 1];
+    char heading[NAME_LEN + 64];
+    if (!history_dir || count <= 0) {
+        return 0;
+    }
+    if (count > HISTORY_MAX_REPLAY) {
+        count = HISTORY_MAX_REPLAY;
+    }
+    uint64_t cutoff = max_age_ms ? wall_clock_ms() - max_age_ms : 0;
+
+    rcu_read_lock();
+    pthread_mutex_lock(&history_mutex);
+    int n = 0;
+    for (uint64_t id = history_room_last(room); n < count; ) {
+        history_record_t *rec = history_record(id);
+        if (!rec || rec->time_ms < cutoff) {
+            break;
+        }
+        ids[n++] = id;
+        id = rec->prev;
+    }
+    if (n == 0) {
+        pthread_mutex_unlock(&history_mutex);
+        rcu_read_unlock();
+        return 0;
+    }
+
+    int heading_len = snprintf(heading, sizeof(heading), "Server: %s %d message%s in %s:\n", label, n,
+                               n == 1 ? "" : "s", room);
+    iov[0].iov_base = heading;
+    iov[0].iov_len = heading_len;
+    size_t n_iov = 1;
+    size_t total = heading_len;
+    for (int i = n - 1; i >= 0; --i) {
+        history_record_t *rec = history_record(ids[i]);
+        char *text = history_segments[(ids[i] / HISTORY_SEGMENT_RECORDS) % HISTORY_SEGMENTS].data + rec->offset;
+        struct iovec *prev = &iov[n_iov - 1];
+        if (n_iov > 1 && (char *)prev->iov_base + prev->iov_len == text) {
+            prev->iov_len += rec->len;
+        } else {
+            iov[n_iov].iov_base = text;
+            iov[n_iov].iov_len = rec->len;
+            n_iov++;
+        }
+        total += rec->len;
+    }
+    pthread_mutex_unlock(&history_mutex);
+
+    if (cli->binary) {
+        /* Records are text lines; split merged runs back into one notice per line. */
+        client_send(cli, heading, heading_len);
+        for (size_t i = 1; i < n_iov; ++i) {
+            char *p = iov[i].iov_base;
+            char *end = p + iov[i].iov_len;
+            while (p < end) {
+                char *eol = memchr(p, '\n', end - p);
+                size_t len = eol ? (size_t)(eol - p + 1) : (size_t)(end - p);
+                client_send(cli, p, len);
+                p += len;
+            }
+        }
+    } else {
+        pthread_mutex_lock(&cli->out_mutex);
+        size_t sent = 0;
+        if (cli->out_count == 0 && !cli->slow_disconnect) {
+            struct msghdr mh;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_iov = iov;
+            mh.msg_iovlen = n_iov;
+            ssize_t w = sendmsg(cli->sockfd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (w > 0) {
+                sent = w;
+                cli->out_writes++;
+                atomic_fetch_add_explicit(&stat_write_calls, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&stat_bytes_out, w, memory_order_relaxed);
+            }
+        }
+        if (sent < total) {
+            msg_buf_t *rest = msg_alloc(total - sent);
+            if (rest) {
+                size_t off = 0;
+                for (size_t i = 0; i < n_iov; ++i) {
+                    size_t skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+                    sent -= skip;
+                    memcpy(rest->data + off, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+                    off += iov[i].iov_len - skip;
+                }
+                client_queue_locked(cli, rest);
+                msg_unref(rest);
+            } else {
+                log_msg(alloc_failure_level(), "Client %s history allocation failed, dropping replay.", cli->name);
+            }
+        }
+        pthread_mutex_unlock(&cli->out_mutex);
+    }
+    rcu_read_unlock();
+    atomic_fetch_add_explicit(&stat_history_replays, 1, memory_order_relaxed);
+    return n;
+}
+
+/* Lock-free multi-producer push; only the producer that finds the inbox empty has to wake the shard. */
+void shard_post(shard_t *sh, shard_msg_kind_t kind, msg_buf_t *msg, const char *target) {
+    shard_msg_t *m = pool_alloc(sizeof(shard_msg_t), 1);
+    if (!m) {
+        log_msg(alloc_failure_level(), "Shard %d message allocation failed, dropping message.", sh->id);
+        return;
+    }
+    m->kind = kind;
+    m->msg = msg;
+    msg_ref(msg);
+    strncpy(m->target, target, NAME_LEN - 1);
+    m->target[NAME_LEN - 1] = '\0';
+
+    shard_msg_t *head = atomic_load_explicit(&sh->inbox, memory_order_relaxed);
+    do {
+        m->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&sh->inbox, &head, m,
+                                                    memory_order_release, memory_order_relaxed));
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(sh->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            log_msg(LOG_ERROR, "Shard %d eventfd write failed: %s", sh->id, strerror(errno));
+        }
+    }
+}
+
+/*
+ * Picks the rendering cli speaks. The frame is missing if msg was built before a binary client
+ * joined or its allocation failed over --mem-limit; that counts as a drop like a full queue.
+ */
+msg_buf_t *msg_for(const client_t *cli, msg_buf_t *msg) {
+    if (!cli->binary) {
+        return msg;
+    }
+    if (!msg->frame) {
+        atomic_fetch_add(&stat_out_drops, 1);
+        log_msg(LOG_DEBUG, "No frame for binary client %s, dropping message.", cli->name);
+    }
+    return msg->frame;
+}
+
+/* Called inside an RCU read section; joins and leaves do not wait for it. */
+void room_deliver_local(room_t *room, int shard_id, client_t *exclude, msg_buf_t *msg) {
+    member_set_t *set = atomic_load(&room->by_shard[shard_id]);
+    for (size_t i = 0; set && i < set->count; ++i) {
+        client_t *cli = set->items[i];
+        msg_buf_t *out = cli != exclude ? msg_for(cli, msg) : NULL;
+        if (out) {
+            client_send_msg(cli, out);
+        }
+    }
+}
+
+/*
+ * Queues message for every member of room. sender is NULL for messages from other nodes; those
+ * arrive on the link thread, which owns no shard, so in io_uring mode they go through the inboxes.
+ */
+void room_broadcast(room_t *room, client_t *sender, const char *sender_name, const char *message, int keep_history) {
+    uint64_t start = monotonic_ns();
+    char flat[BUFFER_SIZE + 1];
+    msg_buf_t *msg = msg_printf("%s: %s\n", sender_name, flatten_lines(message, flat, sizeof(flat)));
+    if (!msg) {
+        log_msg(alloc_failure_level(), "Broadcast allocation failed, dropping message.");
+        return;
+    }
+    if (atomic_load(&binary_clients) > 0) {
+        msg->frame = frame_msg(OP_MESSAGE, sender ? sender->id : 0, sender_name, message, strlen(message));
+    }
+    shard_t *home = sender ? sender->shard : current_shard;
+    rcu_read_lock();
+    for (int i = 0; i < shard_count; ++i) {
+        if (&shards[i] == home || (shard_count == 1 && server_mode != MODE_URING)) {
+            room_deliver_local(room, i, sender, msg);
+        } else if (atomic_load(&room->by_shard[i]) != NULL) {
+            shard_post(&shards[i], SHARD_BROADCAST, msg, room->name);
+        }
+    }
+    rcu_read_unlock();
+    if (keep_history) {
+        history_append(room->name, msg->data, msg->len);
+    }
+    msg_unref(msg);
+    latency_observe(&fanout_hist, monotonic_ns() - start);
+}
+
+void broadcast(client_t *sender, const char *sender_name, const char *message, int keep_history) {
+    /* The sender is a member, so its room cannot be freed underneath us. */
+    room_t *room = sender && sender->room ? sender->room : lobby;
+    room_broadcast(room, sender, sender_name, message, keep_history);
+    link_send_say(room->name, sender_name, message, keep_history);
+}
+
+/* Queues msg for recipient, through its shard's inbox if another thread owns it. Called inside an RCU read section. */
+void client_deliver(client_t *recipient, msg_buf_t *msg) {
+    if ((shard_count > 1 || server_mode == MODE_URING) && recipient->shard != current_shard) {
+        shard_post(recipient->shard, SHARD_PM, msg, recipient->name);
+    } else {
+        msg_buf_t *out = msg_for(recipient, msg);
+        if (out) {
+            client_send_msg(recipient, out);
+        }
+    }
+}
+
+/* Called inside an RCU read section. */
+void deliver_private(client_t *recipient, client_t *sender, const char *sender_name, const char *message) {
+    char flat[BUFFER_SIZE + 1];
+    msg_buf_t *msg = msg_printf("(PM from %s): %s\n", sender_name, flatten_lines(message, flat, sizeof(flat)));
+    if (msg && recipient->binary) {
+        client_t *from = sender ? sender : client_lookup(sender_name);
+        msg->frame = frame_msg(OP_PRIVATE, from ? from->id : 0, sender_name, message, strlen(message));
+    }
+    if (!msg) {
+        log_msg(alloc_failure_level(), "Private message allocation failed, dropping message.");
+        return;
+    }
+    client_deliver(recipient, msg);
+    msg_unref(msg);
+}
+
+/* Server text in both renderings, for a client whose kind the caller does not check. */
+msg_buf_t *notice_msg(const char *text) {
+    msg_buf_t *msg = msg_printf("%s", text);
+    if (msg) {
+        size_t len = strlen(text);
+        msg->frame = frame_msg(OP_NOTICE, 0, NULL, text, len > 0 && text[len - 1] == '\n' ? len - 1 : len);
+    }
+    return msg;
+}
+
+/*
+ * Queues the count stored messages in data as a single buffer, so they leave in one write.
+ * Binary clients get the stored frames as they are; text clients get one line per message.
+ * Returns -1 if nothing could be queued, so the mailbox is kept. Called inside an RCU read section.
+ */
+int mailbox_deliver(client_t *cli, const char *data, size_t size, int count) {
+    char heading[80];
+    snprintf(heading, sizeof(heading), "Server: %d message%s arrived while you were offline:\n", count,
+             count == 1 ? "" : "s");
+    msg_buf_t *head = notice_msg(heading);
+    /* Each frame (10 bytes of framing + name + text) becomes "(PM from name): text\n", 3 bytes more. */
+    msg_buf_t *msg = msg_alloc(cli->binary ? 0 : size + 3 * (size_t)count);
+    if (msg && cli->binary) {
+        msg->frame = msg_alloc(size);
+    }
+    if (!head || !msg || (cli->binary && !msg->frame)) {
+        log_msg(alloc_failure_level(), "Mailbox allocation failed for %s, keeping %d messages.", cli->name, count);
+        if (head) {
+            msg_unref(head);
+        }
+        if (msg) {
+            msg_unref(msg);
+        }
+        return -1;
+    }
+    if (cli->binary) {
+        memcpy(msg->frame->data, data, size);
+    } else {
+        size_t out = 0;
+        for (size_t off = 0; off < size; ) {
+            uint32_t len = frame_get_be32((unsigned char *)data + off);
+            frame_reader_t r = {(unsigned char *)data + off + FRAME_HEADER_LEN, len, 0};
+            char name[NAME_LEN];
+            off += FRAME_HEADER_LEN + len;
+            frame_get_u32(&r);
+            frame_get_name(&r, name);
+            if (r.error) {
+                continue;
+            }
+            out += sprintf(msg->data + out, "(PM from %s): ", name);
+            for (size_t i = 0; i < r.len; ++i) {
+                msg->data[out++] = r.p[i] == '\n' ? ' ' : (char)r.p[i];
+            }
+            msg->data[out++] = '\n';
+        }
+        msg->len = out;
+    }
+    client_deliver(cli, head);
+    client_deliver(cli, msg);
+    msg_unref(head);
+    msg_unref(msg);
+    atomic_fetch_add_explicit(&stat_mail_delivered, count, memory_order_relaxed);
+    log_msg(LOG_INFO, "Delivered %d stored messages to %s", count, cli->name);
+    return 0;
+}
+
+/* Sends text to the client with id, which may have left since, from a thread that owns no shard. */
+void mail_reply(const char *name, uint32_t id, const char *text) {
+    rcu_read_lock();
+    client_t *cli = client_lookup(name);
+    if (cli && cli->id == id) {
+        msg_buf_t *msg = notice_msg(text);
+        if (msg) {
+            client_deliver(cli, msg);
+            msg_unref(msg);
+        } else {
+            log_msg(alloc_failure_level(), "Client %s message allocation failed, dropping message.", name);
+        }
+    }
+    rcu_read_unlock();
+}
+
+void mail_store(mail_job_t *job) {
+    char reply[BUFFER_SIZE];
+    if (mailbox_store(job->name, job->sender, job->text) == 0) {
+        if (job->origin[0]) {
+            log_msg(LOG_INFO, "PM from %s on %s stored for offline user %s.", job->sender, job->origin, job->name);
+        } else if (job->id) {
+            snprintf(reply, sizeof(reply), "Server: %s is offline; the message will be delivered when they join.\n",
+                     job->name);
+            mail_reply(job->sender, job->id, reply);
+        } else {
+            log_msg(LOG_INFO, "Delayed PM from %s stored for offline user %s.", job->sender, job->name);
+        }
+    } else if (job->origin[0]) {
+        log_msg(LOG_WARN, "PM from %s on %s dropped: %s is not on this node.", job->sender, job->origin, job->name);
+    } else if (job->id) {
+        if (errno == EFBIG) {
+            snprintf(reply, sizeof(reply), "Server: %s is offline and their mailbox is full.\n", job->name);
+        } else {
+            snprintf(reply, sizeof(reply), "Server: User '%s' not found or is offline.\n", job->name);
+        }
+        mail_reply(job->sender, job->id, reply);
+    } else {
+        log_msg(LOG_WARN, "Delayed PM recipient '%s' not found for message from %s.", job->name, job->sender);
+    }
+}
+
+void mail_deliver(mail_job_t *job) {
+    char *mail;
+    size_t size;
+    int count;
+    if (mailbox_load(job->name, &mail, &size, &count) < 0) {
+        return;
+    }
+    int queued = -1;
+    rcu_read_lock();
+    client_t *cli = client_lookup(job->name);
+    if (cli && cli->id == job->id) {
+        queued = count > 0 ? mailbox_deliver(cli, mail, size, count) : 0;
+    }
+    rcu_read_unlock();
+    /* Only removed once its messages are queued, so a client that left or a failed allocation keeps them. */
+    if (queued == 0) {
+        mailbox_remove(job->name);
+    }
+    free(mail);
+}
+
+/*
+ * Does all mailbox file I/O, in the order the jobs were queued, so senders and joining
+ * clients never wait for a write, an fsync or a read.
+ */
+void *mail_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&mail_mutex);
+    while (1) {
+        mail_job_t *job = mail_head;
+        if (!job) {
+            pthread_cond_broadcast(&mail_idle);
+            pthread_cond_wait(&mail_cond, &mail_mutex);
+            continue;
+        }
+        mail_head = job->next;
+        if (!mail_head) {
+            mail_tail = NULL;
+        }
+        mail_busy = 1;
+        pthread_mutex_unlock(&mail_mutex);
+        if (job->kind == MAIL_STORE) {
+            mail_store(job);
+        } else {
+            mail_deliver(job);
+        }
+        pool_free(job);
+        pthread_mutex_lock(&mail_mutex);
+        mail_busy = 0;
+    }
+    return NULL;
+}
+
+int mail_start(void) {
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, mail_thread, NULL);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+void send_private_message(client_t *sender, const char* sender_name, const char *recipient_name, const char *message) {
+    char error_buffer[BUFFER_SIZE];
+    client_t *recipient = NULL;
+
+    if (message == NULL || strlen(message) == 0) {
+        if (sender) {
+            client_send_str(sender, "Server: Cannot send an empty private message.\n");
+        }
+        return;
+    }
+
+    rcu_read_lock();
+    recipient = client_lookup(recipient_name);
+
+    if (recipient && recipient == sender) {
+        rcu_read_unlock();
+        client_send_str(sender, "Server: You cannot send a PM to yourself.\n");
+        return;
+    }
+    int queued = -1;
+    int forwarded = recipient ? -1 : link_send_pm(sender_name, recipient_name, message);
+    if (!recipient && forwarded < 0 && mailbox_dir) {
+        /* Recheck under the mailbox lock: either the recipient has joined, or its delivery is queued after the store. */
+        pthread_mutex_t *mail_lock = mailbox_lock(recipient_name);
+        pthread_mutex_lock(mail_lock);
+        pthread_mutex_lock(&clients_mutex);
+        recipient = registry_find_name(&clients, recipient_name);
+        pthread_mutex_unlock(&clients_mutex);
+        if (!recipient) {
+            queued = mail_queue(MAIL_STORE, recipient_name, sender ? sender->id : 0, sender_name, NULL, message);
+        }
+        pthread_mutex_unlock(mail_lock);
+    }
+    if (recipient) {
+        deliver_private(recipient, sender, sender_name, message);
+    }
+    rcu_read_unlock();
+
+    /* Once queued, the mail thread tells the sender how the store went. */
+    if (queued < 0 && !recipient && forwarded < 0) {
+        if (sender) {
+            snprintf(error_buffer, sizeof(error_buffer), "Server: User '%s' not found or is offline.\n", recipient_name);
+            client_send_str(sender, error_buffer);
+        } else {
+            log_msg(LOG_WARN, "Delayed PM recipient '%s' not found for message from %s.", recipient_name, sender_name);
+        }
+    }
+}
+
+int presence_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const presence_entry_t *)a)->name, ((const presence_entry_t *)b)->name);
+}
+
+/* Text reply for page of the matches [lo, hi). */
+msg_buf_t *presence_page_text(const presence_t *p, size_t lo, size_t hi, size_t page, const char *prefix) {
+    static const char head[] = "Server: Connected users:\n";
+    size_t matches = hi - lo;
+    size_t pages = matches ? (matches + LIST_PAGE_TEXT - 1) / LIST_PAGE_TEXT : 1;
+    size_t start = lo + (page - 1) * LIST_PAGE_TEXT;
+    size_t end = hi - start > LIST_PAGE_TEXT ? start + LIST_PAGE_TEXT : hi;
+    char tail[NAME_LEN + 160] = "";
+    if (matches == 0 && *prefix) {
+        snprintf(tail, sizeof(tail), "(No users matching '%s')\n", prefix);
+    } else if (matches == 0) {
+        strcpy(tail, "(No users connected)\n");
+    } else if (page < pages) {
+        snprintf(tail, sizeof(tail), "Server: Page %zu of %zu, %zu users. /list %s%s%zu shows the next one.\n",
+                 page, pages, matches, prefix, *prefix ? " " : "", page + 1);
+    } else if (pages > 1) {
+        snprintf(tail, sizeof(tail), "Server: Page %zu of %zu, %zu users.\n", page, pages, matches);
+    }
+    size_t body = p->entries[end].text_off - p->entries[start].text_off;
+    size_t tail_len = strlen(tail);
+    msg_buf_t *msg = msg_alloc(sizeof(head) - 1 + body + tail_len);
+    if (!msg) {
+        return NULL;
+    }
+    memcpy(msg->data, head, sizeof(head) - 1);
+    memcpy(msg->data + sizeof(head) - 1, p->text + p->entries[start].text_off, body);
+    memcpy(msg->data + sizeof(head) - 1 + body, tail, tail_len);
+    return msg;
+}
+
+/* OP_USERS reply for page of the matches [lo, hi). */
+msg_buf_t *presence_page_binary(const presence_t *p, size_t lo, size_t hi, size_t page) {
+    size_t matches = hi - lo;
+    size_t pages = matches ? (matches + LIST_PAGE_BINARY - 1) / LIST_PAGE_BINARY : 1;
+    size_t start = lo + (page - 1) * LIST_PAGE_BINARY;
+    size_t end = hi - start > LIST_PAGE_BINARY ? start + LIST_PAGE_BINARY : hi;
+    size_t body = p->entries[end].frame_off - p->entries[start].frame_off;
+    size_t cap = FRAME_HEADER_LEN + 16 + body;
+    msg_buf_t *msg = msg_alloc(cap);
+    if (!msg) {
+        return NULL;
+    }
+    frame_writer_t w;
+    frame_begin(&w, (unsigned char *)msg->data, cap, OP_USERS);
+    frame_put_u32(&w, (uint32_t)(end - start));
+    frame_put_bytes(&w, p->frames + p->entries[start].frame_off, body);
+    frame_put_u32(&w, (uint32_t)matches);
+    frame_put_u32(&w, (uint32_t)page);
+    frame_put_u32(&w, (uint32_t)pages);
+    msg->len = frame_end(&w);
+    return msg;
+}
+
+/* Copies the registry view and the remote users into a sorted snapshot; NULL if out of memory. */
+presence_t *presence_build(void) {
+    rcu_read_lock();
+    pthread_mutex_lock(&remote_mutex);
+    registry_view_t *view = atomic_load(&client_view);
+    size_t cap = (view ? view->count : 0) + remote_count;
+    presence_t *p = malloc(sizeof(presence_t) + (cap + 1) * sizeof(presence_entry_t));
+    size_t n = 0;
+    for (size_t i = 0; p && view && i < view->name_cap && n < cap; ++i) {
+        client_t *cl = view->by_name[i];
+        if (cl) {
+            presence_entry_t *e = &p->entries[n++];
+            strcpy(e->name, cl->name);
+            e->node[0] = '\0';
+            e->id = cl->id;
+        }
+    }
+    for (size_t i = 0; p && i < remote_cap; ++i) {
+        for (remote_user_t *u = remote_users[i]; u && n < cap; u = u->next) {
+            presence_entry_t *e = &p->entries[n++];
+            strcpy(e->name, u->name);
+            strcpy(e->node, u->node);
+            e->id = 0;
+        }
+    }
+    pthread_mutex_unlock(&remote_mutex);
+    rcu_read_unlock();
+    if (!p) {
+        return NULL;
+    }
+
+    qsort(p->entries, n, sizeof(presence_entry_t), presence_entry_cmp);
+    size_t text_len = 0, frames_len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = strlen(p->entries[i].name);
+        text_len += len + 3 + (p->entries[i].node[0] ? strlen(p->entries[i].node) + 6 : 0);
+        frames_len += len + 5;
+    }
+    p->count = n;
+    p->first_page[0] = p->first_page[1] = NULL;
+    p->text = malloc(text_len + 1);
+    /* Laid out as the body of one OP_USERS frame, so a page is a single copy. */
+    p->frames = malloc(FRAME_HEADER_LEN + frames_len);
+    if (!p->text || !p->frames) {
+        presence_free(p);
+        return NULL;
+    }
+    frame_writer_t w;
+    frame_begin(&w, p->frames, FRAME_HEADER_LEN + frames_len, OP_USERS);
+    size_t off = 0;
+    for (size_t i = 0; i < n; ++i) {
+        presence_entry_t *e = &p->entries[i];
+        e->text_off = (uint32_t)off;
+        if (e->node[0]) {
+            off += sprintf(p->text + off, "- %s (on %s)\n", e->name, e->node);
+        } else {
+            off += sprintf(p->text + off, "- %s\n", e->name);
+        }
+        e->frame_off = (uint32_t)w.len;
+        frame_put_u32(&w, e->id);
+        frame_put_name(&w, e->name);
+    }
+    p->entries[n].text_off = (uint32_t)off;
+    p->entries[n].frame_off = (uint32_t)w.len;
+    p->first_page[0] = presence_page_text(p, 0, n, 1, "");
+    p->first_page[1] = presence_page_binary(p, 0, n, 1);
+    atomic_fetch_add(&stat_presence_builds, 1);
+    return p;
+}
+
+/*
+ * The current snapshot, built first if a join or leave dropped it. Call inside an RCU read section;
+ * the snapshot stays valid until the section ends even if it is dropped meanwhile.
+ */
+presence_t *presence_current(void) {
+    presence_t *p = atomic_load(&presence);
+    if (p) {
+        return p;
+    }
+    pthread_mutex_lock(&presence_mutex);
+    if ((p = atomic_load(&presence)) == NULL) {
+        unsigned long gen = atomic_load(&presence_gen);
+        if ((p = presence_build()) != NULL) {
+            atomic_store(&presence, p);
+            /* Someone joined or left while we copied; this caller can still use p. */
+            if (atomic_load(&presence_gen) != gen) {
+                presence_invalidate();
+            }
+        }
+    }
+    pthread_mutex_unlock(&presence_mutex);
+    return p;
+}
+
+/* Sets [lo, hi) to the entries whose names start with prefix. */
+void presence_range(const presence_t *p, const char *prefix, size_t *lo, size_t *hi) {
+    size_t len = strlen(prefix);
+    size_t a = 0, b = p->count;
+    while (a < b) {
+        size_t mid = a + (b - a) / 2;
+        if (strncmp(p->entries[mid].name, prefix, len) < 0) {
+            a = mid + 1;
+        } else {
+            b = mid;
+        }
+    }
+    *lo = a;
+    b = p->count;
+    while (a < b) {
+        size_t mid = a + (b - a) / 2;
+        if (strncmp(p->entries[mid].name, prefix, len) <= 0) {
+            a = mid + 1;
+        } else {
+            b = mid;
+        }
+    }
+    *hi = a;
+}
+
+/* Sends one page of the users whose names start with prefix. A bare /list is served ready-made. */
+void list_clients(client_t *requester, const char *prefix, size_t page) {
+    int binary = requester->binary != 0;
+    msg_buf_t *msg = NULL;
+    size_t pages = 0;
+    rcu_read_lock();
+    presence_t *p = presence_current();
+    if (p && page == 1 && !*prefix && p->first_page[binary]) {
+        msg = p->first_page[binary];
+        msg_ref(msg);
+    } else if (p) {
+        size_t lo, hi;
+        size_t per_page = binary ? LIST_PAGE_BINARY : LIST_PAGE_TEXT;
+        presence_range(p, prefix, &lo, &hi);
+        pages = hi > lo ? (hi - lo + per_page - 1) / per_page : 1;
+        if (page <= pages) {
+            msg = binary ? presence_page_binary(p, lo, hi, page) : presence_page_text(p, lo, hi, page, prefix);
+        }
+    }
+    rcu_read_unlock();
+
+    if (msg) {
+        client_send_msg(requester, msg);
+        msg_unref(msg);
+    } else if (pages > 0 && page > pages) {
+        char reply[64];
+        snprintf(reply, sizeof(reply), "Server: There %s only %zu page%s.\n", pages == 1 ? "is" : "are", pages,
+                 pages == 1 ? "" : "s");
+        client_send_str(requester, reply);
+    } else {
+        log_msg(alloc_failure_level(), "Client %s message allocation failed, dropping message.", requester->name);
+    }
+}
+
+/* /list [prefix] [page]; a lone number is a page. */
+void list_command(client_t *cli, char *args) {
+    char *saveptr;
+    char *first = strtok_r(args, " ", &saveptr);
+    char *second = first ? strtok_r(NULL, " ", &saveptr) : NULL;
+    const char *prefix = "";
+    long page = 1;
+    if (second) {
+        prefix = first;
+        page = parse_long_arg(second, 1, UINT32_MAX);
+    } else if (first && strspn(first, "0123456789") == strlen(first)) {
+        page = parse_long_arg(first, 1, UINT32_MAX);
+    } else if (first) {
+        prefix = first;
+    }
+    if (page < 0 || strlen(prefix) >= NAME_LEN || (second && strtok_r(NULL, " ", &saveptr))) {
+        client_send_str(cli, "Server: Usage /list [prefix] [page]\n");
+        return;
+    }
+    list_clients(cli, prefix, (size_t)page);
+}
+
+/* Returns 1 if cli was already subscribed, -1 if the subscriber list could not grow. */
+int presence_subscribe(client_t *cli) {
+    int rc = 0;
+    pthread_mutex_lock(&subscribers_mutex);
+    shard_t *sh = cli->shard;
+    if (cli->subscribed) {
+        rc = 1;
+    } else if (sh->subscriber_count == sh->subscriber_cap) {
+        size_t cap = sh->subscriber_cap ? sh->subscriber_cap * 2 : 16;
+        client_t **grown = realloc(sh->subscribers, cap * sizeof(client_t *));
+        if (grown) {
+            sh->subscribers = grown;
+            sh->subscriber_cap = cap;
+        } else {
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        cli->sub_index = sh->subscriber_count;
+        sh->subscribers[sh->subscriber_count++] = cli;
+        cli->subscribed = 1;
+        atomic_fetch_add(&subscriber_total, 1);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+    return rc;
+}
+
+void watch_command(client_t *cli, int on) {
+    char reply[96];
+    if (!on) {
+        client_send_str(cli, cli->subscribed ? "Server: Stopped watching joins and leaves.\n"
+                                             : "Server: You are not watching joins and leaves.\n");
+        presence_unsubscribe(cli);
+        return;
+    }
+    int rc = presence_subscribe(cli);
+    if (rc < 0) {
+        client_send_str(cli, "Server: Unable to watch right now.\n");
+        return;
+    }
+    rcu_read_lock();
+    presence_t *p = presence_current();
+    size_t online = p ? p->count : 0;
+    rcu_read_unlock();
+    snprintf(reply, sizeof(reply), "Server: %s joins and leaves; %zu users online.\n",
+             rc == 1 ? "Already watching" : "Watching", online);
+    client_send_str(cli, reply);
+}
+
+void presence_deliver_local(shard_t *sh, msg_buf_t *msg) {
+    pthread_mutex_lock(&subscribers_mutex);
+    for (size_t i = 0; i < sh->subscriber_count; ++i) {
+        client_t *cli = sh->subscribers[i];
+        msg_buf_t *out = msg_for(cli, msg);
+        if (out) {
+            client_send_msg(cli, out);
+        }
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+}
+
+/* Tells every /watch subscriber that name joined or left; node is NULL for users on this node. */
+void presence_notify(const char *name, uint32_t id, const char *node, int joined) {
+    if (atomic_load(&subscriber_total) == 0) {
+        return;
+    }
+    msg_buf_t *msg;
+    if (node) {
+        msg = msg_printf("Server: %s: %s (on %s)\n", joined ? "Online" : "Offline", name, node);
+    } else {
+        msg = msg_printf("Server: %s: %s\n", joined ? "Online" : "Offline", name);
+    }
+    if (!msg) {
+        log_msg(alloc_failure_level(), "Presence message allocation failed, dropping it.");
+        return;
+    }
+    size_t cap = FRAME_HEADER_LEN + 7 + 2 * NAME_LEN;
+    if (atomic_load(&binary_clients) > 0 && (msg->frame = msg_alloc(cap)) != NULL) {
+        uint8_t flag = joined != 0;
+        char where[NAME_LEN] = "";
+        if (node) {
+            strcpy(where, node);
+        }
+        frame_writer_t w;
+        frame_begin(&w, (unsigned char *)msg->frame->data, cap, OP_PRESENCE);
+        frame_put_u32(&w, id);
+        frame_put_name(&w, name);
+        frame_put_bytes(&w, &flag, 1);
+        frame_put_name(&w, where);
+        msg->frame->len = frame_end(&w);
+    }
+    for (int i = 0; i < shard_count; ++i) {
+        if (&shards[i] == current_shard || (shard_count == 1 && server_mode != MODE_URING)) {
+            presence_deliver_local(&shards[i], msg);
+            continue;
+        }
+        pthread_mutex_lock(&subscribers_mutex);
+        int subscribed = shards[i].subscriber_count > 0;
+        pthread_mutex_unlock(&subscribers_mutex);
+        if (subscribed) {
+            shard_post(&shards[i], SHARD_PRESENCE, msg, "");
+        }
+    }
+    msg_unref(msg);
+}
+
+size_t room_size(room_t *room) {
+    pthread_mutex_lock(&room->mutex);
+    size_t n = room->member_count;
+    pthread_mutex_unlock(&room->mutex);
+    return n;
+}
+
+/* Moves cli to the named room, telling both the old and the new room about it. */
+void switch_room(client_t *cli, const char *name) {
+    char buffer[BUFFER_SIZE];
+    char old_name[NAME_LEN] = "";
+    if (cli->room) {
+        if (strcmp(cli->room->name, name) == 0) {
+            snprintf(buffer, sizeof(buffer), "Server: You are already in %s.\n", name);
+            client_send_str(cli, buffer);
+            return;
+        }
+        strcpy(old_name, cli->room->name);
+        snprintf(buffer, sizeof(buffer), "%s left %s.", cli->name, old_name);
+        broadcast(cli, "Server", buffer, 0);
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    room_leave(cli);
+    int entered = room_enter(cli, name);
+    if (entered < 0) {
+        room_enter(cli, LOBBY_NAME);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    if (!cli->room) {
+        client_send_str(cli, "Server: Failed to join a room.\n");
+        return;
+    }
+    if (entered < 0) {
+        snprintf(buffer, sizeof(buffer), "Server: Failed to join %s.\n", name);
+        client_send_str(cli, buffer);
+    }
+
+    log_msg(LOG_INFO, "Client %s moved from %s to %s", cli->name, old_name, cli->room->name);
+    snprintf(buffer, sizeof(buffer), "%s joined %s.", cli->name, cli->room->name);
+    broadcast(cli, "Server", buffer, 0);
+    size_t members = room_size(cli->room);
+    snprintf(buffer, sizeof(buffer), "Server: You are now in %s (%zu member%s).\n", cli->room->name,
+             members, members == 1 ? "" : "s");
+    client_send_str(cli, buffer);
+}
+
+void join_room(client_t *cli, char *arg) {
+    char *name = trimwhitespace(arg);
+    if (*name == '#') {
+        name++;
+    }
+    if (*name == '\0') {
+        client_send_str(cli, "Server: Usage /join <room>\n");
+        return;
+    }
+    const char *error = check_client_name(name);
+    if (error) {
+        char reply[100];
+        snprintf(reply, sizeof(reply), "Server: Invalid room name. %s\n", error);
+        client_send_str(cli, reply);
+        return;
+    }
+    switch_room(cli, name);
+}
+
+void part_room(client_t *cli) {
+    if (cli->room == lobby) {
+        client_send_str(cli, "Server: You are already in the lobby.\n");
+        return;
+    }
+    switch_room(cli, LOBBY_NAME);
+}
+
+void list_rooms(client_t *requester) {
+    char list_buffer[BUFFER_SIZE] = "Server: Rooms:\n";
+    size_t current_len = strlen(list_buffer);
+    const char *truncated = "- ... (list truncated)\n";
+
+    pthread_mutex_lock(&rooms_mutex);
+    for (size_t i = 0; i < rooms.count; ++i) {
+        room_t *room = rooms.items[i];
+        int needed = snprintf(list_buffer + current_len, sizeof(list_buffer) - current_len, "- %s (%zu)%s\n",
+                              room->name, room->member_count, room == requester->room ? " <- you" : "");
+        if (needed < 0 || (size_t)needed >= sizeof(list_buffer) - current_len - strlen(truncated)) {
+            strcpy(list_buffer + current_len, truncated);
+            break;
+        }
+        current_len += needed;
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+
+    client_send_str(requester, list_buffer);
+}
+
+void show_history(client_t *cli, char *arg) {
+    char *count_str = trimwhitespace(arg);
+    long count = *count_str ? parse_long_arg(count_str, 1, HISTORY_MAX_REPLAY) : DEFAULT_REPLAY;
+    const char *room = cli->room ? cli->room->name : LOBBY_NAME;
+    char reply[NAME_LEN + 64];
+    if (!history_dir) {
+        client_send_str(cli, "Server: History is not enabled on this server.\n");
+    } else if (count < 0) {
+        snprintf(reply, sizeof(reply), "Server: Usage /history [1-%d]\n", HISTORY_MAX_REPLAY);
+        client_send_str(cli, reply);
+    } else if (history_replay(cli, room, (int)count, 0, "Last") == 0) {
+        snprintf(reply, sizeof(reply), "Server: No history in %s.\n", room);
+        client_send_str(cli, reply);
+    }
+}
+
+uint64_t current_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+unsigned long timer_public_id(uint32_t index) {
+    return (((unsigned long)timer_pool[index].gen << TIMER_INDEX_BITS) | index) + 1;
+}
+
+uint32_t timer_alloc(void) {
+    uint32_t index;
+    if (timer_free_list != TIMER_NIL) {
+        index = timer_free_list;
+        timer_free_list = timer_pool[index].next;
+        return index;
+    }
+    if (timer_pool_used == timer_pool_cap) {
+        if (timer_pool_cap == MAX_PENDING_DELAYS) {
+            return TIMER_NIL;
+        }
+        uint32_t new_cap = timer_pool_cap ? timer_pool_cap * 2 : 64;
+        delay_timer_t *new_pool = realloc(timer_pool, new_cap * sizeof(delay_timer_t));
+        if (!new_pool) {
+            return TIMER_NIL;
+        }
+        timer_pool = new_pool;
+        timer_pool_cap = new_cap;
+    }
+    index = timer_pool_used++;
+    timer_pool[index].gen = 0;
+    return index;
+}
+
+void timer_release(uint32_t index) {
+    delay_timer_t *t = &timer_pool[index];
+    pool_free(t->message);
+    t->message = NULL;
+    t->state = TIMER_FREE;
+    t->gen = (t->gen + 1) & ((1u << (32 - TIMER_INDEX_BITS)) - 1);
+    t->next = timer_free_list;
+    timer_free_list = index;
+}
+
+void wheel_link(uint32_t index) {
+    delay_timer_t *t = &timer_pool[index];
+    uint64_t delta = t->expires > wheel_tick ? t->expires - wheel_tick : 0;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    uint64_t expires = t->expires > wheel_tick ? t->expires : wheel_tick;
+    t->level = level;
+    t->slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    t->prev = TIMER_NIL;
+    t->next = wheel[t->level][t->slot];
+    if (t->next != TIMER_NIL) {
+        timer_pool[t->next].prev = index;
+    }
+    wheel[t->level][t->slot] = index;
+}
+
+void wheel_unlink(uint32_t index) {
+    delay_timer_t *t = &timer_pool[index];
+    if (t->prev != TIMER_NIL) {
+        timer_pool[t->prev].next = t->next;
+    } else {
+        wheel[t->level][t->slot] = t->next;
+    }
+    if (t->next != TIMER_NIL) {
+        timer_pool[t->next].prev = t->prev;
+    }
+}
+
+/* Re-files every timer of an upper-level slot into the levels below it. */
+uint32_t wheel_cascade(int level) {
+    uint32_t slot = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    uint32_t index = wheel[level][slot];
+    wheel[level][slot] = TIMER_NIL;
+    while (index != TIMER_NIL) {
+        uint32_t next = timer_pool[index].next;
+        wheel_link(index);
+        index = next;
+    }
+    return slot;
+}
+
+/*
+ * Called with sched_mutex held on a timer taken off the wheel by wheel_run_tick(). The lock is
+ * dropped while the message is delivered; returns the next due timer.
+ */
+uint32_t timer_fire(uint32_t index) {
+    delay_timer_t *t = &timer_pool[index];
+    uint32_t next = t->next;
+    int delay = t->delay;
+    char sender[NAME_LEN], recipient[NAME_LEN];
+    memcpy(sender, t->sender_name, NAME_LEN);
+    memcpy(recipient, t->recipient_name, NAME_LEN);
+    char *message = t->message;
+    t->message = NULL;
+    timer_release(index);
+    pthread_mutex_unlock(&sched_mutex);
+
+    log_msg(LOG_INFO, "Executing delayed PM from %s to %s after %d seconds.", sender, recipient, delay);
+    send_private_message(NULL, sender, recipient, message);
+    atomic_fetch_add_explicit(&stat_delays_fired, 1, memory_order_relaxed);
+    pool_free(message);
+
+    pthread_mutex_lock(&sched_mutex);
+    return next;
+}
+
+/* Moves the timers of the current tick onto the due list, in wheel order. */
+void wheel_run_tick(uint32_t *due, uint32_t *due_last) {
+    uint32_t slot = wheel_tick & WHEEL_MASK;
+    for (int level = 1; slot == 0 && level < WHEEL_LEVELS; ++level) {
+        slot = wheel_cascade(level);
+    }
+    slot = wheel_tick & WHEEL_MASK;
+    uint32_t index = wheel[0][slot];
+    wheel[0][slot] = TIMER_NIL;
+    while (index != TIMER_NIL) {
+        delay_timer_t *t = &timer_pool[index];
+        uint32_t next = t->next;
+        t->state = TIMER_DUE;
+        t->next = TIMER_NIL;
+        if (*due_last != TIMER_NIL) {
+            timer_pool[*due_last].next = index;
+        } else {
+            *due = index;
+        }
+        *due_last = index;
+        --sched_pending;
+        index = next;
+    }
+    ++wheel_tick;
+}
+
+void *scheduler_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&sched_mutex);
+    uint64_t reclaim_at = monotonic_ms() + RCU_RECLAIM_MS;
+    while (1) {
+        if (monotonic_ms() >= reclaim_at) {
+            pthread_mutex_unlock(&sched_mutex);
+            rcu_poll();
+            pthread_mutex_lock(&sched_mutex);
+            reclaim_at = monotonic_ms() + RCU_RECLAIM_MS;
+        }
+        if (sched_pending == 0) {
+            struct timespec deadline;
+            deadline.tv_sec = reclaim_at / 1000;
+            deadline.tv_nsec = (reclaim_at % 1000) * 1000000;
+            pthread_cond_timedwait(&sched_cond, &sched_mutex, &deadline);
+            continue;
+        }
+        uint64_t now = current_tick();
+        uint32_t due = TIMER_NIL, due_last = TIMER_NIL;
+        while (sched_pending > 0 && wheel_tick <= now) {
+            wheel_run_tick(&due, &due_last);
+        }
+        if (due != TIMER_NIL) {
+            /* Delivery may block on a client, so it runs without sched_mutex. */
+            sched_firing = 1;
+            while (due != TIMER_NIL) {
+                due = timer_fire(due);
+            }
+            sched_firing = 0;
+            pthread_cond_broadcast(&sched_idle);
+            continue;
+        }
+        uint64_t next_ms = wheel_tick * TICK_MS;
+        struct timespec deadline;
+        deadline.tv_sec = next_ms / 1000;
+        deadline.tv_nsec = (next_ms % 1000) * 1000000;
+        pthread_cond_timedwait(&sched_cond, &sched_mutex, &deadline);
+    }
+    return NULL;
+}
+
+int scheduler_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            wheel[level][slot] = TIMER_NIL;
+        }
+    }
+    wheel_tick = current_tick();
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, scheduler_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+long schedule_delay(const char *sender_name, const char *recipient_name, const char *message, int delay) {
+    size_t len = strlen(message) + 1;
+    char *copy = pool_alloc(len, 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, message, len);
+
+    pthread_mutex_lock(&sched_mutex);
+    uint32_t index = timer_alloc();
+    if (index == TIMER_NIL) {
+        pthread_mutex_unlock(&sched_mutex);
+        pool_free(copy);
+        return -1;
+    }
+    uint64_t now = current_tick();
+    if (sched_pending == 0 && wheel_tick < now) {
+        wheel_tick = now;
+    }
+
+    delay_timer_t *t = &timer_pool[index];
+    t->state = TIMER_PENDING;
+    t->delay = delay;
+    t->expires = now + (uint64_t)delay * 1000 / TICK_MS;
+    strncpy(t->sender_name, sender_name, NAME_LEN - 1);
+    t->sender_name[NAME_LEN - 1] = '\0';
+    strncpy(t->recipient_name, recipient_name, NAME_LEN - 1);
+    t->recipient_name[NAME_LEN - 1] = '\0';
+    t->message = copy;
+    wheel_link(index);
+    if (sched_pending++ == 0) {
+        pthread_cond_signal(&sched_cond);
+    }
+    long id = (long)timer_public_id(index);
+    pthread_mutex_unlock(&sched_mutex);
+    return id;
+}
+
+int cancel_delay(const char *sender_name, unsigned long id) {
+    uint32_t index = (id - 1) & (MAX_PENDING_DELAYS - 1);
+    int cancelled = 0;
+
+    pthread_mutex_lock(&sched_mutex);
+    if (index < timer_pool_used && timer_pool[index].state == TIMER_PENDING &&
+        timer_public_id(index) == id && strcmp(timer_pool[index].sender_name, sender_name) == 0) {
+        wheel_unlink(index);
+        timer_release(index);
+        --sched_pending;
+        cancelled = 1;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return cancelled;
+}
+
+void list_delays(client_t *requester) {
+    char list_buffer[BUFFER_SIZE] = "Server: Pending delayed messages:\n";
+    size_t current_len = strlen(list_buffer);
+    const char *truncated = "- ... (list truncated)\n";
+    int count = 0;
+
+    pthread_mutex_lock(&sched_mutex);
+    uint64_t now = current_tick();
+    for (uint32_t i = 0; i < timer_pool_used; ++i) {
+        delay_timer_t *t = &timer_pool[i];
+        if (t->state != TIMER_PENDING || strcmp(t->sender_name, requester->name) != 0) {
+            continue;
+        }
+        uint64_t remaining = t->expires > now ? ((t->expires - now) * TICK_MS + 999) / 1000 : 0;
+        int needed = snprintf(list_buffer + current_len, sizeof(list_buffer) - current_len,
+                              "- #%lu to %s in %lus: %.40s\n", timer_public_id(i), t->recipient_name,
+                              (unsigned long)remaining, t->message);
+        if (needed < 0 || (size_t)needed >= sizeof(list_buffer) - current_len - strlen(truncated)) {
+            strcpy(list_buffer + current_len, truncated);
+            count++;
+            break;
+        }
+        current_len += needed;
+        count++;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+
+    if (count == 0) {
+        strcat(list_buffer, "(No pending delayed messages)\n");
+    }
+    client_send_str(requester, list_buffer);
+}
+
+int is_admin(const client_t *cli) {
+    for (int i = 0; i < admin_count; ++i) {
+        if (strcmp(admin_names[i], cli->name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void read_gauges(size_t *connected, size_t *room_count, size_t *pending) {
+    rcu_read_lock();
+    registry_view_t *view = atomic_load(&client_view);
+    *connected = view ? view->count : 0;
+    rcu_read_unlock();
+    pthread_mutex_lock(&rooms_mutex);
+    *room_count = rooms.count;
+    pthread_mutex_unlock(&rooms_mutex);
+    pthread_mutex_lock(&sched_mutex);
+    *pending = sched_pending;
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/* Average pooled bytes held by each open connection, handshaking ones included. */
+size_t memory_per_connection(void) {
+    long live = atomic_load_explicit(&live_clients, memory_order_relaxed);
+    return live > 0 ? atomic_load_explicit(&mem_conn, memory_order_relaxed) / live : 0;
+}
+
+void write_latency_line(FILE *f, const char *label, latency_hist_t *h) {
+    unsigned long n = atomic_load_explicit(&h->count, memory_order_relaxed);
+    unsigned long sum = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    fprintf(f, "- %s: %lu, avg %lu us, p50 <= %lu us, p99 <= %lu us\n", label, n,
+            n ? sum / n / 1000 : 0, latency_quantile(h, 0.5), latency_quantile(h, 0.99));
+}
+
+void write_stats(FILE *f) {
+    size_t connected, room_count, pending;
+    read_gauges(&connected, &room_count, &pending);
+    fprintf(f, "Server: Stats:\n");
+    fprintf(f, "- clients: %zu connected, %lu accepted, %lu handshake timeouts, %lu refused for lack of fds\n",
+            connected, atomic_load(&stat_connections), atomic_load(&stat_handshake_timeouts),
+            atomic_load(&stat_accept_refused));
+    fprintf(f, "- rooms: %zu\n", room_count);
+    fprintf(f, "- messages: %lu in, %lu out in %lu writes\n", atomic_load(&stat_msgs_in),
+            atomic_load(&stat_msgs_delivered), atomic_load(&stat_write_calls));
+    fprintf(f, "- bytes: %lu in, %lu out\n", atomic_load(&stat_bytes_in), atomic_load(&stat_bytes_out));
+    fprintf(f, "- drops: %lu, slow disconnects: %lu, send errors: %lu, overlong input: %lu\n",
+            atomic_load(&stat_out_drops), atomic_load(&stat_slow_disconnects), atomic_load(&stat_send_errors),
+            atomic_load(&stat_long_lines));
+    fprintf(f, "- delays: %zu pending, %lu fired\n", pending, atomic_load(&stat_delays_fired));
+    fprintf(f, "- history: %lu appended, %lu replays\n", atomic_load(&stat_history_appends),
+            atomic_load(&stat_history_replays));
+    fprintf(f, "- mailbox: %lu stored, %lu delivered\n", atomic_load(&stat_mail_stored),
+            atomic_load(&stat_mail_delivered));
+    fprintf(f, "- log records dropped: %lu\n", atomic_load(&stat_log_drops));
+    fprintf(f, "- presence: %d watching, %lu snapshots built\n", atomic_load(&subscriber_total),
+            atomic_load(&stat_presence_builds));
+    fprintf(f, "- memory: %zu KB in use, %zu KB reserved, %zu bytes per connection\n", atomic_load(&mem_used) / 1024,
+            atomic_load(&mem_reserved) / 1024, memory_per_connection());
+    if (mem_limit) {
+        fprintf(f, "- memory limit: %zu KB, %lu connections refused, %lu allocations shed\n", mem_limit / 1024,
+                atomic_load(&stat_mem_rejects), atomic_load(&stat_mem_shed));
+    }
+    if (link_port || peer_count) {
+        pthread_mutex_lock(&remote_mutex);
+        size_t remote = remote_count;
+        pthread_mutex_unlock(&remote_mutex);
+        fprintf(f, "- links: node %s, %d up, %zu remote users, %lu frames out, %lu frames in, %lu resets, "
+                "%lu sender pauses\n", node_name, atomic_load(&links_up), remote, atomic_load(&stat_link_frames_out),
+                atomic_load(&stat_link_frames_in), atomic_load(&stat_link_resets), atomic_load(&stat_link_pauses));
+    }
+    if (rate_limited) {
+        fprintf(f, "- rate limited: %lu input, %lu message, %lu pm, %lu list, %lu delay\n",
+                atomic_load(&stat_rate_limited[RATE_INPUT]), atomic_load(&stat_rate_limited[RATE_MESSAGE]),
+                atomic_load(&stat_rate_limited[RATE_PM]), atomic_load(&stat_rate_limited[RATE_LIST]),
+                atomic_load(&stat_rate_limited[RATE_DELAY]));
+    }
+    write_latency_line(f, "broadcast fan-out", &fanout_hist);
+    for (int c = 0; c < CMD_COUNT; ++c) {
+        if (atomic_load_explicit(&command_hist[c].count, memory_order_relaxed) > 0) {
+            char label[32];
+            snprintf(label, sizeof(label), "command %s", command_names[c]);
+            write_latency_line(f, label, &command_hist[c]);
+        }
+    }
+}
+
+void write_metric(FILE *f, const char *name, const char *type, const char *help, unsigned long value) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+void write_histogram(FILE *f, const char *name, const char *labels, latency_hist_t *h) {
+    unsigned long cumulative = 0;
+    const char *sep = *labels ? "," : "";
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep, (double)(1ul << i) / 1e6, cumulative);
+    }
+    cumulative += atomic_load_explicit(&h->buckets[LATENCY_BUCKETS], memory_order_relaxed);
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, cumulative);
+    const char *lbrace = *labels ? "{" : "", *rbrace = *labels ? "}" : "";
+    fprintf(f, "%s_sum%s%s%s %.9f\n", name, lbrace, labels, rbrace,
+            atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9);
+    fprintf(f, "%s_count%s%s%s %lu\n", name, lbrace, labels, rbrace, cumulative);
+}
+
+/* Prometheus text exposition format, version 0.0.4. */
+void write_metrics(FILE *f) {
+    size_t connected, room_count, pending;
+    read_gauges(&connected, &room_count, &pending);
+    write_metric(f, "chat_clients_connected", "gauge", "Registered clients.", connected);
+    write_metric(f, "chat_rooms", "gauge", "Rooms with at least one member, plus the lobby.", room_count);
+    write_metric(f, "chat_connections_total", "counter", "Accepted connections.", atomic_load(&stat_connections));
+    write_metric(f, "chat_handshake_timeouts_total", "counter", "Connections closed for not sending a name in time.",
+                 atomic_load(&stat_handshake_timeouts));
+    write_metric(f, "chat_accept_refused_total", "counter", "Connections closed unserved because no descriptor was free.",
+                 atomic_load(&stat_accept_refused));
+    write_metric(f, "chat_messages_in_total", "counter", "Lines received from clients.", atomic_load(&stat_msgs_in));
+    write_metric(f, "chat_messages_out_total", "counter", "Messages written to clients.", atomic_load(&stat_msgs_delivered));
+    write_metric(f, "chat_write_calls_total", "counter", "sendmsg() calls that wrote data.", atomic_load(&stat_write_calls));
+    write_metric(f, "chat_bytes_in_total", "counter", "Bytes received from clients.", atomic_load(&stat_bytes_in));
+    write_metric(f, "chat_bytes_out_total", "counter", "Bytes written to clients.", atomic_load(&stat_bytes_out));
+    write_metric(f, "chat_queue_drops_total", "counter", "Messages dropped by the slow-consumer policy.", atomic_load(&stat_out_drops));
+    write_metric(f, "chat_slow_disconnects_total", "counter", "Clients disconnected for not keeping up.", atomic_load(&stat_slow_disconnects));
+    write_metric(f, "chat_send_errors_total", "counter", "Failed writes to client sockets.", atomic_load(&stat_send_errors));
+    write_metric(f, "chat_input_too_long_total", "counter", "Lines over --max-line and oversized frames.", atomic_load(&stat_long_lines));
+    write_metric(f, "chat_delays_pending", "gauge", "Scheduled /delay messages.", pending);
+    write_metric(f, "chat_delays_fired_total", "counter", "Delivered /delay messages.", atomic_load(&stat_delays_fired));
+    write_metric(f, "chat_history_appends_total", "counter", "Messages written to the history log.",
+                 atomic_load(&stat_history_appends));
+    write_metric(f, "chat_history_replays_total", "counter", "History replays sent to clients.",
+                 atomic_load(&stat_history_replays));
+    write_metric(f, "chat_mail_stored_total", "counter", "PMs saved for offline users.",
+                 atomic_load(&stat_mail_stored));
+    write_metric(f, "chat_mail_delivered_total", "counter", "Saved PMs delivered on join.",
+                 atomic_load(&stat_mail_delivered));
+    write_metric(f, "chat_log_drops_total", "counter", "Log records dropped because a log ring was full.",
+                 atomic_load(&stat_log_drops));
+    write_metric(f, "chat_presence_watchers", "gauge", "Clients subscribed to joins and leaves with /watch.",
+                 atomic_load(&subscriber_total));
+    write_metric(f, "chat_presence_snapshots_total", "counter", "User list snapshots built for /list.",
+                 atomic_load(&stat_presence_builds));
+    write_metric(f, "chat_memory_bytes", "gauge", "Pooled bytes in use.", atomic_load(&mem_used));
+    write_metric(f, "chat_memory_reserved_bytes", "gauge", "Bytes held by the allocation pools.", atomic_load(&mem_reserved));
+    write_metric(f, "chat_memory_per_connection_bytes", "gauge", "Average pooled bytes held by one open connection.",
+                 memory_per_connection());
+    write_metric(f, "chat_memory_limit_bytes", "gauge", "The --mem-limit setting (0 if unset).", mem_limit);
+    write_metric(f, "chat_memory_rejects_total", "counter", "Connections refused at the memory limit.",
+                 atomic_load(&stat_mem_rejects));
+    write_metric(f, "chat_memory_shed_total", "counter", "Allocations refused at the memory limit.",
+                 atomic_load(&stat_mem_shed));
+    pthread_mutex_lock(&remote_mutex);
+    size_t remote = remote_count;
+    pthread_mutex_unlock(&remote_mutex);
+    write_metric(f, "chat_links_up", "gauge", "Links to other nodes that completed the handshake.",
+                 atomic_load(&links_up));
+    write_metric(f, "chat_remote_users", "gauge", "Users announced by other nodes.", remote);
+    write_metric(f, "chat_link_frames_out_total", "counter", "Frames queued to other nodes.",
+                 atomic_load(&stat_link_frames_out));
+    write_metric(f, "chat_link_frames_in_total", "counter", "Frames received from other nodes.",
+                 atomic_load(&stat_link_frames_in));
+    write_metric(f, "chat_link_resets_total", "counter", "Links reset for falling too far behind.",
+                 atomic_load(&stat_link_resets));
+    write_metric(f, "chat_link_sender_pauses_total", "counter", "Times a local sender waited for a congested link.",
+                 atomic_load(&stat_link_pauses));
+    fprintf(f, "# HELP chat_rate_limited_total Times a client's reads were paused, by the bucket that ran dry.\n"
+               "# TYPE chat_rate_limited_total counter\n");
+    for (int c = 0; c < RATE_CLASSES; ++c) {
+        fprintf(f, "chat_rate_limited_total{bucket=\"%s\"} %lu\n", rate_names[c], atomic_load(&stat_rate_limited[c]));
+    }
+
+    fprintf(f, "# HELP chat_broadcast_fanout_seconds Time to queue one broadcast for every member.\n"
+               "# TYPE chat_broadcast_fanout_seconds histogram\n");
+    write_histogram(f, "chat_broadcast_fanout_seconds", "", &fanout_hist);
+    fprintf(f, "# HELP chat_command_seconds Time to handle one input line, by command.\n"
+               "# TYPE chat_command_seconds histogram\n");
+    for (int c = 0; c < CMD_COUNT; ++c) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_names[c]);
+        write_histogram(f, "chat_command_seconds", labels, &command_hist[c]);
+    }
+}
+
+void send_stats(client_t *cli) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (!f) {
+        client_send_str(cli, "Server: Stats unavailable.\n");
+        return;
+    }
+    write_stats(f);
+    fclose(f);
+    client_send(cli, text, len);
+    free(text);
+}
+
+void delay_command(client_t *cli, long delay_val, const char *recipient, const char *msg) {
+    if (delay_val <= 0 || delay_val > MAX_DELAY_SECONDS) {
+        client_send_str(cli, "Server: Invalid time (must be positive integer seconds, max 86400).\n");
+    } else if (*msg == '\0') {
+        client_send_str(cli, "Server: Usage /delay <time_seconds> <recipient> <message>\n");
+    } else {
+        long id = schedule_delay(cli->name, recipient, msg, (int)delay_val);
+        if (id >= 0) {
+            char confirm[160];
+            snprintf(confirm, sizeof(confirm),
+                     "Server: Message to %s scheduled in %ld seconds (id %ld).\n",
+                     recipient, delay_val, id);
+            client_send_str(cli, confirm);
+        } else {
+            client_send_str(cli, "Server: Failed to schedule message.\n");
+        }
+    }
+}
+
+command_t run_command(client_t *cli, char *current_line) {
+    log_received_line(cli->name, current_line);
+    if (current_line[0] != '/') {
+        broadcast(cli, cli->name, current_line, 1);
+        return CMD_MESSAGE;
+    }
+
+    command_t cmd = CMD_UNKNOWN;
+    if (strcmp(current_line, "/list") == 0 || strncmp(current_line, "/list ", 6) == 0) {
+        cmd = CMD_LIST;
+        list_command(cli, current_line + 5);
+    } else if (strncmp(current_line, "/pm ", 4) == 0 || strncmp(current_line, "/send ", 6) == 0) {
+        cmd = CMD_PM;
+        char *saveptr = current_line;
+        char *recipient = strtok_r(saveptr + (current_line[1]=='p'?4:6), " ", &saveptr);
+        char *msg = saveptr;
+        if (recipient && *recipient) {
+            msg = trimwhitespace(msg);
+            if (*msg) {
+                send_private_message(cli, cli->name, recipient, msg);
+            } else {
+                client_send_str(cli, "Server: Usage /pm <recipient> <message>\n");
+            }
+        } else {
+            client_send_str(cli, "Server: Usage /pm <recipient> <message>\n");
+        }
+    } else if (strncmp(current_line, "/delay ", 7) == 0) {
+        cmd = CMD_DELAY;
+        char *saveptr = current_line;
+        char *time_str = strtok_r(saveptr + 7, " ", &saveptr);
+        char *recipient = strtok_r(NULL, " ", &saveptr);
+        char *msg = saveptr;
+        if (time_str && recipient && *time_str && *recipient) {
+            char *endptr;
+            errno = 0;
+            long delay_val = strtol(time_str, &endptr, 10);
+            if (errno || *endptr != '\0') {
+                delay_val = -1;
+            }
+            delay_command(cli, delay_val, recipient, trimwhitespace(msg));
+        } else {
+            client_send_str(cli, "Server: Usage /delay <time_seconds> <recipient> <message>\n");
+        }
+    } else if (strcmp(current_line, "/delays") == 0) {
+        cmd = CMD_DELAYS;
+        list_delays(cli);
+    } else if (strncmp(current_line, "/cancel ", 8) == 0) {
+        cmd = CMD_CANCEL;
+        char *endptr;
+        char *id_str = trimwhitespace(current_line + 8);
+        errno = 0;
+        unsigned long id = strtoul(id_str, &endptr, 10);
+        char reply[100];
+        if (errno || endptr == id_str || *endptr != '\0') {
+            client_send_str(cli, "Server: Usage /cancel <id>\n");
+        } else if (cancel_delay(cli->name, id)) {
+            snprintf(reply, sizeof(reply), "Server: Delayed message %lu cancelled.\n", id);
+            client_send_str(cli, reply);
+        } else {
+            snprintf(reply, sizeof(reply), "Server: No pending delayed message with id %lu.\n", id);
+            client_send_str(cli, reply);
+        }
+    } else if (strcmp(current_line, "/join") == 0 || strncmp(current_line, "/join ", 6) == 0) {
+        cmd = CMD_JOIN;
+        join_room(cli, current_line + 5);
+    } else if (strcmp(current_line, "/part") == 0) {
+        cmd = CMD_PART;
+        part_room(cli);
+    } else if (strcmp(current_line, "/rooms") == 0) {
+        cmd = CMD_ROOMS;
+        list_rooms(cli);
+    } else if (strcmp(current_line, "/history") == 0 || strncmp(current_line, "/history ", 9) == 0) {
+        cmd = CMD_HISTORY;
+        show_history(cli, current_line + 8);
+    } else if (strcmp(current_line, "/watch") == 0 || strcmp(current_line, "/unwatch") == 0) {
+        cmd = CMD_WATCH;
+        watch_command(cli, current_line[1] == 'w');
+    } else if (strcmp(current_line, "/stats") == 0) {
+        cmd = CMD_STATS;
+        if (is_admin(cli)) {
+            send_stats(cli);
+        } else {
+            client_send_str(cli, "Server: /stats is only available to admins.\n");
+        }
+    } else {
+        client_send_str(cli, "Server: Unknown command.\n");
+    }
+    return cmd;
+}
+
+void handle_line(client_t *cli, char *current_line) {
+    uint64_t start = monotonic_ns();
+    command_t cmd = run_command(cli, current_line);
+    atomic_fetch_add_explicit(&stat_msgs_in, 1, memory_order_relaxed);
+    latency_observe(&command_hist[cmd], monotonic_ns() - start);
+}
+
+/* Resolves a frame's (id, name) recipient into name; the id wins when it is set. */
+int resolve_recipient(uint32_t id, char name[NAME_LEN]) {
+    if (id == 0) {
+        return name[0] != '\0';
+    }
+    rcu_read_lock();
+    client_t *cl = registry_find_id(&clients, id);
+    if (cl) {
+        strcpy(name, cl->name);
+    }
+    rcu_read_unlock();
+    return cl != NULL;
+}
+
+command_t run_frame(client_t *cli, uint8_t op, const unsigned char *payload, size_t len) {
+    frame_reader_t r = {payload, len, 0};
+    char text[FRAME_MAX_PAYLOAD + 1];
+    char name[NAME_LEN];
+
+    log_received_frame(cli->name, op, len);
+    switch (op) {
+    case OP_SAY:
+        if (frame_get_text(&r, text, sizeof(text)) > 0) {
+            broadcast(cli, cli->name, text, 1);
+        }
+        return CMD_MESSAGE;
+    case OP_PM: {
+        uint32_t id = frame_get_u32(&r);
+        frame_get_name(&r, name);
+        frame_get_text(&r, text, sizeof(text));
+        if (r.error) {
+            client_send_str(cli, "Server: Malformed PM frame.\n");
+        } else if (!resolve_recipient(id, name)) {
+            client_send_str(cli, "Server: User not found or is offline.\n");
+        } else {
+            send_private_message(cli, cli->name, name, text);
+        }
+        return CMD_PM;
+    }
+    case OP_LIST: {
+        /* An empty payload asks for the first page of everyone. */
+        uint32_t page = len > 0 ? frame_get_u32(&r) : 1;
+        name[0] = '\0';
+        if (r.len > 0) {
+            frame_get_name(&r, name);
+        }
+        if (r.error) {
+            client_send_str(cli, "Server: Malformed list frame.\n");
+        } else {
+            list_clients(cli, name, page ? page : 1);
+        }
+        return CMD_LIST;
+    }
+    case OP_DELAY: {
+        uint32_t seconds = frame_get_u32(&r);
+        uint32_t id = frame_get_u32(&r);
+        frame_get_name(&r, name);
+        frame_get_text(&r, text, sizeof(text));
+        if (r.error) {
+            client_send_str(cli, "Server: Malformed delay frame.\n");
+        } else if (!resolve_recipient(id, name)) {
+            client_send_str(cli, "Server: User not found or is offline.\n");
+        } else {
+            delay_command(cli, seconds > MAX_DELAY_SECONDS ? -1 : (long)seconds, name, text);
+        }
+        return CMD_DELAY;
+    }
+    case OP_COMMAND: {
+        frame_get_text(&r, text, sizeof(text));
+        char *line = trimwhitespace(text);
+        return *line ? run_command(cli, line) : CMD_UNKNOWN;
+    }
+    default:
+        client_send_str(cli, "Server: Unknown frame opcode.\n");
+        return CMD_UNKNOWN;
+    }
+}
+
+void handle_frame(client_t *cli, uint8_t op, const unsigned char *payload, size_t len) {
+    uint64_t start = monotonic_ns();
+    command_t cmd = run_frame(cli, op, payload, len);
+    atomic_fetch_add_explicit(&stat_msgs_in, 1, memory_order_relaxed);
+    latency_observe(&command_hist[cmd], monotonic_ns() - start);
+}
+
+/* Which command bucket a line draws from, besides the input bucket every line draws from. */
+rate_class_t line_rate_class(const char *p, size_t len) {
+    while (len > 0 && isspace((unsigned char)*p)) {
+        p++;
+        len--;
+    }
+    if (len == 0) {
+        return RATE_INPUT;
+    }
+    if (*p != '/') {
+        return RATE_MESSAGE;
+    }
+    if ((len > 4 && strncmp(p, "/pm ", 4) == 0) || (len > 6 && strncmp(p, "/send ", 6) == 0)) {
+        return RATE_PM;
+    }
+    if (len >= 5 && strncmp(p, "/list", 5) == 0 && (len == 5 || isspace((unsigned char)p[5]))) {
+        return RATE_LIST;
+    }
+    if (len > 7 && strncmp(p, "/delay ", 7) == 0) {
+        return RATE_DELAY;
+    }
+    return RATE_INPUT;
+}
+
+rate_class_t frame_rate_class(uint8_t op, const unsigned char *payload, size_t len) {
+    switch (op) {
+    case OP_SAY:
+        return RATE_MESSAGE;
+    case OP_PM:
+        return RATE_PM;
+    case OP_LIST:
+        return RATE_LIST;
+    case OP_DELAY:
+        return RATE_DELAY;
+    case OP_COMMAND:
+        return line_rate_class((const char *)payload, len);
+    default:
+        return RATE_INPUT;
+    }
+}
+
+/* Reads are paused for the rate limits and while a link is congested. */
+int rate_state_needed(void) {
+    return rate_limited || link_port || peer_count;
+}
+
+rate_state_t *rate_state_create(void) {
+    rate_state_t *rate = conn_alloc(sizeof(rate_state_t), 1);
+    if (!rate) {
+        return NULL;
+    }
+    memset(rate, 0, sizeof(*rate));
+    uint32_t now = (uint32_t)monotonic_ms();
+    for (int c = 0; c < RATE_CLASSES; ++c) {
+        rate->buckets[c].tokens = rate_limits[c].burst * 1000;
+        rate->buckets[c].stamp_ms = now;
+    }
+    return rate;
+}
+
+/*
+ * Takes a token from the input bucket and from cls's bucket. If either is empty, nothing is
+ * taken and the result is how many milliseconds until both will have one. Messages and PMs
+ * also wait while a link is congested, as they may be forwarded over it.
+ */
+uint32_t rate_admit(client_t *cli, rate_class_t cls) {
+    if ((cls == RATE_MESSAGE || cls == RATE_PM) && atomic_load_explicit(&links_congested, memory_order_relaxed) > 0) {
+        atomic_fetch_add_explicit(&stat_link_pauses, 1, memory_order_relaxed);
+        log_msg(LOG_DEBUG, "Client %s is waiting for a congested link, pausing reads for %d ms.", cli->name,
+                LINK_BACKOFF_MS);
+        return LINK_BACKOFF_MS;
+    }
+    rate_class_t classes[2] = {RATE_INPUT, cls};
+    int n = cls == RATE_INPUT ? 1 : 2;
+    uint32_t now = (uint32_t)monotonic_ms();
+    uint32_t wait = 0;
+    rate_class_t hit = RATE_INPUT;
+    for (int i = 0; i < n; ++i) {
+        const rate_limit_t *limit = &rate_limits[classes[i]];
+        rate_bucket_t *b = &cli->rate->buckets[classes[i]];
+        if (limit->rate == 0) {
+            continue;
+        }
+        uint64_t tokens = b->tokens + (uint64_t)(uint32_t)(now - b->stamp_ms) * limit->rate;
+        if (tokens > (uint64_t)limit->burst * 1000) {
+            tokens = (uint64_t)limit->burst * 1000;
+        }
+        b->tokens = (uint32_t)tokens;
+        b->stamp_ms = now;
+        if (tokens < 1000) {
+            uint32_t w = (uint32_t)((1000 - tokens + limit->rate - 1) / limit->rate);
+            if (w > wait) {
+                wait = w;
+                hit = classes[i];
+            }
+        }
+    }
+    if (wait > 0) {
+        atomic_fetch_add_explicit(&stat_rate_limited[hit], 1, memory_order_relaxed);
+        log_msg(LOG_DEBUG, "Client %s is over its %s rate, pausing reads for %u ms.", cli->name, rate_names[hit], wait);
+        return wait;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (rate_limits[classes[i]].rate) {
+            cli->rate->buckets[classes[i]].tokens -= 1000;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Stops reading from cli for wait_ms: its unread input stays buffered and the kernel's socket
+ * buffers push back on the sender. Event-loop clients wait on their shard's paused list.
+ */
+void rate_pause(client_t *cli, uint32_t wait_ms) {
+    pthread_mutex_lock(&cli->out_mutex);
+    cli->rate->resume_ms = monotonic_ms() + wait_ms;
+    if (server_mode == MODE_EPOLL) {
+        client_watch(cli, cli->want_write);
+    }
+    pthread_mutex_unlock(&cli->out_mutex);
+    cli->in.held = 1;
+    if (server_mode != MODE_THREADS) {
+        cli->rate->paused_next = cli->shard->paused_head;
+        cli->shard->paused_head = cli;
+    }
+}
+
+void rate_resume(client_t *cli) {
+    pthread_mutex_lock(&cli->out_mutex);
+    cli->rate->resume_ms = 0;
+    if (server_mode == MODE_EPOLL) {
+        client_watch(cli, cli->want_write);
+    }
+    pthread_mutex_unlock(&cli->out_mutex);
+    cli->in.held = 0;
+}
+
+/* Unlinks and returns the paused clients that are due, chained through paused_next; lowers *wait_ms to the next one. */
+client_t *rate_take_due(shard_t *sh, int *wait_ms) {
+    uint64_t now = monotonic_ms();
+    client_t *due = NULL;
+    client_t **pp = &sh->paused_head;
+    while (*pp) {
+        client_t *cli = *pp;
+        if (cli->rate->resume_ms <= now) {
+            *pp = cli->rate->paused_next;
+            cli->rate->paused_next = due;
+            due = cli;
+            continue;
+        }
+        int left = (int)(cli->rate->resume_ms - now);
+        if (*wait_ms < 0 || left < *wait_ms) {
+            *wait_ms = left;
+        }
+        pp = &cli->rate->paused_next;
+    }
+    return due;
+}
+
+void rate_untrack(client_t *cli) {
+    if (!cli->rate || !cli->rate->resume_ms || server_mode == MODE_THREADS) {
+        return;
+    }
+    for (client_t **pp = &cli->shard->paused_head; *pp; pp = &(*pp)->rate->paused_next) {
+        if (*pp == cli) {
+            *pp = cli->rate->paused_next;
+            break;
+        }
+    }
+}
+
+/* Each frame is handled in place from the input buffer. A frame over the rate limit waits there. */
+void process_frames(client_t *cli) {
+    in_buf_t *in = &cli->in;
+    while (in->tail - in->head >= FRAME_HEADER_LEN) {
+        const unsigned char *p = (const unsigned char *)in->data + in->head;
+        uint32_t len = frame_get_be32(p);
+        if (len > FRAME_MAX_PAYLOAD) {
+            log_msg(LOG_WARN, "Client %s sent an oversized frame (%u bytes), closing.", cli->name, len);
+            atomic_fetch_add_explicit(&stat_long_lines, 1, memory_order_relaxed);
+            client_send_str(cli, "Server: Frame too large.\n");
+            shutdown(cli->sockfd, SHUT_RD);
+            in->head = in->tail = in->scanned = 0;
+            return;
+        }
+        if (in->tail - in->head < FRAME_HEADER_LEN + len) {
+            break;
+        }
+        if (cli->rate) {
+            uint32_t wait = rate_admit(cli, frame_rate_class(p[4], p + FRAME_HEADER_LEN, len));
+            if (wait > 0) {
+                rate_pause(cli, wait);
+                return;
+            }
+        }
+        in->head += FRAME_HEADER_LEN + len;
+        handle_frame(cli, p[4], p + FRAME_HEADER_LEN, len);
+    }
+}
+
+/*
+ * Hands each complete line to handle_line() as a NUL-terminated slice of the input buffer.
+ * Only bytes received since the last call are scanned. A line longer than max_line is
+ * reported once and dropped up to its newline; the rest of the stream is unaffected. A line
+ * over the rate limit is left in place and the scan resumes from it once reads resume.
+ */
+void process_lines(client_t *cli) {
+    in_buf_t *in = &cli->in;
+    char *newline_pos;
+    while ((newline_pos = find_newline(in->data + in->scanned, in->tail - in->scanned)) != NULL) {
+        char *line_start = in->data + in->head;
+        if (cli->rate && !in->discarding) {
+            uint32_t wait = rate_admit(cli, line_rate_class(line_start, newline_pos - line_start));
+            if (wait > 0) {
+                in->scanned = in->head;
+                rate_pause(cli, wait);
+                return;
+            }
+        }
+        *newline_pos = '\0';
+        in->head = in->scanned = newline_pos + 1 - in->data;
+        if (in->discarding) {
+            in->discarding = 0;
+            continue;
+        }
+        char *current_line = trimwhitespace(line_start);
+        if (*current_line) {
+            handle_line(cli, current_line);
+        }
+    }
+    in->scanned = in->tail;
+
+    if (in->tail - in->head > max_line) {
+        if (!in->discarding) {
+            char reply[80];
+            log_msg(LOG_WARN, "Client %s sent a line over %zu bytes, discarding it.", cli->name, max_line);
+            atomic_fetch_add_explicit(&stat_long_lines, 1, memory_order_relaxed);
+            snprintf(reply, sizeof(reply), "Server: Line too long (max %zu bytes), discarded.\n", max_line);
+            client_send_str(cli, reply);
+            in->discarding = 1;
+        }
+        in->head = in->tail = in->scanned = 0;
+    }
+}
+
+void process_input(client_t *cli) {
+    if (cli->rate && cli->rate->resume_ms) {
+        return;
+    }
+    if (cli->binary) {
+        process_frames(cli);
+    } else {
+        process_lines(cli);
+    }
+    if (cli->in.head == cli->in.tail) {
+        in_buf_release(&cli->in);
+    }
+}
+
+void announce_join(client_t *cli) {
+    char buffer[BUFFER_SIZE];
+    log_msg(LOG_INFO, "Client joined: %s (%s:%d) with fd %d on shard %d", cli->name,
+            inet_ntoa(cli->addr.sin_addr), ntohs(cli->addr.sin_port), cli->sockfd, cli->shard->id);
+    snprintf(buffer, sizeof(buffer), "%s joined the chat room.", cli->name);
+    broadcast(cli, "Server", buffer, 0);
+    presence_notify(cli->name, cli->id, NULL, 1);
+}
+
+void announce_leave(client_t *cli, int error) {
+    char buffer[BUFFER_SIZE];
+    if (cli->slow_disconnect) {
+        log_msg(LOG_WARN, "Client too slow, disconnected: %s (fd %d)", cli->name, cli->sockfd);
+        snprintf(buffer, sizeof(buffer), "%s was disconnected (not keeping up).", cli->name);
+    } else if (!error) {
+        log_msg(LOG_INFO, "Client disconnected: %s (fd %d)", cli->name, cli->sockfd);
+        snprintf(buffer, sizeof(buffer), "%s left the chat room.", cli->name);
+    } else {
+        log_msg(LOG_WARN, "Client error: %s (fd %d): %s", cli->name, cli->sockfd, strerror(errno));
+        snprintf(buffer, sizeof(buffer), "%s left due to an error.", cli->name);
+    }
+    /* Broadcasters holding an older member list may still be queueing to cli. */
+    pthread_mutex_lock(&cli->out_mutex);
+    log_msg(LOG_DEBUG, "Client %s received %lu messages in %lu writes, dropped %lu (peak queue depth %zu, %zu bytes held).",
+            cli->name, cli->out_msgs, cli->out_writes, cli->out_drops, cli->out_peak,
+            pool_charge(cli) + pool_charge(cli->in.data) + pool_charge(cli->out_q) + pool_charge(cli->send));
+    pthread_mutex_unlock(&cli->out_mutex);
+    broadcast(cli, "Server", buffer, 0);
+}
+
+/* Subscribers hear about the leave only once the user is out of the registry and the snapshot. */
+void client_leave(client_t *cli, int error) {
+    announce_leave(cli, error);
+    remove_client(cli->sockfd);
+    presence_notify(cli->name, cli->id, NULL, 0);
+}
+
+void reject_client(client_t *cli, const char *reply) {
+    if (cli->binary) {
+        unsigned char frame[BUFFER_SIZE];
+        frame_writer_t w;
+        frame_begin(&w, frame, sizeof(frame), OP_NOTICE);
+        frame_put_bytes(&w, reply, strlen(reply) - 1);
+        send(cli->sockfd, frame, frame_end(&w), MSG_NOSIGNAL);
+    } else {
+        send(cli->sockfd, reply, strlen(reply), MSG_NOSIGNAL);
+    }
+}
+
+/* Recent lobby history is replayed before the client enters the lobby, so it arrives ahead of live messages. */
+int register_client_name(client_t *cli, char *name_buf) {
+    char *clean_name = trimwhitespace(name_buf);
+    if (strncmp(clean_name, BINARY_HELLO, strlen(BINARY_HELLO)) == 0) {
+        cli->binary = 1;
+        clean_name = trimwhitespace(clean_name + strlen(BINARY_HELLO));
+    }
+    if (*clean_name == '\0') {
+        log_msg(LOG_WARN, "Client sent empty name.");
+        return -1;
+    }
+    strncpy(cli->name, clean_name, NAME_LEN - 1);
+    cli->name[NAME_LEN - 1] = '\0';
+
+    if (rate_state_needed() && (cli->rate = rate_state_create()) == NULL) {
+        log_msg(alloc_failure_level(), "Rejecting %s: rate limit state allocation failed.", cli->name);
+        reject_client(cli, "Server: Unable to join right now.\n");
+        return -1;
+    }
+    if (add_client(cli) < 0) {
+        char reply[NAME_LEN + 64];
+        if (errno == EEXIST) {
+            log_msg(LOG_WARN, "Rejecting %s: name already in use.", cli->name);
+            snprintf(reply, sizeof(reply), "Server: The name '%s' is already in use.\n", cli->name);
+        } else {
+            log_msg(LOG_ERROR, "Rejecting %s: %s", cli->name, strerror(errno));
+            snprintf(reply, sizeof(reply), "Server: Unable to join right now.\n");
+        }
+        reject_client(cli, reply);
+        return -1;
+    }
+    history_replay(cli, LOBBY_NAME, replay_count, HISTORY_REPLAY_AGE_MS, "Recent");
+    if (room_enter(cli, LOBBY_NAME) < 0) {
+        log_msg(LOG_ERROR, "Rejecting %s: cannot enter the lobby: %s", cli->name, strerror(errno));
+        remove_client(cli->sockfd);
+        reject_client(cli, "Server: Unable to join right now.\n");
+        return -1;
+    }
+    cli->registered = 1;
+    return 0;
+}
+
+int client_handshake(client_t *cli) {
+    in_buf_t *in = &cli->in;
+    char *newline_pos = find_newline(in->data + in->head, in->tail - in->head);
+    if (!newline_pos) {
+        if (in->tail - in->head >= NAME_LEN + strlen(BINARY_HELLO)) {
+            log_msg(LOG_WARN, "Client sent an overlong name.");
+            return -1;
+        }
+        return 0;
+    }
+
+    *newline_pos = '\0';
+    if (register_client_name(cli, in->data + in->head) < 0) {
+        return -1;
+    }
+    in->head = in->scanned = newline_pos + 1 - in->data;
+
+    handshake_untrack(cli);
+    announce_join(cli);
+    return 0;
+}
+
+/*
+ * Every loop that owns clients, and the link thread, parks here while an upgrade hands the
+ * server over. Thread-mode clients still in the handshake are listed so they go along too.
+ * Returns only if the upgrade was abandoned.
+ */
+void upgrade_park(client_t *handshaking) {
+    pthread_mutex_lock(&upgrade_mutex);
+    if (atomic_load(&upgrading)) {
+        if (handshaking) {
+            handshaking->handshake_next = upgrade_handshakes;
+            upgrade_handshakes = handshaking;
+        }
+        upgrade_parked++;
+        pthread_cond_broadcast(&upgrade_cond);
+        while (atomic_load(&upgrading)) {
+            pthread_cond_wait(&upgrade_cond, &upgrade_mutex);
+        }
+        upgrade_parked--;
+    }
+    pthread_mutex_unlock(&upgrade_mutex);
+}
+
+/* Clients taken over from the previous process wait on their shard until its loop starts. */
+client_t *upgrade_take_adopted(shard_t *sh) {
+    client_t *cli = sh->adopted;
+    if (cli) {
+        sh->adopted = cli->handshake_next;
+        cli->handshake_next = NULL;
+    }
+    return cli;
+}
+
+/* Client threads are counted so an upgrade knows how many must park. */
+void client_thread_exit(void) {
+    pthread_mutex_lock(&upgrade_mutex);
+    atomic_fetch_sub(&client_threads, 1);
+    pthread_cond_broadcast(&upgrade_cond);
+    pthread_mutex_unlock(&upgrade_mutex);
+}
+
+/* Reads the name line on the client's own thread, so a client that never sends one holds up nobody else. */
+int thread_handshake(client_t *cli) {
+    struct pollfd pfds[2] = {{cli->sockfd, POLLIN, 0}, {upgrade_wake_fd, POLLIN, 0}};
+    uint64_t deadline = monotonic_ms() + handshake_timeout_ms;
+    /* A client taken over mid-handshake may already have its name buffered. */
+    if (cli->in.tail > cli->in.head && client_handshake(cli) < 0) {
+        return -1;
+    }
+    while (!cli->registered) {
+        uint64_t now = monotonic_ms();
+        if (now >= deadline) {
+            atomic_fetch_add_explicit(&stat_handshake_timeouts, 1, memory_order_relaxed);
+            log_msg(LOG_WARN, "Closing %s:%d (fd %d): no name within %d ms.", inet_ntoa(cli->addr.sin_addr),
+                    ntohs(cli->addr.sin_port), cli->sockfd, handshake_timeout_ms);
+            return -1;
+        }
+        if (poll(pfds, 2, (int)(deadline - now)) <= 0) {
+            continue;
+        }
+        if (pfds[1].revents & POLLIN) {
+            upgrade_park(cli);
+            continue;
+        }
+        ssize_t nbytes = client_recv(cli);
+        if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (nbytes <= 0) {
+            log_msg(LOG_WARN, "Failed to get client name or client disconnected.");
+            return -1;
+        }
+        if (client_handshake(cli) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void *handle_client(void *arg) {
+    client_t *cli = (client_t *)arg;
+    struct pollfd pfds[3];
+    int nbytes = 0;
+
+    pthread_detach(pthread_self());
+    log_ring_size = LOG_RING_CLIENT_RECORDS;
+    if (thread_handshake(cli) < 0) {
+        client_close(cli);
+        client_destroy(cli);
+        client_thread_exit();
+        return NULL;
+    }
+    process_input(cli);
+
+    pfds[0].fd = cli->sockfd;
+    pfds[1].fd = cli->wake_fd;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = upgrade_wake_fd;
+    pfds[2].events = POLLIN;
+    while (1) {
+        int timeout = -1;
+        pthread_mutex_lock(&cli->out_mutex);
+        uint64_t resume = cli->rate ? cli->rate->resume_ms : 0;
+        pfds[0].events = (resume ? 0 : POLLIN) | (cli->out_count > 0 ? POLLOUT : 0);
+        pthread_mutex_unlock(&cli->out_mutex);
+        if (resume) {
+            uint64_t now = monotonic_ms();
+            if (now >= resume) {
+                rate_resume(cli);
+                process_input(cli);
+                continue;
+            }
+            timeout = (int)(resume - now);
+        }
+
+        if (poll(pfds, 3, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERROR, "Client %s poll failed: %s", cli->name, strerror(errno));
+            nbytes = -1;
+            break;
+        }
+        if (pfds[2].revents & POLLIN) {
+            upgrade_park(NULL);
+            continue;
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            while (read(cli->wake_fd, &count, sizeof(count)) > 0) {
+            }
+        }
+        if ((pfds[0].revents & POLLOUT) && client_drain(cli) < 0) {
+            nbytes = -1;
+            break;
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            nbytes = client_recv(cli);
+            if (nbytes <= 0) {
+                break;
+            }
+            process_input(cli);
+        }
+    }
+
+    client_leave(cli, nbytes != 0);
+    client_close(cli);
+    client_destroy(cli);
+    client_thread_exit();
+    return NULL;
+}
+
+void epoll_close_client(client_t *cli, int error) {
+    if (cli->registered) {
+        client_leave(cli, error);
+    }
+    dirty_unlink(cli);
+    handshake_untrack(cli);
+    rate_untrack(cli);
+    /* Closing the socket also takes it out of the epoll set. */
+    client_close(cli);
+    client_destroy(cli);
+}
+
+void epoll_flush_dirty(shard_t *sh) {
+    while (sh->dirty_head) {
+        client_t *cli = sh->dirty_head;
+        dirty_unlink(cli);
+        if (client_drain(cli) < 0) {
+            epoll_close_client(cli, 1);
+        }
+    }
+}
+
+/* Handles newly received input; returns -1 if the handshake failed and the connection should close. */
+int client_consume_input(client_t *cli) {
+    if (!cli->registered) {
+        if (client_handshake(cli) < 0) {
+            return -1;
+        }
+        if (!cli->registered) {
+            return 0;
+        }
+    }
+    process_input(cli);
+    return 0;
+}
+
+void epoll_read_client(client_t *cli) {
+    ssize_t nbytes = client_recv(cli);
+    if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (nbytes <= 0) {
+        if (!cli->registered && nbytes == 0) {
+            log_msg(LOG_WARN, "Failed to get client name or client disconnected.");
+        }
+        epoll_close_client(cli, nbytes != 0);
+        return;
+    }
+
+    if (client_consume_input(cli) < 0) {
+        epoll_close_client(cli, 0);
+    }
+}
+
+/* Returns -1 if the write failed and the client has been closed. */
+int epoll_write_client(client_t *cli) {
+    if (client_drain(cli) < 0) {
+        epoll_close_client(cli, 1);
+        return -1;
+    }
+    return 0;
+}
+
+void shard_drain_inbox(shard_t *sh) {
+    uint64_t count;
+    while (read(sh->wake_fd, &count, sizeof(count)) > 0) {
+    }
+
+    shard_msg_t *m = atomic_exchange_explicit(&sh->inbox, NULL, memory_order_acquire);
+    shard_msg_t *fifo = NULL;
+    while (m) {
+        shard_msg_t *next = m->next;
+        m->next = fifo;
+        fifo = m;
+        m = next;
+    }
+
+    while (fifo) {
+        shard_msg_t *next = fifo->next;
+        if (fifo->kind == SHARD_BROADCAST) {
+            /* The read section keeps room_leave() from freeing the room mid-delivery. */
+            rcu_read_lock();
+            pthread_mutex_lock(&rooms_mutex);
+            room_t *room = room_dir_find(&rooms, fifo->target);
+            pthread_mutex_unlock(&rooms_mutex);
+            if (room) {
+                room_deliver_local(room, sh->id, NULL, fifo->msg);
+            }
+            rcu_read_unlock();
+        } else if (fifo->kind == SHARD_PRESENCE) {
+            presence_deliver_local(sh, fifo->msg);
+        } else {
+            rcu_read_lock();
+            client_t *recipient = client_lookup(fifo->target);
+            if (recipient && recipient->shard != sh) {
+                /* The name reconnected on another shard since the post. */
+                shard_post(recipient->shard, SHARD_PM, fifo->msg, fifo->target);
+            } else if (recipient) {
+                msg_buf_t *out = msg_for(recipient, fifo->msg);
+                if (out) {
+                    client_send_msg(recipient, out);
+                }
+            }
+            rcu_read_unlock();
+            if (!recipient) {
+                log_msg(LOG_WARN, "PM recipient '%s' left before delivery.", fifo->target);
+            }
+        }
+        msg_unref(fifo->msg);
+        pool_free(fifo);
+        fifo = next;
+    }
+}
+
+/*
+ * Handles a failed accept(). Out of descriptors, the connection stays queued and the listener
+ * stays readable, so the loop would spin; the spare descriptor reserved at startup is given up
+ * for a moment to accept and close whatever is waiting. Errors are logged at most once a second.
+ */
+void accept_failed(int listen_fd, int err) {
+    if (err == EMFILE || err == ENFILE) {
+        unsigned long refused = 0;
+        pthread_mutex_lock(&spare_mutex);
+        if (spare_fd >= 0) {
+            close(spare_fd);
+        }
+        struct pollfd p = {listen_fd, POLLIN, 0};
+        int fd;
+        while (poll(&p, 1, 0) > 0 && (fd = accept(listen_fd, NULL, NULL)) >= 0) {
+            close(fd);
+            refused++;
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        pthread_mutex_unlock(&spare_mutex);
+        atomic_fetch_add_explicit(&stat_accept_refused, refused, memory_order_relaxed);
+    }
+    uint64_t now = monotonic_ms();
+    uint64_t last = atomic_load_explicit(&accept_error_logged_ms, memory_order_relaxed);
+    if (now - last >= 1000 && atomic_compare_exchange_strong(&accept_error_logged_ms, &last, now)) {
+        log_msg(LOG_ERROR, "Accept failed: %s (%lu connections refused so far).", strerror(err),
+                atomic_load(&stat_accept_refused));
+    }
+}
+
+void epoll_accept_clients(shard_t *sh) {
+    while (1) {
+        struct sockaddr_in cli_addr;
+        socklen_t cli_len = sizeof(cli_addr);
+        int client_sock = accept4(sh->listen_fd, (struct sockaddr *)&cli_addr, &cli_len, SOCK_NONBLOCK);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                accept_failed(sh->listen_fd, errno);
+            }
+            return;
+        }
+
+        client_t *cli = client_create(client_sock, &cli_addr);
+        if (!cli) {
+            log_msg(alloc_failure_level(), "Client allocation failed, closing the new connection.");
+            close(client_sock);
+            continue;
+        }
+        cli->shard = sh;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = cli;
+        if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            log_msg(LOG_ERROR, "Shard %d cannot watch a new connection: %s", sh->id, strerror(errno));
+            close(client_sock);
+            client_destroy(cli);
+            continue;
+        }
+        handshake_track(cli);
+    }
+}
+
+int shard_watch(shard_t *sh, int fd, void *tag) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = tag;
+    return epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void *run_epoll_loop(void *arg) {
+    shard_t *sh = arg;
+
+    int flags = fcntl(sh->listen_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sh->listen_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl(O_NONBLOCK) failed");
+        return NULL;
+    }
+    if (shard_watch(sh, sh->listen_fd, NULL) < 0 || shard_watch(sh, sh->wake_fd, sh) < 0) {
+        perror("epoll_ctl(ADD) failed for shard");
+        return NULL;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    current_shard = sh;
+    client_t *adopted;
+    while ((adopted = upgrade_take_adopted(sh)) != NULL) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = adopted;
+        if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, adopted->sockfd, &ev) < 0) {
+            log_msg(LOG_ERROR, "Cannot watch adopted client %s: %s", adopted->name, strerror(errno));
+            epoll_close_client(adopted, 1);
+            continue;
+        }
+        if (!adopted->registered) {
+            handshake_track(adopted);
+        }
+        if (client_consume_input(adopted) < 0) {
+            epoll_close_client(adopted, 0);
+        } else if (adopted->out_count > 0) {
+            dirty_link(adopted);
+        }
+    }
+    epoll_flush_dirty(sh);
+    while (1) {
+        int wait_ms;
+        client_t *late;
+        while ((late = handshake_expired(sh, &wait_ms)) != NULL) {
+            epoll_close_client(late, 0);
+        }
+        /* Resumed clients may pause again, so scan until none is due; that also sets the wait for them. */
+        client_t *ready;
+        while ((ready = rate_take_due(sh, &wait_ms)) != NULL) {
+            while (ready) {
+                client_t *next = ready->rate->paused_next;
+                rate_resume(ready);
+                if (client_consume_input(ready) < 0) {
+                    epoll_close_client(ready, 0);
+                }
+                ready = next;
+            }
+            epoll_flush_dirty(sh);
+        }
+        int n = epoll_wait(sh->epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERROR, "Shard %d epoll_wait failed: %s", sh->id, strerror(errno));
+            return NULL;
+        }
+        for (int i = 0; i < n; ++i) {
+            void *tag = events[i].data.ptr;
+            if (!tag) {
+                epoll_accept_clients(sh);
+                continue;
+            }
+            if (tag == sh) {
+                shard_drain_inbox(sh);
+                continue;
+            }
+            client_t *cli = tag;
+            if ((events[i].events & EPOLLOUT) && epoll_write_client(cli) < 0) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                epoll_read_client(cli);
+            }
+        }
+        epoll_flush_dirty(sh);
+        if (atomic_load(&upgrading)) {
+            upgrade_park(NULL);
+        }
+    }
+}
+
+#ifdef USE_IO_URING
+/*
+ * io_uring backend (--mode uring, built with -DUSE_IO_URING). Each shard owns a ring, driven
+ * with the raw system calls so there is no library dependency. Accept and receive are
+ * multishot; received data lands in a ring of provided buffers and is copied into the
+ * client's input buffer. Client sockets are entered in a sparse registered-file table,
+ * indexed by fd. Sends for every dirty client are prepared as SENDMSG entries and
+ * submitted together with the wait for the next completions, in one io_uring_enter().
+ */
+typedef struct uring_send {
+    struct msghdr mh;
+    struct iovec iov[FLUSH_IOV_MAX];
+} uring_send_t;
+
+typedef struct uring {
+    int fd;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    unsigned buf_tail;
+    char *bufs;
+    unsigned file_count;
+    struct __kernel_timespec timer;
+    int timer_armed;
+    uint64_t timer_at;
+    uint64_t accept_resume_ms;
+    unsigned inflight;
+    int quiescing;
+} uring_t;
+
+enum {
+    URING_ACCEPT,
+    URING_WAKE,
+    URING_RECV,
+    URING_SEND,
+    URING_TIMER,
+    URING_CANCEL
+};
+#define URING_TAG_MASK 7u
+
+uint64_t uring_data(void *ptr, unsigned tag) {
+    return (uint64_t)(uintptr_t)ptr | tag;
+}
+
+int uring_register(uring_t *r, unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, r->fd, op, arg, nr);
+}
+
+/* Submits everything prepared so far and, if wait is set, blocks for at least one completion. */
+int uring_submit(uring_t *r, int wait) {
+    atomic_store_explicit(r->sq_tail, r->sq_local_tail, memory_order_release);
+    unsigned pending = r->sq_local_tail - atomic_load_explicit(r->sq_head, memory_order_acquire);
+    while (1) {
+        int rc = (int)syscall(__NR_io_uring_enter, r->fd, pending, wait ? 1 : 0,
+                              wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc >= 0 || errno == EBUSY || errno == EAGAIN) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *r) {
+    if (r->sq_local_tail - atomic_load_explicit(r->sq_head, memory_order_acquire) == r->sq_entries) {
+        uring_submit(r, 0);
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    r->sq_local_tail++;
+    r->inflight++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring_set_file(struct io_uring_sqe *sqe, const client_t *cli) {
+    sqe->fd = cli->sockfd;
+    if (cli->fixed_file) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+/* Points table slot fd at file (-1 clears it); returns 1 on success. */
+int uring_update_file(uring_t *r, int fd, int file) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = (unsigned)fd;
+    up.fds = (uint64_t)(uintptr_t)&file;
+    return uring_register(r, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+void uring_recycle(uring_t *r, unsigned bid) {
+    struct io_uring_buf *b = &r->buf_ring->bufs[r->buf_tail & (URING_BUFFERS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * URING_BUFFER_SIZE);
+    b->len = URING_BUFFER_SIZE;
+    b->bid = (uint16_t)bid;
+    r->buf_tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&r->buf_ring->tail, (uint16_t)r->buf_tail, memory_order_release);
+}
+
+int uring_setup(uring_t *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        /* Kernels before 6.1 lack single-issuer and deferred task work. */
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (r->fd < 0) {
+        perror("io_uring_setup failed");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring mode needs Linux 6.0 or later.\n");
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        perror("mmap io_uring failed");
+        return -1;
+    }
+    r->sq_head = (_Atomic unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (_Atomic unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    /* Submission slots map one-to-one onto SQEs, so the index array is filled once. */
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+        array[i] = i;
+    }
+    r->cq_head = (_Atomic unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (_Atomic unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    r->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->bufs = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (r->buf_ring == MAP_FAILED || !r->bufs) {
+        perror("malloc failed for io_uring buffers");
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring provided buffer ring registration failed");
+        return -1;
+    }
+    for (unsigned i = 0; i < URING_BUFFERS; ++i) {
+        uring_recycle(r, i);
+    }
+
+    struct rlimit rl;
+    r->file_count = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < URING_MAX_FILES
+                    ? (unsigned)rl.rlim_cur : URING_MAX_FILES;
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = r->file_count;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (uring_register(r, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+        perror("io_uring file table registration failed, using plain fds");
+        r->file_count = 0;
+    }
+    return 0;
+}
+
+void uring_arm_accept(shard_t *sh) {
+    if (sh->ring->quiescing) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(sh->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sh->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_data(sh, URING_ACCEPT);
+}
+
+void uring_arm_wake(shard_t *sh) {
+    if (sh->ring->quiescing) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(sh->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sh->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_data(sh, URING_WAKE);
+}
+
+/* Wakes the loop when the oldest pending handshake is due. */
+void uring_arm_timer(shard_t *sh, int wait_ms) {
+    uring_t *r = sh->ring;
+    r->timer.tv_sec = wait_ms / 1000;
+    r->timer.tv_nsec = (wait_ms % 1000) * 1000000L;
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&r->timer;
+    sqe->len = 1;
+    sqe->user_data = uring_data(sh, URING_TIMER);
+    r->timer_armed = 1;
+    r->timer_at = monotonic_ms() + wait_ms;
+}
+
+void uring_arm_recv(client_t *cli) {
+    if (cli->shard->ring->quiescing) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(cli->shard->ring);
+    sqe->opcode = IORING_OP_RECV;
+    uring_set_file(sqe, cli);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uring_data(cli, URING_RECV);
+    cli->uring_ops++;
+}
+
+void uring_arm_send(client_t *cli) {
+    if (cli->shard->ring->quiescing) {
+        return;
+    }
+    uring_send_t *send = cli->send;
+    if (!send && (send = cli->send = conn_alloc(sizeof(uring_send_t), 0)) == NULL) {
+        log_msg(LOG_ERROR, "Client %s send state allocation failed.", cli->name);
+        return;
+    }
+    size_t total;
+    pthread_mutex_lock(&cli->out_mutex);
+    size_t n_iov = out_queue_iov(cli, send->iov, &total);
+    cli->out_inflight = n_iov;
+    pthread_mutex_unlock(&cli->out_mutex);
+    if (n_iov == 0) {
+        return;
+    }
+
+    memset(&send->mh, 0, sizeof(send->mh));
+    send->mh.msg_iov = send->iov;
+    send->mh.msg_iovlen = n_iov;
+    struct io_uring_sqe *sqe = uring_sqe(cli->shard->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    uring_set_file(sqe, cli);
+    sqe->addr = (uint64_t)(uintptr_t)&send->mh;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_data(cli, URING_SEND);
+    cli->uring_ops++;
+}
+
+/* Frees a closed client once the kernel has no more operations referring to it. */
+void uring_release_client(client_t *cli) {
+    if (cli->fixed_file) {
+        uring_update_file(cli->shard->ring, cli->sockfd, -1);
+    }
+    client_close(cli);
+    conn_free(cli->send);
+    client_destroy(cli);
+}
+
+/*
+ * shutdown() ends the outstanding receive and fails any send; the client is freed once the last
+ * of those completions has been handled.
+ */
+void uring_close_client(client_t *cli, int error) {
+    if (cli->closing) {
+        return;
+    }
+    cli->closing = 1;
+    if (cli->registered) {
+        client_leave(cli, error);
+    }
+    dirty_unlink(cli);
+    handshake_untrack(cli);
+    rate_untrack(cli);
+    shutdown(cli->sockfd, SHUT_RDWR);
+}
+
+void uring_attach_client(client_t *cli) {
+    uring_t *r = cli->shard->ring;
+    if ((unsigned)cli->sockfd < r->file_count && uring_update_file(r, cli->sockfd, cli->sockfd) == 1) {
+        cli->fixed_file = 1;
+    }
+    uring_arm_recv(cli);
+}
+
+void uring_accept_client(shard_t *sh, int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0) {
+        memset(&addr, 0, sizeof(addr));
+    }
+    client_t *cli = client_create(fd, &addr);
+    if (!cli) {
+        log_msg(alloc_failure_level(), "Client allocation failed, closing the new connection.");
+        close(fd);
+        return;
+    }
+    cli->shard = sh;
+    uring_attach_client(cli);
+    handshake_track(cli);
+}
+
+/* Feeds received bytes through the same handshake and line handling as the other modes. */
+/* A paused client's multishot receive is cancelled, so the kernel stops reading for it. */
+void uring_hold_recv(client_t *cli) {
+    if (cli->closing || !cli->rate || !cli->rate->resume_ms || cli->rate->recv_state != RECV_ARMED) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(cli->shard->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_data(cli, URING_RECV);
+    sqe->user_data = uring_data(cli->shard, URING_CANCEL);
+    cli->rate->recv_state = RECV_CANCELLING;
+    uring_submit(cli->shard->ring, 0);
+}
+
+void uring_feed(client_t *cli, const char *data, size_t len) {
+    atomic_fetch_add_explicit(&stat_bytes_in, len, memory_order_relaxed);
+    while (len > 0 && !cli->closing) {
+        size_t room = in_buf_reserve(&cli->in);
+        if (room == 0) {
+            errno = ENOMEM;
+            uring_close_client(cli, 1);
+            return;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(cli->in.data + cli->in.tail, data, n);
+        cli->in.tail += n;
+        data += n;
+        len -= n;
+        if (client_consume_input(cli) < 0) {
+            uring_close_client(cli, 0);
+        }
+    }
+    uring_hold_recv(cli);
+}
+
+void uring_complete(shard_t *sh, struct io_uring_cqe *cqe) {
+    uring_t *r = sh->ring;
+    unsigned tag = cqe->user_data & URING_TAG_MASK;
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    int res = cqe->res;
+
+    if (!more) {
+        r->inflight--;
+    }
+    if (tag == URING_ACCEPT) {
+        if (res >= 0) {
+            uring_accept_client(sh, res);
+        } else if (res != -ECONNABORTED && res != -EINTR && res != -ECANCELED) {
+            accept_failed(sh->listen_fd, -res);
+        }
+        /* The kernel takes a descriptor before it waits, so without one a new accept fails at once. */
+        if (!more && (res == -EMFILE || res == -ENFILE)) {
+            r->accept_resume_ms = monotonic_ms() + ACCEPT_BACKOFF_MS;
+        } else if (!more) {
+            uring_arm_accept(sh);
+        }
+        return;
+    }
+    if (tag == URING_TIMER) {
+        r->timer_armed = 0;
+        return;
+    }
+    if (tag == URING_CANCEL) {
+        return;
+    }
+    if (tag == URING_WAKE) {
+        shard_drain_inbox(sh);
+        if (!more) {
+            uring_arm_wake(sh);
+        }
+        return;
+    }
+
+    client_t *cli = ptr;
+    if (tag == URING_RECV) {
+        if (!more) {
+            cli->uring_ops--;
+        }
+        if (res > 0) {
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (!cli->closing) {
+                uring_feed(cli, r->bufs + (size_t)bid * URING_BUFFER_SIZE, (size_t)res);
+            }
+            uring_recycle(r, bid);
+        } else if (res != -ENOBUFS && res != -ECANCELED && !cli->closing) {
+            if (res < 0) {
+                errno = -res;
+            } else if (!cli->registered) {
+                log_msg(LOG_WARN, "Failed to get client name or client disconnected.");
+            }
+            uring_close_client(cli, res != 0);
+        }
+        /* Multishot receive stops when the buffer ring runs dry or a pause cancels it; start it again
+         * unless the client is still paused. */
+        if (!more && !cli->closing && cli->rate && cli->rate->resume_ms) {
+            cli->rate->recv_state = RECV_STOPPED;
+        } else if (!more && !cli->closing) {
+            uring_arm_recv(cli);
+            if (cli->rate) {
+                cli->rate->recv_state = RECV_ARMED;
+            }
+        }
+    } else {
+        cli->uring_ops--;
+        pthread_mutex_lock(&cli->out_mutex);
+        cli->out_inflight = 0;
+        if (res > 0) {
+            out_queue_consume(cli, (size_t)res);
+        }
+        if (cli->out_count == 0) {
+            /* Only clients with something to send keep send state. */
+            conn_free(cli->send);
+            cli->send = NULL;
+        }
+        pthread_mutex_unlock(&cli->out_mutex);
+        if (res < 0 && res != -EAGAIN && res != -EINTR && res != -ECANCELED && !cli->closing) {
+            errno = -res;
+            atomic_fetch_add_explicit(&stat_send_errors, 1, memory_order_relaxed);
+            uring_close_client(cli, 1);
+        } else if (!cli->closing && cli->out_count > 0) {
+            uring_arm_send(cli);
+        }
+    }
+    if (cli->closing && cli->uring_ops == 0) {
+        uring_release_client(cli);
+    }
+}
+
+/*
+ * Before an upgrade parks the shard, every request is cancelled and reaped, so the kernel reads
+ * nothing more from its sockets and no send is left half done. Data that already arrived is
+ * handled as usual.
+ */
+void uring_quiesce(shard_t *sh) {
+    uring_t *r = sh->ring;
+    r->quiescing = 1;
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = uring_data(sh, URING_CANCEL);
+    while (r->inflight > 0) {
+        if (uring_submit(r, 1) < 0 && errno != EINTR) {
+            log_msg(LOG_ERROR, "Shard %d: io_uring_enter failed while quiescing: %s", sh->id, strerror(errno));
+            return;
+        }
+        unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+        while (head != tail) {
+            struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+            atomic_store_explicit(r->cq_head, ++head, memory_order_release);
+            uring_complete(sh, &cqe);
+        }
+    }
+}
+
+void uring_rearm_client(client_t *cli) {
+    if (cli->closing) {
+        return;
+    }
+    if (cli->rate && cli->rate->resume_ms) {
+        cli->rate->recv_state = RECV_STOPPED;
+    } else {
+        uring_arm_recv(cli);
+        if (cli->rate) {
+            cli->rate->recv_state = RECV_ARMED;
+        }
+    }
+    if (cli->out_count > 0) {
+        dirty_link(cli);
+    }
+}
+
+/* Undoes uring_quiesce() when an upgrade is abandoned. */
+void uring_resume(shard_t *sh) {
+    sh->ring->quiescing = 0;
+    sh->ring->accept_resume_ms = 0;
+    uring_arm_accept(sh);
+    uring_arm_wake(sh);
+    pthread_mutex_lock(&clients_mutex);
+    for (size_t i = 0; i < clients.count; ++i) {
+        if (clients.items[i]->shard == sh) {
+            uring_rearm_client(clients.items[i]);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    for (client_t *cli = sh->handshake_head; cli; cli = cli->handshake_next) {
+        uring_rearm_client(cli);
+    }
+}
+
+void *run_uring_loop(void *arg) {
+    shard_t *sh = arg;
+    sh->ring = calloc(1, sizeof(uring_t));
+    if (!sh->ring || uring_setup(sh->ring) < 0) {
+        fprintf(stderr, "Shard %d could not set up io_uring.\n", sh->id);
+        return NULL;
+    }
+    uring_t *r = sh->ring;
+    current_shard = sh;
+    uring_arm_accept(sh);
+    uring_arm_wake(sh);
+    client_t *adopted;
+    while ((adopted = upgrade_take_adopted(sh)) != NULL) {
+        uring_attach_client(adopted);
+        if (!adopted->registered) {
+            handshake_track(adopted);
+        }
+        if (client_consume_input(adopted) < 0) {
+            uring_close_client(adopted, 0);
+            continue;
+        }
+        uring_hold_recv(adopted);
+        if (adopted->out_count > 0) {
+            dirty_link(adopted);
+        }
+    }
+    while (1) {
+        int wait_ms;
+        client_t *late;
+        while ((late = handshake_expired(sh, &wait_ms)) != NULL) {
+            uring_close_client(late, 0);
+        }
+        client_t *ready;
+        while ((ready = rate_take_due(sh, &wait_ms)) != NULL) {
+            while (ready) {
+                client_t *next = ready->rate->paused_next;
+                rate_resume(ready);
+                if (client_consume_input(ready) < 0) {
+                    uring_close_client(ready, 0);
+                }
+                /* Only read more once the buffered lines have all gone through. */
+                if (!ready->closing && !ready->rate->resume_ms && ready->rate->recv_state == RECV_STOPPED) {
+                    uring_arm_recv(ready);
+                    ready->rate->recv_state = RECV_ARMED;
+                }
+                uring_hold_recv(ready);
+                ready = next;
+            }
+        }
+        if (r->accept_resume_ms) {
+            uint64_t now = monotonic_ms();
+            if (now >= r->accept_resume_ms) {
+                r->accept_resume_ms = 0;
+                uring_arm_accept(sh);
+            } else if (wait_ms < 0 || r->accept_resume_ms - now < (uint64_t)wait_ms) {
+                wait_ms = (int)(r->accept_resume_ms - now);
+            }
+        }
+        if (wait_ms >= 0 && (!r->timer_armed || monotonic_ms() + wait_ms < r->timer_at)) {
+            uring_arm_timer(sh, wait_ms);
+        }
+        while (sh->dirty_head) {
+            client_t *cli = sh->dirty_head;
+            dirty_unlink(cli);
+            if (cli->out_inflight == 0 && !cli->closing) {
+                uring_arm_send(cli);
+            }
+        }
+        if (uring_submit(r, 1) < 0) {
+            log_msg(LOG_ERROR, "Shard %d io_uring_enter failed: %s", sh->id, strerror(errno));
+            return NULL;
+        }
+        unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+        while (head != tail) {
+            struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+            atomic_store_explicit(r->cq_head, ++head, memory_order_release);
+            uring_complete(sh, &cqe);
+        }
+        if (atomic_load(&upgrading)) {
+            uring_quiesce(sh);
+            upgrade_park(NULL);
+            uring_resume(sh);
+        }
+    }
+}
+#endif
+
+void thread_spawn_client(client_t *cli, pthread_attr_t *attr) {
+    pthread_t tid;
+    atomic_fetch_add(&client_threads, 1);
+    int err = pthread_create(&tid, attr, handle_client, cli);
+    if (err != 0) {
+        log_msg(LOG_ERROR, "Cannot start a thread for a new connection: %s", strerror(err));
+        if (cli->registered) {
+            remove_client(cli->sockfd);
+        }
+        client_close(cli);
+        client_destroy(cli);
+        client_thread_exit();
+    }
+}
+
+/* Accepts every pending connection per wakeup and hands each one straight to its own thread. */
+void run_thread_loop(int server_sock) {
+    int flags = fcntl(server_sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(server_sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl(O_NONBLOCK) failed");
+        return;
+    }
+    /* A client thread needs far less than the default 8 MB stack. */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE) != 0) {
+        perror("pthread_attr_setstacksize failed");
+    }
+    client_t *adopted;
+    while ((adopted = upgrade_take_adopted(&shards[0])) != NULL) {
+        thread_spawn_client(adopted, &attr);
+    }
+    struct pollfd pfds[2] = {{server_sock, POLLIN, 0}, {upgrade_wake_fd, POLLIN, 0}};
+    while (1) {
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+            log_msg(LOG_ERROR, "Accept loop poll failed: %s", strerror(errno));
+            return;
+        }
+        if (pfds[1].revents & POLLIN) {
+            upgrade_park(NULL);
+            continue;
+        }
+        while (1) {
+            struct sockaddr_in cli_addr;
+            socklen_t cli_len = sizeof(cli_addr);
+            int client_sock = accept4(server_sock, (struct sockaddr *)&cli_addr, &cli_len, SOCK_NONBLOCK);
+            if (client_sock < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    accept_failed(server_sock, errno);
+                }
+                break;
+            }
+
+            client_t *cli = client_create(client_sock, &cli_addr);
+            if (!cli) {
+                log_msg(alloc_failure_level(), "Client allocation failed, closing the new connection.");
+                close(client_sock);
+                continue;
+            }
+            cli->shard = &shards[0];
+            thread_spawn_client(cli, &attr);
+        }
+    }
+}
+
+int open_listener(int port, int reuse_port) {
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("socket creation failed");
+        return -1;
+    }
+
+    int opt = 1;
+    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEADDR) failed");
+    }
+    if (reuse_port && setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(server_sock);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind failed");
+        close(server_sock);
+        return -1;
+    }
+
+    if (listen(server_sock, listen_backlog) < 0) {
+        perror("listen failed");
+        close(server_sock);
+        return -1;
+    }
+    return server_sock;
+}
+
+/* Sends one handover record, with fd (unless -1) attached to its first byte. */
+int upgrade_send(int sock, const unsigned char *record, size_t len, int fd) {
+    struct iovec iov = {(void *)record, len};
+    struct msghdr mh;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        mh.msg_control = ctl.buf;
+        mh.msg_controllen = sizeof(ctl.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while (iov.iov_len > 0) {
+        ssize_t n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        mh.msg_control = NULL;
+        mh.msg_controllen = 0;
+        iov.iov_base = (char *)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+    return 0;
+}
+
+int upgrade_send_op(int sock, uint8_t op, uint32_t index, int fd) {
+    unsigned char record[FRAME_HEADER_LEN + 4];
+    frame_writer_t w;
+    frame_begin(&w, record, sizeof(record), op);
+    frame_put_u32(&w, index);
+    return upgrade_send(sock, record, frame_end(&w), fd);
+}
+
+/* Reads one record; an attached socket ends up in its fd (-1 if none). NULL at EOF or on error. */
+upgrade_record_t *upgrade_recv(int sock) {
+    unsigned char header[FRAME_HEADER_LEN];
+    size_t got = 0;
+    int fd = -1;
+    while (got < sizeof(header)) {
+        struct iovec iov = {header + got, sizeof(header) - got};
+        struct msghdr mh;
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctl.buf;
+        mh.msg_controllen = sizeof(ctl.buf);
+        ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return NULL;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && fd < 0) {
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        got += n;
+    }
+
+    uint32_t len = frame_get_be32(header);
+    upgrade_record_t *rec = len <= UPGRADE_MAX_RECORD ? malloc(sizeof(upgrade_record_t) + len) : NULL;
+    if (!rec) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    rec->next = NULL;
+    rec->op = header[4];
+    rec->fd = fd;
+    rec->len = len;
+    for (got = 0; got < len;) {
+        ssize_t n = recv(sock, rec->data + got, len - got, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            free(rec);
+            return NULL;
+        }
+        got += n;
+    }
+    return rec;
+}
+
+/* Takes a listener the previous process handed over; -1 if there is none (a normal start). */
+int upgrade_take_fd(uint8_t op, uint32_t index) {
+    for (upgrade_record_t *rec = upgrade_records; rec; rec = rec->next) {
+        if (rec->op == op && rec->fd >= 0 && rec->len >= 4 && frame_get_be32(rec->data) == index) {
+            int fd = rec->fd;
+            rec->fd = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+link_t *link_graveyard;
+
+int remote_grow(void) {
+    size_t cap = remote_cap ? remote_cap * 2 : REMOTE_INITIAL;
+    remote_user_t **table = calloc(cap, sizeof(remote_user_t *));
+    if (!table) {
+        return -1;
+    }
+    for (size_t i = 0; i < remote_cap; ++i) {
+        remote_user_t *u = remote_users[i];
+        while (u) {
+            remote_user_t *next = u->next;
+            size_t slot = hash_name(u->name) & (cap - 1);
+            u->next = table[slot];
+            table[slot] = u;
+            u = next;
+        }
+    }
+    free(remote_users);
+    remote_users = table;
+    remote_cap = cap;
+    return 0;
+}
+
+/* A name already in use here or on another node keeps its first owner; the newcomer is not listed. */
+void remote_user_add(link_t *l, const char *name) {
+    rcu_read_lock();
+    int local = client_lookup(name) != NULL;
+    rcu_read_unlock();
+    pthread_mutex_lock(&remote_mutex);
+    remote_user_t *u = local ? NULL : remote_find(name);
+    if (local || u) {
+        if (!u || u->link != l) {
+            log_msg(LOG_WARN, "Node %s announced %s, who is already on %s; keeping the existing user.", l->node,
+                    name, local ? "this node" : u->node);
+        }
+        pthread_mutex_unlock(&remote_mutex);
+        return;
+    }
+    if (remote_count >= remote_cap && remote_grow() < 0) {
+        pthread_mutex_unlock(&remote_mutex);
+        log_msg(LOG_ERROR, "Remote user table allocation failed, not listing %s.", name);
+        return;
+    }
+    u = pool_alloc(sizeof(remote_user_t), 0);
+    if (!u) {
+        pthread_mutex_unlock(&remote_mutex);
+        log_msg(LOG_ERROR, "Remote user allocation failed, not listing %s.", name);
+        return;
+    }
+    u->link = l;
+    strcpy(u->name, name);
+    strcpy(u->node, l->node);
+    size_t slot = remote_slot(name);
+    u->next = remote_users[slot];
+    remote_users[slot] = u;
+    remote_count++;
+    pthread_mutex_unlock(&remote_mutex);
+    presence_invalidate();
+    presence_notify(name, 0, l->node, 1);
+}
+
+void remote_user_remove(link_t *l, const char *name) {
+    int found = 0;
+    pthread_mutex_lock(&remote_mutex);
+    for (remote_user_t **pp = remote_cap ? &remote_users[remote_slot(name)] : NULL; pp && *pp; pp = &(*pp)->next) {
+        if ((*pp)->link == l && strcmp((*pp)->name, name) == 0) {
+            remote_user_t *u = *pp;
+            *pp = u->next;
+            pool_free(u);
+            remote_count--;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&remote_mutex);
+    if (found) {
+        presence_invalidate();
+        presence_notify(name, 0, l->node, 0);
+    }
+}
+
+/* Drops every user announced over l; returns how many there were. Watchers are told after remote_mutex is released. */
+int remote_forget(link_t *l) {
+    int n = 0;
+    remote_user_t *gone = NULL;
+    pthread_mutex_lock(&remote_mutex);
+    for (size_t i = 0; i < remote_cap; ++i) {
+        remote_user_t **pp = &remote_users[i];
+        while (*pp) {
+            if ((*pp)->link == l) {
+                remote_user_t *u = *pp;
+                *pp = u->next;
+                u->next = gone;
+                gone = u;
+                ++n;
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+    remote_count -= n;
+    pthread_mutex_unlock(&remote_mutex);
+    if (n > 0) {
+        presence_invalidate();
+    }
+    while (gone) {
+        remote_user_t *u = gone;
+        gone = u->next;
+        presence_notify(u->name, 0, u->node, 0);
+        pool_free(u);
+    }
+    return n;
+}
+
+/* The links list is only changed by the link thread, so it reads it without links_mutex. */
+link_t *link_find_up(const char *node) {
+    for (link_t *l = links; l; l = l->next) {
+        if (l->up && strcmp(l->node, node) == 0) {
+            return l;
+        }
+    }
+    return NULL;
+}
+
+/* Writes what the socket takes and watches for writability while anything is left. */
+int link_flush(link_t *l) {
+    pthread_mutex_lock(&l->mutex);
+    while (l->out_off < l->out_len) {
+        ssize_t n = send(l->fd, l->out + l->out_off, l->out_len - l->out_off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0) {
+            pthread_mutex_unlock(&l->mutex);
+            return -1;
+        }
+        l->out_off += n;
+    }
+    if (l->congested && l->out_len - l->out_off < LINK_LOW_WATER) {
+        l->congested = 0;
+        atomic_fetch_sub(&links_congested, 1);
+        log_msg(LOG_INFO, "Link to %s caught up; resuming local senders.", l->node);
+    }
+    int pending = l->out_off < l->out_len;
+    if (!pending && l->out_cap > 65536) {
+        /* Presence bursts can be large; do not keep that much around once it has gone out. */
+        pool_free(l->out);
+        l->out = NULL;
+        l->out_cap = l->out_len = l->out_off = 0;
+    }
+    pthread_mutex_unlock(&l->mutex);
+    if (pending != l->want_write) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+        ev.data.ptr = l;
+        if (epoll_ctl(link_epoll_fd, EPOLL_CTL_MOD, l->fd, &ev) < 0) {
+            log_msg(LOG_ERROR, "Link epoll_ctl(MOD) failed: %s", strerror(errno));
+        }
+        l->want_write = pending;
+    }
+    return 0;
+}
+
+/* Unpublishes l at once; the memory is freed after the current batch of events. */
+void link_close(link_t *l, const char *reason) {
+    int forgotten = remote_forget(l);
+    pthread_mutex_lock(&l->mutex);
+    if (l->congested) {
+        l->congested = 0;
+        atomic_fetch_sub(&links_congested, 1);
+    }
+    pthread_mutex_unlock(&l->mutex);
+    pthread_mutex_lock(&links_mutex);
+    for (link_t **pp = &links; *pp; pp = &(*pp)->next) {
+        if (*pp == l) {
+            *pp = l->next;
+            break;
+        }
+    }
+    if (l->up) {
+        atomic_fetch_sub(&links_up, 1);
+    }
+    pthread_mutex_unlock(&links_mutex);
+
+    if (l->up) {
+        log_msg(LOG_INFO, "Link to node %s closed (%s); %d remote users removed.", l->node, reason, forgotten);
+    } else if (l->peer < 0 || !peers[l->peer].failing) {
+        log_msg(LOG_WARN, "Link %s closed (%s).", l->node, reason);
+    }
+    if (l->peer >= 0) {
+        peer_t *p = &peers[l->peer];
+        p->link = NULL;
+        p->next_dial = monotonic_ms() + LINK_RETRY_MS;
+        p->failing = !l->up;
+    }
+    close(l->fd);
+    l->fd = -1;
+    l->next = link_graveyard;
+    link_graveyard = l;
+}
+
+void link_free_closed(void) {
+    while (link_graveyard) {
+        link_t *l = link_graveyard;
+        link_graveyard = l->next;
+        in_buf_release(&l->in);
+        pool_free(l->out);
+        pthread_mutex_destroy(&l->mutex);
+        free(l);
+    }
+}
+
+/* Queues a LINK_JOIN for every local user. Holding clients_mutex means no join or leave slips between the two. */
+void link_up(link_t *l) {
+    size_t sent = 0;
+    pthread_mutex_lock(&clients_mutex);
+    pthread_mutex_lock(&links_mutex);
+    pthread_mutex_lock(&l->mutex);
+    l->up = 1;
+    atomic_fetch_add(&links_up, 1);
+    for (size_t i = 0; i < clients.count; ++i) {
+        unsigned char frame[FRAME_HEADER_LEN + 2 * NAME_LEN];
+        frame_writer_t w;
+        frame_begin(&w, frame, sizeof(frame), LINK_JOIN);
+        frame_put_name(&w, node_name);
+        frame_put_name(&w, clients.items[i]->name);
+        link_queue_locked(l, frame, frame_end(&w));
+        ++sent;
+    }
+    pthread_mutex_unlock(&l->mutex);
+    pthread_mutex_unlock(&links_mutex);
+    pthread_mutex_unlock(&clients_mutex);
+    log_msg(LOG_INFO, "Link to node %s is up; announced %zu local users.", l->node, sent);
+    if (link_flush(l) < 0) {
+        link_close(l, strerror(errno));
+    }
+}
+
+void link_hello(link_t *l, const char *node) {
+    if (l->peer >= 0) {
+        strcpy(peers[l->peer].node, node);
+        peers[l->peer].failing = 0;
+    }
+    if (strcmp(node, node_name) == 0) {
+        link_close(l, "this is a link to ourselves");
+        return;
+    }
+    strcpy(l->node, node);
+    link_t *other = link_find_up(node);
+    if (other) {
+        /* Both nodes dialled each other. Each side keeps the link dialled by the smaller node name. */
+        int ours_wins = strcmp(node_name, node) < 0;
+        if ((l->peer >= 0) == ours_wins && (other->peer >= 0) != ours_wins) {
+            link_close(other, "duplicate link");
+        } else {
+            link_close(l, "duplicate link");
+            return;
+        }
+    }
+    link_up(l);
+}
+
+void link_deliver_say(const char *room_name, const char *sender_name, const char *text, int keep_history) {
+    /* The read section keeps room_leave() from freeing the room mid-delivery. */
+    rcu_read_lock();
+    pthread_mutex_lock(&rooms_mutex);
+    room_t *room = room_dir_find(&rooms, room_name);
+    pthread_mutex_unlock(&rooms_mutex);
+    if (room) {
+        room_broadcast(room, NULL, sender_name, text, keep_history);
+    }
+    rcu_read_unlock();
+}
+
+/* Like send_private_message(), but never forwards: the recipient is either here or gone. */
+void link_deliver_pm(const char *origin, const char *sender_name, const char *recipient_name, const char *text) {
+    int queued = -1;
+    rcu_read_lock();
+    client_t *recipient = client_lookup(recipient_name);
+    if (!recipient && mailbox_dir) {
+        pthread_mutex_t *mail_lock = mailbox_lock(recipient_name);
+        pthread_mutex_lock(mail_lock);
+        pthread_mutex_lock(&clients_mutex);
+        recipient = registry_find_name(&clients, recipient_name);
+        pthread_mutex_unlock(&clients_mutex);
+        if (!recipient) {
+            queued = mail_queue(MAIL_STORE, recipient_name, 0, sender_name, origin, text);
+        }
+        pthread_mutex_unlock(mail_lock);
+    }
+    if (recipient) {
+        deliver_private(recipient, NULL, sender_name, text);
+    }
+    rcu_read_unlock();
+    if (queued < 0 && !recipient) {
+        log_msg(LOG_WARN, "PM from %s on %s dropped: %s is not on this node.", sender_name, origin, recipient_name);
+    }
+}
+
+void link_handle_frame(link_t *l, uint8_t op, const unsigned char *payload, size_t len) {
+    frame_reader_t r = {payload, len, 0};
+    char origin[NAME_LEN], name[NAME_LEN], target[NAME_LEN];
+    char text[BUFFER_SIZE + 1];
+    frame_get_name(&r, origin);
+    if (r.error || origin[0] == '\0') {
+        link_close(l, "malformed frame");
+        return;
+    }
+    if (op == LINK_HELLO && !l->up) {
+        link_hello(l, origin);
+        return;
+    }
+    if (!l->up || op == LINK_HELLO) {
+        link_close(l, "protocol error");
+        return;
+    }
+    if (strcmp(origin, l->node) != 0) {
+        /* Nodes only send their own events, so anything else is being relayed and could loop. */
+        log_msg(LOG_WARN, "Link to %s: dropping a relayed frame from %s.", l->node, origin);
+        return;
+    }
+    switch (op) {
+    case LINK_JOIN:
+        frame_get_name(&r, name);
+        if (!r.error) {
+            remote_user_add(l, name);
+        }
+        break;
+    case LINK_PART:
+        frame_get_name(&r, name);
+        if (!r.error) {
+            remote_user_remove(l, name);
+        }
+        break;
+    case LINK_SAY:
+        frame_get_name(&r, target);
+        frame_get_name(&r, name);
+        if (r.len < 1) {
+            r.error = 1;
+        }
+        if (!r.error) {
+            int keep_history = r.p[0];
+            r.p++;
+            r.len--;
+            frame_get_text(&r, text, sizeof(text));
+            link_deliver_say(target, name, text, keep_history);
+        }
+        break;
+    case LINK_PM:
+        frame_get_name(&r, name);
+        frame_get_name(&r, target);
+        if (!r.error) {
+            frame_get_text(&r, text, sizeof(text));
+            link_deliver_pm(l->node, name, target, text);
+        }
+        break;
+    default:
+        log_msg(LOG_WARN, "Link to %s: ignoring unknown opcode 0x%02x.", l->node, op);
+        break;
+    }
+    if (r.error) {
+        link_close(l, "malformed frame");
+    }
+}
+
+void link_read(link_t *l) {
+    in_buf_t *in = &l->in;
+    while (l->fd >= 0) {
+        size_t room = in_buf_reserve(in);
+        if (room == 0) {
+            link_close(l, "input buffer allocation failed");
+            return;
+        }
+        ssize_t n = recv(l->fd, in->data + in->tail, room, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            link_close(l, n == 0 ? "closed by peer" : strerror(errno));
+            return;
+        }
+        in->tail += n;
+        while (l->fd >= 0 && in->tail - in->head >= FRAME_HEADER_LEN) {
+            const unsigned char *p = (const unsigned char *)in->data + in->head;
+            uint32_t len = frame_get_be32(p);
+            if (len > LINK_MAX_PAYLOAD) {
+                link_close(l, "oversized frame");
+                return;
+            }
+            if (in->tail - in->head < FRAME_HEADER_LEN + len) {
+                break;
+            }
+            in->head += FRAME_HEADER_LEN + len;
+            atomic_fetch_add_explicit(&stat_link_frames_in, 1, memory_order_relaxed);
+            link_handle_frame(l, p[4], p + FRAME_HEADER_LEN, len);
+        }
+    }
+    if (l->fd >= 0 && in->head == in->tail) {
+        in_buf_release(in);
+    }
+}
+
+/* label names the link in the log until the peer's HELLO tells us its node name. */
+link_t *link_create(int fd, int peer, int connecting, const char *label) {
+    link_t *l = calloc(1, sizeof(link_t));
+    if (!l) {
+        log_msg(LOG_ERROR, "Link allocation failed: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    l->fd = fd;
+    l->peer = peer;
+    l->connecting = connecting;
+    l->want_write = connecting;
+    snprintf(l->node, sizeof(l->node), "%s", label);
+    pthread_mutex_init(&l->mutex, NULL);
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (connecting ? EPOLLOUT : 0);
+    ev.data.ptr = l;
+    if (epoll_ctl(link_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_msg(LOG_ERROR, "Link epoll_ctl(ADD) failed: %s", strerror(errno));
+        close(fd);
+        pthread_mutex_destroy(&l->mutex);
+        free(l);
+        return NULL;
+    }
+    unsigned char frame[FRAME_HEADER_LEN + NAME_LEN];
+    frame_writer_t w;
+    frame_begin(&w, frame, sizeof(frame), LINK_HELLO);
+    frame_put_name(&w, node_name);
+    pthread_mutex_lock(&l->mutex);
+    link_queue_locked(l, frame, frame_end(&w));
+    pthread_mutex_unlock(&l->mutex);
+
+    pthread_mutex_lock(&links_mutex);
+    l->next = links;
+    links = l;
+    pthread_mutex_unlock(&links_mutex);
+    if (!connecting && link_flush(l) < 0) {
+        link_close(l, strerror(errno));
+        return NULL;
+    }
+    return l;
+}
+
+void link_accept(void) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(link_listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_msg(LOG_ERROR, "Link accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+        char label[NAME_LEN];
+        snprintf(label, sizeof(label), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        log_msg(LOG_INFO, "Link connection from %s.", label);
+        link_create(fd, -1, 0, label);
+    }
+}
+
+void link_dial(int index) {
+    peer_t *p = &peers[index];
+    struct sockaddr_in addr;
+    char label[NAME_LEN];
+    snprintf(label, sizeof(label), "%s:%d", p->host, p->port);
+    p->next_dial = monotonic_ms() + LINK_RETRY_MS;
+    if (resolve_server(p->host, p->port, &addr) < 0) {
+        if (!p->failing) {
+            log_msg(LOG_WARN, "Cannot resolve peer %s; retrying.", label);
+        }
+        p->failing = 1;
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_msg(LOG_ERROR, "Link socket failed: %s", strerror(errno));
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        if (!p->failing) {
+            log_msg(LOG_WARN, "Cannot connect to peer %s: %s; retrying.", label, strerror(errno));
+        }
+        p->failing = 1;
+        close(fd);
+        return;
+    }
+    p->link = link_create(fd, index, 1, label);
+}
+
+void link_connected(link_t *l) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) {
+        err = errno;
+    }
+    if (err) {
+        link_close(l, strerror(err));
+        return;
+    }
+    l->connecting = 0;
+    if (link_flush(l) < 0) {
+        link_close(l, strerror(errno));
+    }
+}
+
+/* Sends what other threads queued, and resets links that fell too far behind. */
+void link_drain_wake(void) {
+    uint64_t count;
+    while (read(link_wake_fd, &count, sizeof(count)) > 0) {
+    }
+    link_t *next;
+    for (link_t *l = links; l; l = next) {
+        next = l->next;
+        pthread_mutex_lock(&l->mutex);
+        int overflow = l->overflow;
+        pthread_mutex_unlock(&l->mutex);
+        if (overflow) {
+            atomic_fetch_add(&stat_link_resets, 1);
+            link_close(l, "fell too far behind");
+        } else if (l->up && !l->want_write && link_flush(l) < 0) {
+            link_close(l, strerror(errno));
+        }
+    }
+}
+
+/* Peers are dialled until they answer, unless their node is already linked the other way. */
+int link_dial_due(uint64_t now) {
+    int wait_ms = -1;
+    for (int i = 0; i < peer_count; ++i) {
+        peer_t *p = &peers[i];
+        if (p->link || strcmp(p->node, node_name) == 0 || (p->node[0] && link_find_up(p->node))) {
+            continue;
+        }
+        if (now >= p->next_dial) {
+            link_dial(i);
+        }
+        if (!p->link) {
+            int left = p->next_dial > now ? (int)(p->next_dial - now) : 0;
+            if (wait_ms < 0 || left < wait_ms) {
+                wait_ms = left;
+            }
+        }
+    }
+    return wait_ms;
+}
+
+void *link_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int wait_ms = link_dial_due(monotonic_ms());
+        int n = epoll_wait(link_epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERROR, "Link epoll_wait failed: %s", strerror(errno));
+            return NULL;
+        }
+        for (int i = 0; i < n; ++i) {
+            void *tag = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if (tag == &link_listen_fd) {
+                link_accept();
+                continue;
+            }
+            if (tag == &link_wake_fd) {
+                link_drain_wake();
+                continue;
+            }
+            link_t *l = tag;
+            if (l->fd < 0) {
+                continue;
+            }
+            if (l->connecting) {
+                link_connected(l);
+            } else if ((ev & EPOLLOUT) && link_flush(l) < 0) {
+                link_close(l, strerror(errno));
+            }
+            if (l->fd >= 0 && (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                link_read(l);
+            }
+        }
+        link_free_closed();
+        if (atomic_load(&upgrading)) {
+            /* The new process links up again itself; peers must not see this node twice. */
+            while (links) {
+                link_close(links, "server upgrade");
+            }
+            link_free_closed();
+            upgrade_park(NULL);
+        }
+    }
+}
+
+/* Federation is off unless --link-port or --peer is given. Links are not authenticated. */
+int link_start(int port) {
+    if (link_port == 0 && peer_count == 0) {
+        return 0;
+    }
+    if (node_name[0] == '\0') {
+        char host[NAME_LEN] = "node";
+        gethostname(host, sizeof(host) - 1);
+        snprintf(node_name, sizeof(node_name), "%.24s:%d", host, port);
+    }
+    link_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    link_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (link_epoll_fd < 0 || link_wake_fd < 0) {
+        log_msg(LOG_ERROR, "Link setup failed: %s", strerror(errno));
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &link_wake_fd;
+    if (epoll_ctl(link_epoll_fd, EPOLL_CTL_ADD, link_wake_fd, &ev) < 0) {
+        log_msg(LOG_ERROR, "Link epoll_ctl(ADD) failed: %s", strerror(errno));
+        return -1;
+    }
+    if (link_port > 0) {
+        link_listen_fd = upgrade_take_fd(UPGRADE_LINK_LISTENER, 0);
+        if (link_listen_fd < 0) {
+            link_listen_fd = open_listener(link_port, 0);
+        }
+        if (link_listen_fd < 0) {
+            return -1;
+        }
+        fcntl(link_listen_fd, F_SETFL, fcntl(link_listen_fd, F_GETFL) | O_NONBLOCK);
+        ev.data.ptr = &link_listen_fd;
+        if (epoll_ctl(link_epoll_fd, EPOLL_CTL_ADD, link_listen_fd, &ev) < 0) {
+            log_msg(LOG_ERROR, "Link epoll_ctl(ADD) failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, link_thread, NULL);
+    if (err != 0) {
+        log_msg(LOG_ERROR, "Link thread creation failed: %s", strerror(err));
+        return -1;
+    }
+    pthread_detach(tid);
+    if (link_port > 0) {
+        log_msg(LOG_INFO, "Node %s accepting links on port %d, %d peers to dial.", node_name, link_port, peer_count);
+    } else {
+        log_msg(LOG_INFO, "Node %s, %d peers to dial.", node_name, peer_count);
+    }
+    return 0;
+}
+
+/* Answers one scrape: any GET for / or /metrics gets the exposition, everything else a 404. */
+void serve_metrics(int fd) {
+    char req[1024];
+    size_t req_len = 0;
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (req_len < sizeof(req) - 1) {
+        ssize_t n = recv(fd, req + req_len, sizeof(req) - 1 - req_len, 0);
+        if (n <= 0) {
+            break;
+        }
+        req_len += n;
+        req[req_len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    req[req_len] = '\0';
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *f = open_memstream(&body, &body_len);
+    if (!f) {
+        return;
+    }
+    const char *status = "200 OK";
+    if (strncmp(req, "GET / ", 6) == 0 || strncmp(req, "GET /metrics ", 13) == 0) {
+        write_metrics(f);
+    } else {
+        status = "404 Not Found";
+        fprintf(f, "Not found.\n");
+    }
+    fclose(f);
+
+    char header[160];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_len);
+    struct iovec iov[2] = {{header, header_len}, {body, body_len}};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) < 0) {
+        log_msg(LOG_WARN, "Metrics send failed: %s", strerror(errno));
+    }
+    free(body);
+}
+
+void *metrics_thread(void *arg) {
+    struct pollfd *pfds = arg;
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERROR, "Metrics poll failed: %s", strerror(errno));
+            return NULL;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (pfds[i].fd < 0 || !(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            int fd = accept(pfds[i].fd, NULL, NULL);
+            if (fd < 0) {
+                log_msg(LOG_ERROR, "Metrics accept failed: %s", strerror(errno));
+                continue;
+            }
+            serve_metrics(fd);
+            close(fd);
+        }
+    }
+}
+
+/* Opens the scrape endpoints: loopback TCP on --metrics-port and/or a unix socket at --metrics-socket. */
+int metrics_start(void) {
+    static struct pollfd pfds[2] = {{-1, POLLIN, 0}, {-1, POLLIN, 0}};
+    if (metrics_port > 0 && (metrics_fds[0] = upgrade_take_fd(UPGRADE_METRICS, 0)) < 0) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int opt = 1;
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(metrics_port);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+            perror("metrics listener failed");
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        metrics_fds[0] = fd;
+    }
+    if (metrics_path && (metrics_fds[1] = upgrade_take_fd(UPGRADE_METRICS, 1)) < 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(metrics_path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Metrics socket path is too long.\n");
+            return -1;
+        }
+        strcpy(addr.sun_path, metrics_path);
+        unlink(metrics_path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+            perror("metrics socket failed");
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        metrics_fds[1] = fd;
+    }
+    pfds[0].fd = metrics_fds[0];
+    pfds[1].fd = metrics_fds[1];
+    if (pfds[0].fd < 0 && pfds[1].fd < 0) {
+        return 0;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, metrics_thread, pfds) != 0) {
+        perror("pthread_create failed for metrics");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int shard_init(shard_t *sh, int id, int port) {
+    memset(sh, 0, sizeof(shard_t));
+    sh->id = id;
+    sh->epoll_fd = -1;
+    sh->wake_fd = -1;
+    atomic_init(&sh->inbox, NULL);
+
+    sh->listen_fd = upgrade_take_fd(UPGRADE_LISTENER, id);
+    if (sh->listen_fd < 0) {
+        sh->listen_fd = open_listener(port, shard_count > 1);
+    }
+    if (sh->listen_fd < 0) {
+        return -1;
+    }
+    if (server_mode == MODE_THREADS) {
+        return 0;
+    }
+    if (server_mode == MODE_EPOLL) {
+        sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    sh->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((server_mode == MODE_EPOLL && sh->epoll_fd < 0) || sh->wake_fd < 0) {
+        perror("shard setup failed");
+        return -1;
+    }
+    return 0;
+}
+
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("setrlimit(RLIMIT_NOFILE) failed");
+        }
+    }
+}
+
+/* The acceptor and every client thread, or every shard, plus the link thread. */
+int upgrade_expected(void) {
+    int loops = server_mode == MODE_THREADS ? 1 + atomic_load(&client_threads) : shard_count;
+    return loops + (link_epoll_fd >= 0);
+}
+
+/* Messages posted to a parked shard are delivered to its clients' queues, so they are handed over too. */
+void upgrade_drain_inboxes(void) {
+    int pending = 1;
+    while (pending) {
+        pending = 0;
+        for (int i = 0; i < shard_count; ++i) {
+            if (atomic_load(&shards[i].inbox) != NULL) {
+                current_shard = &shards[i];
+                shard_drain_inbox(&shards[i]);
+                pending = 1;
+            }
+        }
+    }
+    current_shard = NULL;
+}
+
+/* Sends cli with its unread input and unsent output; returns 1 if sent, 0 if it was closing anyway. */
+int upgrade_send_client(int sock, client_t *cli) {
+    if (cli->detached || cli->slow_disconnect || cli->closing) {
+        return 0;
+    }
+    pthread_mutex_lock(&cli->out_mutex);
+    size_t in_len = cli->in.tail - cli->in.head;
+    size_t out_len = 0;
+    for (size_t i = 0; i < cli->out_count; ++i) {
+        out_len += cli->out_q[(cli->out_head + i) % cli->out_cap]->len - (i == 0 ? cli->out_off : 0);
+    }
+    size_t cap = FRAME_HEADER_LEN + 8 + 2 * NAME_LEN + in_len + out_len;
+    unsigned char *record = malloc(cap);
+    if (!record) {
+        pthread_mutex_unlock(&cli->out_mutex);
+        return -1;
+    }
+    frame_writer_t w;
+    frame_begin(&w, record, cap, UPGRADE_CLIENT);
+    frame_put_u32(&w, (cli->registered ? UPGRADE_CLIENT_REGISTERED : 0) | (cli->binary ? UPGRADE_CLIENT_BINARY : 0) |
+                          (cli->subscribed ? UPGRADE_CLIENT_SUBSCRIBED : 0));
+    frame_put_name(&w, cli->registered ? cli->name : "");
+    frame_put_name(&w, cli->room ? cli->room->name : "");
+    frame_put_u32(&w, (uint32_t)in_len);
+    frame_put_bytes(&w, cli->in.data + cli->in.head, in_len);
+    for (size_t i = 0; i < cli->out_count; ++i) {
+        msg_buf_t *msg = cli->out_q[(cli->out_head + i) % cli->out_cap];
+        size_t skip = i == 0 ? cli->out_off : 0;
+        frame_put_bytes(&w, msg->data + skip, msg->len - skip);
+    }
+    pthread_mutex_unlock(&cli->out_mutex);
+    int rc = upgrade_send(sock, record, frame_end(&w), cli->sockfd);
+    free(record);
+    return rc < 0 ? -1 : 1;
+}
+
+int upgrade_send_delay(int sock, uint32_t index) {
+    delay_timer_t *t = &timer_pool[index];
+    size_t cap = FRAME_HEADER_LEN + 20 + 2 * NAME_LEN + strlen(t->message);
+    unsigned char *record = malloc(cap);
+    if (!record) {
+        return -1;
+    }
+    frame_writer_t w;
+    frame_begin(&w, record, cap, UPGRADE_DELAY);
+    frame_put_u32(&w, index);
+    frame_put_u32(&w, t->gen);
+    frame_put_u32(&w, (uint32_t)(t->expires >> 32));
+    frame_put_u32(&w, (uint32_t)t->expires);
+    frame_put_u32(&w, (uint32_t)t->delay);
+    frame_put_name(&w, t->sender_name);
+    frame_put_name(&w, t->recipient_name);
+    frame_put_bytes(&w, t->message, strlen(t->message));
+    int rc = upgrade_send(sock, record, frame_end(&w), -1);
+    free(record);
+    return rc;
+}
+
+/* Called with every loop parked and sched_mutex held, so nothing below can change under us. */
+int upgrade_send_state(int sock, size_t *client_count, size_t *delay_count) {
+    int rc = 0;
+    for (int i = 0; i < shard_count && rc == 0; ++i) {
+        rc = upgrade_send_op(sock, UPGRADE_LISTENER, i, shards[i].listen_fd);
+    }
+    for (int i = 0; i < 2 && rc == 0; ++i) {
+        if (metrics_fds[i] >= 0) {
+            rc = upgrade_send_op(sock, UPGRADE_METRICS, i, metrics_fds[i]);
+        }
+    }
+    if (rc == 0 && link_listen_fd >= 0) {
+        rc = upgrade_send_op(sock, UPGRADE_LINK_LISTENER, 0, link_listen_fd);
+    }
+
+    *client_count = 0;
+    pthread_mutex_lock(&clients_mutex);
+    for (size_t i = 0; i < clients.count && rc >= 0; ++i) {
+        if ((rc = upgrade_send_client(sock, clients.items[i])) > 0) {
+            ++*client_count;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    for (int i = 0; i < shard_count && rc >= 0; ++i) {
+        client_t *cli = server_mode == MODE_THREADS ? upgrade_handshakes : shards[i].handshake_head;
+        for (; cli && rc >= 0; cli = cli->handshake_next) {
+            if ((rc = upgrade_send_client(sock, cli)) > 0) {
+                ++*client_count;
+            }
+        }
+    }
+
+    *delay_count = 0;
+    for (uint32_t i = 0; i < timer_pool_used && rc >= 0; ++i) {
+        if (timer_pool[i].state == TIMER_PENDING && (rc = upgrade_send_delay(sock, i)) == 0) {
+            ++*delay_count;
+        }
+    }
+    if (rc < 0 || upgrade_send_op(sock, UPGRADE_DONE, 0, -1) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Waits up to UPGRADE_TIMEOUT_MS for the new process to send op. */
+int upgrade_expect(int sock, uint8_t op) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, UPGRADE_TIMEOUT_MS) <= 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    upgrade_record_t *rec = upgrade_recv(sock);
+    int rc = rec && rec->op == op ? 0 : -1;
+    if (rec && rec->fd >= 0) {
+        close(rec->fd);
+    }
+    free(rec);
+    if (rc < 0) {
+        errno = EPROTO;
+    }
+    return rc;
+}
+
+/*
+ * SIGUSR2: starts the binary again and, once it is up, parks every loop and hands it the
+ * listeners, the clients and the pending delays. This process exits when the new one confirms;
+ * if anything fails before that, it unparks and carries on serving.
+ */
+void upgrade_run(void) {
+    uint64_t start = monotonic_ms();
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        log_msg(LOG_ERROR, "Upgrade failed: socketpair: %s", strerror(errno));
+        return;
+    }
+    char env[16];
+    snprintf(env, sizeof(env), "%d", sv[1]);
+    setenv(UPGRADE_ENV, env, 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Only the handover socket reaches the new binary; everything else comes over it. */
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        fcntl(sv[1], F_SETFD, 0);
+        execvp(upgrade_argv[0], upgrade_argv);
+        _exit(127);
+    }
+    unsetenv(UPGRADE_ENV);
+    close(sv[1]);
+    if (pid < 0) {
+        log_msg(LOG_ERROR, "Upgrade failed: fork: %s", strerror(errno));
+        close(sv[0]);
+        return;
+    }
+    log_msg(LOG_INFO, "Upgrade: started %s as pid %d.", upgrade_argv[0], (int)pid);
+
+    const char *failure = "the new process did not start";
+    if (upgrade_expect(sv[0], UPGRADE_READY) == 0) {
+        uint64_t frozen_at = monotonic_ms();
+        pthread_mutex_lock(&upgrade_mutex);
+        atomic_store(&upgrading, 1);
+        uint64_t one = 1;
+        if (write(upgrade_wake_fd, &one, sizeof(one)) < 0) {
+            log_msg(LOG_ERROR, "Upgrade eventfd write failed: %s", strerror(errno));
+        }
+        for (int i = 0; i < shard_count; ++i) {
+            if (shards[i].wake_fd >= 0 && write(shards[i].wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                log_msg(LOG_ERROR, "Shard %d eventfd write failed: %s", i, strerror(errno));
+            }
+        }
+        if (link_wake_fd >= 0) {
+            link_wake();
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += UPGRADE_TIMEOUT_MS / 1000;
+        while (upgrade_parked < upgrade_expected() &&
+               pthread_cond_timedwait(&upgrade_cond, &upgrade_mutex, &deadline) != ETIMEDOUT) {
+        }
+        int parked = upgrade_parked >= upgrade_expected();
+        pthread_mutex_unlock(&upgrade_mutex);
+
+        failure = "not every loop stopped";
+        if (parked) {
+            size_t client_count, delay_count;
+            pthread_mutex_lock(&sched_mutex);
+            while (sched_firing) {
+                pthread_cond_wait(&sched_idle, &sched_mutex);
+            }
+            mail_wait_idle();
+            upgrade_drain_inboxes();
+            failure = "the handover was not confirmed";
+            if (upgrade_send_state(sv[0], &client_count, &delay_count) == 0 && upgrade_expect(sv[0], UPGRADE_ACK) == 0) {
+                log_msg(LOG_INFO, "Upgrade: handed %zu clients and %zu delayed messages to pid %d "
+                        "(%lu ms, %lu ms frozen).", client_count, delay_count, (int)pid,
+                        (unsigned long)(monotonic_ms() - start), (unsigned long)(monotonic_ms() - frozen_at));
+                log_drain();
+                _exit(0);
+            }
+            pthread_mutex_unlock(&sched_mutex);
+        }
+    }
+
+    log_msg(LOG_ERROR, "Upgrade failed (%s); carrying on.", failure);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+    pthread_mutex_lock(&upgrade_mutex);
+    upgrade_handshakes = NULL;
+    atomic_store(&upgrading, 0);
+    uint64_t count;
+    while (read(upgrade_wake_fd, &count, sizeof(count)) > 0) {
+    }
+    pthread_cond_broadcast(&upgrade_cond);
+    pthread_mutex_unlock(&upgrade_mutex);
+}
+
+void *upgrade_thread(void *arg) {
+    sigset_t *signals = arg;
+    while (1) {
+        int sig;
+        if (sigwait(signals, &sig) == 0) {
+            upgrade_run();
+        }
+    }
+    return NULL;
+}
+
+/* SIGUSR2 is blocked in every thread from the start of main(); this thread takes it. */
+int upgrade_start(sigset_t *signals) {
+    upgrade_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (upgrade_wake_fd < 0) {
+        perror("upgrade eventfd failed");
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, upgrade_thread, signals) != 0) {
+        perror("pthread_create failed for upgrades");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/* In a process started by upgrade_run(): says we are ready and reads the whole handover. */
+int upgrade_receive(const char *env) {
+    long fd = parse_long_arg(env, 0, INT_MAX);
+    unsetenv(UPGRADE_ENV);
+    if (fd < 0) {
+        return -1;
+    }
+    upgrade_fd = (int)fd;
+    fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+    if (upgrade_send_op(upgrade_fd, UPGRADE_READY, 0, -1) < 0) {
+        return -1;
+    }
+    upgrade_record_t **tail = &upgrade_records;
+    while (1) {
+        upgrade_record_t *rec = upgrade_recv(upgrade_fd);
+        if (!rec) {
+            return -1;
+        }
+        if (rec->op == UPGRADE_DONE) {
+            free(rec);
+            return 0;
+        }
+        *tail = rec;
+        tail = &rec->next;
+    }
+}
+
+/* Rebuilds a handed-over client and leaves it on sh for its loop; the socket is closed on failure. */
+int upgrade_adopt_client(upgrade_record_t *rec, shard_t *sh) {
+    frame_reader_t r = {rec->data, rec->len, 0};
+    char name[NAME_LEN], room[NAME_LEN];
+    uint32_t flags = frame_get_u32(&r);
+    frame_get_name(&r, name);
+    frame_get_name(&r, room);
+    uint32_t in_len = frame_get_u32(&r);
+    if (r.error || in_len > r.len) {
+        close(rec->fd);
+        return -1;
+    }
+    const unsigned char *in_data = r.p;
+    const unsigned char *out_data = r.p + in_len;
+    size_t out_len = r.len - in_len;
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(rec->fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        memset(&addr, 0, sizeof(addr));
+    }
+    if (server_mode != MODE_URING) {
+        fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) | O_NONBLOCK);
+    }
+    client_t *cli = client_create(rec->fd, &addr);
+    if (!cli) {
+        close(rec->fd);
+        return -1;
+    }
+    cli->shard = sh;
+    /* The old process may have held more input than a fresh buffer allows. */
+    cli->in.held = 1;
+    int rc = in_buf_append(&cli->in, (const char *)in_data, in_len);
+    cli->in.held = 0;
+    if (rc == 0 && out_len > 0) {
+        msg_buf_t *msg = msg_alloc(out_len);
+        rc = -1;
+        if (msg) {
+            memcpy(msg->data, out_data, out_len);
+            pthread_mutex_lock(&cli->out_mutex);
+            rc = out_queue_push(cli, msg);
+            pthread_mutex_unlock(&cli->out_mutex);
+            msg_unref(msg);
+        }
+    }
+    if (rc == 0 && (flags & UPGRADE_CLIENT_REGISTERED)) {
+        strcpy(cli->name, name);
+        cli->binary = (flags & UPGRADE_CLIENT_BINARY) != 0;
+        if ((rate_state_needed() && (cli->rate = rate_state_create()) == NULL) || add_client(cli) < 0) {
+            rc = -1;
+        } else if (room_enter(cli, room[0] ? room : LOBBY_NAME) < 0 && room_enter(cli, LOBBY_NAME) < 0) {
+            remove_client(cli->sockfd);
+            rc = -1;
+        } else {
+            cli->registered = 1;
+            if ((flags & UPGRADE_CLIENT_SUBSCRIBED) && presence_subscribe(cli) < 0) {
+                log_msg(LOG_WARN, "Could not keep %s watching joins and leaves.", cli->name);
+            }
+        }
+    }
+    if (rc < 0) {
+        log_msg(LOG_WARN, "Could not take over %s (fd %d); closing it.", name[0] ? name : "a connection", cli->sockfd);
+        client_close(cli);
+        client_destroy(cli);
+        return -1;
+    }
+    cli->handshake_next = sh->adopted;
+    sh->adopted = cli;
+    return 0;
+}
+
+/* Puts a handed-over delay back at its old index and generation, so its id still cancels it. */
+int upgrade_restore_delay(const upgrade_record_t *rec) {
+    frame_reader_t r = {rec->data, rec->len, 0};
+    char sender[NAME_LEN], recipient[NAME_LEN];
+    uint32_t index = frame_get_u32(&r);
+    uint32_t gen = frame_get_u32(&r);
+    uint64_t expires = (uint64_t)frame_get_u32(&r) << 32;
+    expires |= frame_get_u32(&r);
+    int delay = (int)frame_get_u32(&r);
+    frame_get_name(&r, sender);
+    frame_get_name(&r, recipient);
+    if (r.error || index >= MAX_PENDING_DELAYS) {
+        return -1;
+    }
+    char *copy = pool_alloc(r.len + 1, 0);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, r.p, r.len);
+    copy[r.len] = '\0';
+
+    pthread_mutex_lock(&sched_mutex);
+    if (index >= timer_pool_cap) {
+        uint32_t new_cap = timer_pool_cap ? timer_pool_cap : 64;
+        while (new_cap <= index) {
+            new_cap *= 2;
+        }
+        delay_timer_t *new_pool = realloc(timer_pool, new_cap * sizeof(delay_timer_t));
+        if (!new_pool) {
+            pthread_mutex_unlock(&sched_mutex);
+            pool_free(copy);
+            return -1;
+        }
+        timer_pool = new_pool;
+        timer_pool_cap = new_cap;
+    }
+    for (; timer_pool_used <= index; ++timer_pool_used) {
+        timer_pool[timer_pool_used].state = TIMER_FREE;
+        timer_pool[timer_pool_used].gen = 0;
+        timer_pool[timer_pool_used].message = NULL;
+    }
+    uint64_t now = current_tick();
+    if (sched_pending == 0 && wheel_tick < now) {
+        wheel_tick = now;
+    }
+    delay_timer_t *t = &timer_pool[index];
+    t->state = TIMER_PENDING;
+    t->gen = gen & ((1u << (32 - TIMER_INDEX_BITS)) - 1);
+    t->delay = delay;
+    t->expires = expires;
+    strcpy(t->sender_name, sender);
+    strcpy(t->recipient_name, recipient);
+    t->message = copy;
+    wheel_link(index);
+    if (sched_pending++ == 0) {
+        pthread_cond_signal(&sched_cond);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return 0;
+}
+
+/* Sets up what upgrade_receive() collected, closes what nobody took and lets the old process go. */
+int upgrade_adopt(void) {
+    size_t client_count = 0, delay_count = 0;
+    int next_shard = 0;
+    while (upgrade_records) {
+        upgrade_record_t *rec = upgrade_records;
+        upgrade_records = rec->next;
+        if (rec->op == UPGRADE_CLIENT && rec->fd >= 0) {
+            /* The shard's loop has not started, so whatever joining queues goes on its dirty list. */
+            current_shard = &shards[next_shard++ % shard_count];
+            if (upgrade_adopt_client(rec, current_shard) == 0) {
+                ++client_count;
+            }
+            current_shard = NULL;
+            rec->fd = -1;
+        } else if (rec->op == UPGRADE_DELAY && upgrade_restore_delay(rec) == 0) {
+            ++delay_count;
+        }
+        if (rec->fd >= 0) {
+            close(rec->fd);
+        }
+        free(rec);
+    }
+    /* Slots between the restored delays are free again. */
+    pthread_mutex_lock(&sched_mutex);
+    timer_free_list = TIMER_NIL;
+    for (uint32_t i = timer_pool_used; i-- > 0;) {
+        if (timer_pool[i].state == TIMER_FREE) {
+            timer_pool[i].next = timer_free_list;
+            timer_free_list = i;
+        }
+    }
+    pthread_mutex_unlock(&sched_mutex);
+
+    log_msg(LOG_INFO, "Took over %zu clients and %zu delayed messages.", client_count, delay_count);
+    int rc = upgrade_send_op(upgrade_fd, UPGRADE_ACK, 0, -1);
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    return rc;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--mode threads|epoll|uring] [--shards N] [--queue-limit N]\n"
+                    "       [--slow-policy drop-oldest|drop-newest|disconnect] [--admin NAME]...\n"
+                    "       [--metrics-port PORT] [--metrics-socket PATH] [--max-line BYTES]\n"
+                    "       [--history DIR] [--replay N] [--mailbox DIR]\n"
+                    "       [--log-level error|warn|info|debug] [--log-sample N] [--no-log-content]\n"
+                    "       [--backlog N] [--handshake-timeout SECONDS] [--mem-limit MB]\n"
+                    "       [--node NAME] [--link-port PORT] [--peer HOST:PORT]...\n"
+                    "       [--rate-limit input|message|pm|list|delay=RATE[:BURST]]... <port>\n"
+                    "Send SIGUSR2 to hand the running server over to a fresh start of the same binary.\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"queue-limit", required_argument, NULL, 'q'},
+        {"slow-policy", required_argument, NULL, 's'},
+        {"shards", required_argument, NULL, 'n'},
+        {"admin", required_argument, NULL, 'a'},
+        {"metrics-port", required_argument, NULL, 'P'},
+        {"metrics-socket", required_argument, NULL, 'S'},
+        {"max-line", required_argument, NULL, 'L'},
+        {"history", required_argument, NULL, 'H'},
+        {"replay", required_argument, NULL, 'R'},
+        {"mailbox", required_argument, NULL, 'M'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"log-sample", required_argument, NULL, 'e'},
+        {"no-log-content", no_argument, NULL, 'c'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"handshake-timeout", required_argument, NULL, 'T'},
+        {"mem-limit", required_argument, NULL, 'X'},
+        {"node", required_argument, NULL, 'N'},
+        {"link-port", required_argument, NULL, 'k'},
+        {"peer", required_argument, NULL, 'p'},
+        {"rate-limit", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt_c;
+    long val;
+    upgrade_argv = argv;
+    while ((opt_c = getopt_long(argc, argv, "m:q:s:n:a:P:S:L:H:R:M:l:e:cb:T:X:N:k:p:r:", long_opts, NULL)) != -1) {
+        switch (opt_c) {
+        case 'm':
+            if (strcmp(optarg, "threads") == 0) {
+                server_mode = MODE_THREADS;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                server_mode = MODE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+#ifdef USE_IO_URING
+                server_mode = MODE_URING;
+#else
+                fprintf(stderr, "This server was built without io_uring support (rebuild with -DUSE_IO_URING).\n");
+                return 1;
+#endif
+            } else {
+                fprintf(stderr, "Unknown mode '%s' (expected threads, epoll or uring).\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q':
+            if ((val = parse_long_arg(optarg, 1, 1000000)) < 0) {
+                fprintf(stderr, "'%s' is not a valid queue limit (1-1000000).\n", optarg);
+                return 1;
+            }
+            queue_limit = (size_t)val;
+            break;
+        case 's':
+            if (strcmp(optarg, "drop-oldest") == 0) {
+                slow_policy = SLOW_DROP_OLDEST;
+            } else if (strcmp(optarg, "drop-newest") == 0) {
+                slow_policy = SLOW_DROP_NEWEST;
+            } else if (strcmp(optarg, "disconnect") == 0) {
+                slow_policy = SLOW_DISCONNECT;
+            } else {
+                fprintf(stderr, "Unknown slow-consumer policy '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            if ((val = parse_long_arg(optarg, 1, 1024)) < 0) {
+                fprintf(stderr, "'%s' is not a valid shard count (1-1024).\n", optarg);
+                return 1;
+            }
+            shard_count = (int)val;
+            break;
+        case 'a': {
+            char **names = realloc(admin_names, (admin_count + 1) * sizeof(char *));
+            if (!names) {
+                perror("malloc failed for admin names");
+                return 1;
+            }
+            admin_names = names;
+            admin_names[admin_count++] = optarg;
+            break;
+        }
+        case 'P':
+            if ((metrics_port = validate_port(optarg)) < 0) {
+                fprintf(stderr, "'%s' is not a valid metrics port (1-65535).\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            metrics_path = optarg;
+            break;
+        case 'L':
+            if ((val = parse_long_arg(optarg, 64, 1 << 20)) < 0) {
+                fprintf(stderr, "'%s' is not a valid line limit (64-1048576).\n", optarg);
+                return 1;
+            }
+            max_line = (size_t)val;
+            break;
+        case 'H':
+            history_dir = optarg;
+            break;
+        case 'R':
+            if ((val = parse_long_arg(optarg, 0, HISTORY_MAX_REPLAY)) < 0) {
+                fprintf(stderr, "'%s' is not a valid replay count (0-%d).\n", optarg, HISTORY_MAX_REPLAY);
+                return 1;
+            }
+            replay_count = (int)val;
+            break;
+        case 'M':
+            mailbox_dir = optarg;
+            break;
+        case 'l':
+            if (strcmp(optarg, "error") == 0) {
+                log_level = LOG_ERROR;
+            } else if (strcmp(optarg, "warn") == 0) {
+                log_level = LOG_WARN;
+            } else if (strcmp(optarg, "info") == 0) {
+                log_level = LOG_INFO;
+            } else if (strcmp(optarg, "debug") == 0) {
+                log_level = LOG_DEBUG;
+            } else {
+                fprintf(stderr, "Unknown log level '%s' (expected error, warn, info or debug).\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if ((val = parse_long_arg(optarg, 0, 1000000)) < 0) {
+                fprintf(stderr, "'%s' is not a valid log sample rate (0-1000000).\n", optarg);
+                return 1;
+            }
+            log_sample = (unsigned long)val;
+            break;
+        case 'c':
+            log_content = 0;
+            break;
+        case 'b':
+            if ((val = parse_long_arg(optarg, 1, 65535)) < 0) {
+                fprintf(stderr, "'%s' is not a valid listen backlog (1-65535).\n", optarg);
+                return 1;
+            }
+            listen_backlog = (int)val;
+            break;
+        case 'T':
+            if ((val = parse_long_arg(optarg, 1, 3600)) < 0) {
+                fprintf(stderr, "'%s' is not a valid handshake timeout (1-3600 seconds).\n", optarg);
+                return 1;
+            }
+            handshake_timeout_ms = (int)val * 1000;
+            break;
+        case 'X':
+            if ((val = parse_long_arg(optarg, 0, 1048576)) < 0) {
+                fprintf(stderr, "'%s' is not a valid memory limit (0-1048576 MB).\n", optarg);
+                return 1;
+            }
+            mem_limit = (size_t)val << 20;
+            break;
+        case 'N':
+            if (check_client_name(optarg) != NULL) {
+                fprintf(stderr, "'%s' is not a valid node name (1-31 characters, no spaces).\n", optarg);
+                return 1;
+            }
+            strcpy(node_name, optarg);
+            break;
+        case 'k':
+            if ((link_port = validate_port(optarg)) < 0) {
+                fprintf(stderr, "'%s' is not a valid link port (1-65535).\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p': {
+            char *colon = strrchr(optarg, ':');
+            int peer_port = colon ? validate_port(colon + 1) : -1;
+            if (!colon || colon == optarg || peer_port < 0) {
+                fprintf(stderr, "'%s' is not a valid peer (expected HOST:PORT).\n", optarg);
+                return 1;
+            }
+            peer_t *list = realloc(peers, (peer_count + 1) * sizeof(peer_t));
+            if (!list) {
+                perror("malloc failed for peers");
+                return 1;
+            }
+            peers = list;
+            memset(&peers[peer_count], 0, sizeof(peer_t));
+            peers[peer_count].host = strndup(optarg, colon - optarg);
+            peers[peer_count].port = peer_port;
+            peer_count++;
+            break;
+        }
+        case 'r': {
+            /* BUCKET=RATE[:BURST]; the burst defaults to one second's worth. */
+            char *eq = strchr(optarg, '=');
+            char *colon = eq ? strchr(eq, ':') : NULL;
+            int cls = -1;
+            for (int c = 0; eq && c < RATE_CLASSES; ++c) {
+                if (strlen(rate_names[c]) == (size_t)(eq - optarg) && strncmp(optarg, rate_names[c], eq - optarg) == 0) {
+                    cls = c;
+                }
+            }
+            if (colon) {
+                *colon = '\0';
+            }
+            long rate = eq ? parse_long_arg(eq + 1, 1, RATE_MAX) : -1;
+            long burst = colon ? parse_long_arg(colon + 1, 1, RATE_MAX) : rate;
+            if (cls < 0 || rate < 0 || burst < 0) {
+                if (colon) {
+                    *colon = ':';
+                }
+                fprintf(stderr, "'%s' is not a valid rate limit (expected input, message, pm, list or delay "
+                                "=RATE[:BURST], 1-%d per second).\n", optarg, RATE_MAX);
+                return 1;
+            }
+            rate_limits[cls].rate = (uint32_t)rate;
+            rate_limits[cls].burst = (uint32_t)burst;
+            rate_limited = 1;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int port = validate_port(argv[optind]);
+    if (port < 0) {
+        fprintf(stderr, "'%s' is not a valid port (1-65535).\n", argv[optind]);
+        return 1;
+    }
+    if (shard_count > 1 && server_mode == MODE_THREADS) {
+        fprintf(stderr, "--shards requires --mode epoll or uring.\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    static sigset_t upgrade_signals;
+    sigemptyset(&upgrade_signals);
+    sigaddset(&upgrade_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &upgrade_signals, NULL);
+    raise_fd_limit();
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pool_init();
+    if (log_start() < 0) {
+        fprintf(stderr, "Failed to start the logging thread.\n");
+        return 1;
+    }
+    if (pthread_key_create(&rcu_key, rcu_reader_release) != 0) {
+        fprintf(stderr, "Failed to set up RCU readers.\n");
+        return 1;
+    }
+    if (scheduler_start() < 0) {
+        fprintf(stderr, "Failed to start the delayed message scheduler.\n");
+        return 1;
+    }
+    const char *upgrade_env = getenv(UPGRADE_ENV);
+    if (upgrade_env && upgrade_receive(upgrade_env) < 0) {
+        fprintf(stderr, "Failed to take over from the running server.\n");
+        return 1;
+    }
+    if (metrics_start() < 0) {
+        return 1;
+    }
+
+    shards = calloc(shard_count, sizeof(shard_t));
+    if (!shards) {
+        perror("malloc failed for shards");
+        return 1;
+    }
+    for (int i = 0; i < shard_count; ++i) {
+        if (shard_init(&shards[i], i, port) < 0) {
+            return 1;
+        }
+    }
+    lobby = room_create(LOBBY_NAME);
+    if (!lobby || room_dir_add(&rooms, lobby) < 0) {
+        perror("malloc failed for lobby");
+        return 1;
+    }
+    if (history_dir && history_open() < 0) {
+        fprintf(stderr, "Failed to open the history in %s.\n", history_dir);
+        return 1;
+    }
+    if (history_dir && history_start() < 0) {
+        perror("pthread_create failed for history");
+        return 1;
+    }
+    if (mailbox_dir && mkdir(mailbox_dir, 0700) < 0 && errno != EEXIST) {
+        perror("mkdir mailbox directory failed");
+        return 1;
+    }
+    for (int i = 0; i < MAILBOX_LOCKS; ++i) {
+        pthread_mutex_init(&mailbox_locks[i], NULL);
+    }
+    if (mailbox_dir && mail_start() < 0) {
+        perror("pthread_create failed for mail");
+        return 1;
+    }
+    if (link_start(port) < 0) {
+        return 1;
+    }
+    if (upgrade_fd >= 0 && upgrade_adopt() < 0) {
+        log_msg(LOG_WARN, "Could not confirm the takeover to the old server: %s", strerror(errno));
+    }
+    if (upgrade_start(&upgrade_signals) < 0) {
+        return 1;
+    }
+
+    const char *mode_name = server_mode == MODE_URING ? "io_uring" : server_mode == MODE_EPOLL ? "epoll" : "threads";
+    if (shard_count > 1) {
+        log_msg(LOG_INFO, "Server listening on port %d (%s mode, %d shards)...", port, mode_name, shard_count);
+    } else {
+        log_msg(LOG_INFO, "Server listening on port %d (%s mode)...", port, mode_name);
+    }
+
+    if (server_mode != MODE_THREADS) {
+        void *(*loop)(void *) = run_epoll_loop;
+#ifdef USE_IO_URING
+        if (server_mode == MODE_URING) {
+            loop = run_uring_loop;
+        }
+#endif
+        for (int i = 1; i < shard_count; ++i) {
+            if (pthread_create(&shards[i].tid, NULL, loop, &shards[i]) != 0) {
+                perror("pthread_create failed for shard");
+                return 1;
+            }
+        }
+        loop(&shards[0]);
+    } else {
+        run_thread_loop(shards[0].listen_fd);
+    }
+
+    for (int i = 0; i < shard_count; ++i) {
+        close(shards[i].listen_fd);
+    }
+    pthread_mutex_destroy(&clients_mutex);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#!/bin/bash
+# Links three nodes on localhost and checks that /list shows the users of the other nodes, that
+# room messages and private messages cross nodes, and that a node's users disappear from the
+# others once it is killed. Arguments go to every server, for example
+#   tests/federation.sh --mode epoll
+. "$(dirname "$0")/lib.sh"
+
+base=${PORT:-23500}
+
+# list_shows CLIENT PATTERN [yes|no] repeats /list until the reply does (or does not) match.
+list_shows() {
+    local i j m want=${3:-yes} found
+    for ((i = 0; i < 50; ++i)); do
+        m=$(mark "$1")
+        say "$1" "/list"
+        for ((j = 0; j < 20; ++j)); do
+            since "$1" "$m" | grep -q "Connected users" && break
+            sleep 0.05
+        done
+        found=no
+        since "$1" "$m" | grep -q -- "$2" && found=yes
+        [ "$found" = "$want" ] && return 0
+    done
+    fail "/list for $1 kept answering $found for '$2'"
+}
+
+build
+start_server a "$@" --node a --link-port $((base + 11)) $((base + 1))
+start_server b "$@" --node b --link-port $((base + 12)) --peer 127.0.0.1:$((base + 11)) $((base + 2))
+start_server c "$@" --node c --peer 127.0.0.1:$((base + 11)) --peer 127.0.0.1:$((base + 12)) $((base + 3))
+for node in a b c; do
+    for peer in a b c; do
+        [ "$node" = "$peer" ] || wait_for "$node.log" "Link to node $peer is up"
+    done
+done
+
+start_client alice $((base + 1))
+start_client bob $((base + 2))
+start_client carol $((base + 3))
+list_shows alice "- bob (on b)"
+list_shows alice "- carol (on c)"
+list_shows carol "- alice (on a)"
+list_shows carol "- bob (on b)"
+
+say alice "hello from a"
+wait_for bob.out "^alice: hello from a"
+wait_for carol.out "^alice: hello from a"
+
+say bob "/pm carol secret from b"
+wait_for carol.out "(PM from bob): secret from b"
+say carol "/pm alice secret from c"
+wait_for alice.out "(PM from carol): secret from c"
+
+say alice "/join dev"
+say carol "/join dev"
+wait_for alice.out "dev"
+wait_for carol.out "dev"
+sleep 0.5
+say alice "only for dev"
+wait_for carol.out "^alice: only for dev"
+sleep 0.5
+! grep -q "only for dev" "$tmp/bob.out" || fail "bob got a message for the dev room"
+for name in bob carol; do
+    [ "$(grep -c '^alice: hello from a' "$tmp/$name.out")" -eq 1 ] || fail "$name got the room message twice"
+done
+
+{ kill -9 "${pid_of[c]}" && wait "${pid_of[c]}"; } 2>/dev/null
+wait_for a.log "Link to node c closed"
+list_shows alice "carol" no
+list_shows bob "carol" no
+list_shows alice "- bob (on b)"
+echo "PASS: three linked nodes share users, room messages and private messages"
@@ -0,0 +1,97 @@
+# Helpers for the test scripts: builds the binaries into a scratch directory, runs servers and
+# clients in the background, and feeds each client through a FIFO so the script can type into
+# it. Set KEEP=1 to keep the scratch directory (logs and client output) after a run.
+
+set -u
+root=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+pids=()
+declare -A pid_of fd_of
+
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    if [ -n "${KEEP:-}" ]; then
+        echo "Output kept in $tmp"
+    else
+        rm -rf "$tmp"
+    fi
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    KEEP=1
+    exit 1
+}
+
+# spawn IN OUT COMMAND... runs COMMAND in the background, without the FIFOs of other clients.
+spawn() {
+    local in=$1 out=$2 fd
+    shift 2
+    (
+        for fd in "${fd_of[@]}"; do
+            exec {fd}>&-
+        done
+        exec stdbuf -oL "$@" < "$in" > "$out" 2>&1
+    ) &
+    pids+=($!)
+}
+
+build() {
+    gcc ${CFLAGS:-} -pthread -o "$tmp/server" "$root/server.c" || fail "server does not build"
+    gcc ${CFLAGS:-} -pthread -o "$tmp/client" "$root/client.c" || fail "client does not build"
+}
+
+# start_server NAME ARGS... logs to $tmp/NAME.log and returns once the server listens.
+start_server() {
+    local name=$1
+    shift
+    spawn /dev/null "$tmp/$name.log" "$tmp/server" "$@"
+    pid_of[$name]=$!
+    wait_for "$name.log" "Server listening"
+}
+
+# start_client NAME PORT [CLIENT OPTIONS...] writes what the client prints to $tmp/NAME.out.
+start_client() {
+    local name=$1 port=$2 fd
+    shift 2
+    mkfifo "$tmp/$name.in"
+    spawn "$tmp/$name.in" "$tmp/$name.out" "$tmp/client" "$@" "$name" 127.0.0.1 "$port"
+    pid_of[$name]=$!
+    exec {fd}> "$tmp/$name.in"
+    fd_of[$name]=$fd
+}
+
+# say NAME LINE types LINE into the client.
+say() {
+    printf '%s\n' "$2" >&"${fd_of[$1]}"
+}
+
+# quit NAME closes the client's input, which makes it leave, and waits for it to exit.
+quit() {
+    local fd=${fd_of[$1]}
+    exec {fd}>&-
+    wait "${pid_of[$1]}" 2>/dev/null
+}
+
+# wait_for FILE PATTERN [SECONDS] waits until FILE (in $tmp) has a line matching PATTERN.
+wait_for() {
+    local i
+    for ((i = 0; i < ${3:-10} * 10; ++i)); do
+        grep -q -- "$2" "$tmp/$1" 2>/dev/null && return 0
+        sleep 0.1
+    done
+    fail "no '$2' in $1"
+}
+
+# mark NAME and since NAME MARK show what a client printed after the mark was taken.
+mark() {
+    wc -l < "$tmp/$1.out"
+}
+
+since() {
+    tail -n +$(($2 + 1)) "$tmp/$1.out"
+}
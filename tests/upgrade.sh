@@ -0,0 +1,58 @@
+#!/bin/bash
+# Upgrades a busy server with SIGUSR2 and checks that clients cannot tell: no connection drops,
+# every message arrives exactly once, and delayed messages scheduled before the upgrade still
+# fire and can still be cancelled by their ids. Arguments go to the server, for example
+#   tests/upgrade.sh --mode epoll --shards 2
+. "$(dirname "$0")/lib.sh"
+
+port=${PORT:-23400}
+count=${COUNT:-2000}
+
+build
+start_server server "$@" "$port"
+start_client tx "$port" --pipe
+start_client text "$port" --pipe
+start_client binary "$port" --pipe --binary
+start_client bob "$port"
+wait_for bob.out "Connected to server"
+sleep 0.5
+
+say bob "/delay 4 bob fires after the upgrade"
+say bob "/delay 60 bob is cancelled after the upgrade"
+wait_for bob.out "scheduled in 60 seconds"
+fire_id=$(sed -n 's/.*scheduled in 4 seconds (id \([0-9]*\)).*/\1/p' "$tmp/bob.out")
+cancel_id=$(sed -n 's/.*scheduled in 60 seconds (id \([0-9]*\)).*/\1/p' "$tmp/bob.out")
+
+for ((i = 1; i <= count; ++i)); do
+    say tx "message $i"
+    if ((i == count / 2)); then
+        kill -USR2 "${pid_of[server]}"
+    fi
+done
+wait_for server.log "Took over"
+new_pid=$(sed -n 's/.*Upgrade: handed .* to pid \([0-9]*\).*/\1/p' "$tmp/server.log")
+[ -n "$new_pid" ] || fail "the old server did not hand over"
+pids+=("$new_pid")
+
+say bob "/delays"
+wait_for bob.out "#$fire_id to bob"
+say bob "/cancel $cancel_id"
+wait_for bob.out "Delayed message $cancel_id cancelled"
+wait_for bob.out "(PM from bob): fires after the upgrade" 5
+sleep 1
+
+for name in tx text binary bob; do
+    kill -0 "${pid_of[$name]}" 2>/dev/null || fail "$name was disconnected"
+done
+for name in text binary bob; do
+    quit "$name"
+    got=$(grep -c '^tx: message ' "$tmp/$name.out")
+    unique=$(grep '^tx: message ' "$tmp/$name.out" | sort -u | wc -l)
+    [ "$got" -eq "$count" ] || fail "$name got $got of $count messages"
+    [ "$unique" -eq "$count" ] || fail "$name got duplicate messages"
+    ! grep -q "Server disconnected" "$tmp/$name.out" || fail "$name was disconnected"
+done
+[ "$(grep -c '(PM from bob): fires after the upgrade' "$tmp/bob.out")" -eq 1 ] || fail "the delayed message fired twice"
+! grep -q "(PM from bob): is cancelled" "$tmp/bob.out" || fail "the cancelled message was delivered"
+quit tx
+echo "PASS: upgraded under load, $count messages delivered once to every client"